@@ -9,6 +9,7 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
+    enable_event_log(1);
     if (init_stub("P2", argv[1], atoi(argv[2])) != 0) {
         fprintf(stderr, "Failed to initialize stub\n");
         return 1;
@@ -0,0 +1,189 @@
+#include "stub.h"
+#include "stub_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* stub_barrier is a dissemination barrier: in round r every member of an
+   N-process group signals the member 2^r ranks ahead and waits for the one
+   2^r ranks behind. After ceil(log2 N) rounds every member has heard,
+   directly or not, from all the others, and no member acts as coordinator
+   or waits for N signals. The signals are frames like any other and take
+   the only links there are: every process has one, TCP or a shared-memory
+   ring, to P2, and none to the others. So P2 relays every signal between
+   two other members, N * ceil(log2 N) frames per barrier at most against
+   2N for a barrier coordinated by P2, but keeps no barrier state: it only
+   forwards frames, and signals to or from P2 are not relayed.
+
+   The argument of a BARRIER frame identifies the round it belongs to:
+     bits 32-63  group key, a hash of the member list
+     bits 4-31   epoch, how many barriers this process ran on the group
+     bits 0-3    round
+   so signals that arrive before their receiver reaches that round, or
+   even that barrier, are kept until it gets there. A process keeps the
+   member list of every key it used and refuses a second group with the
+   same key, so two groups never share round state. */
+#define BARRIER_MAX_ARRIVALS 1024
+#define BARRIER_MAX_GROUPS 64
+#define BARRIER_EPOCH_MASK 0xFFFFFFF
+#define BARRIER_ARGUMENT(key, epoch, round) \
+    (((uint64_t)(key) << 32) | ((uint64_t)((epoch) & BARRIER_EPOCH_MASK) << 4) | (round))
+
+static struct barrier_state {
+    struct arrival {
+        uint64_t argument;
+        int count;
+    } arrivals[BARRIER_MAX_ARRIVALS];
+    int arrival_count;
+    struct group_epoch {
+        uint32_t key;
+        int* ids;
+        int count;
+        unsigned int epoch;
+    } groups[BARRIER_MAX_GROUPS];
+    int group_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t arrived;
+} barrier = {.arrival_count = 0, .group_count = 0,
+             .mutex = PTHREAD_MUTEX_INITIALIZER, .arrived = PTHREAD_COND_INITIALIZER};
+
+/* group_key hashes the member ids in rank order (32-bit FNV-1a). */
+static uint32_t group_key(const int* ids, int count) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < count; i++) {
+        hash = (hash ^ (ids[i] & 0xFF)) * 16777619u;
+        hash = (hash ^ (ids[i] >> 8)) * 16777619u;
+    }
+    return hash;
+}
+
+/* next_epoch returns the epoch of the barrier starting on the group and
+   forgets the signals left over from earlier ones, which only exist if
+   one of them timed out. Fails if another group has the same key. Must
+   be called with barrier.mutex held. */
+static int next_epoch(uint32_t key, const int* ids, int count, unsigned int* epoch) {
+    struct group_epoch* group = NULL;
+    for (int i = 0; i < barrier.group_count; i++) {
+        if (barrier.groups[i].key == key) group = &barrier.groups[i];
+    }
+    if (group != NULL && (group->count != count || memcmp(group->ids, ids, count * sizeof(int)) != 0)) {
+        fprintf(stderr, "barrier: group key %08x already belongs to another group\n", key);
+        return -1;
+    }
+    if (group == NULL) {
+        if (barrier.group_count == BARRIER_MAX_GROUPS) return -1;
+        int* copy = malloc(count * sizeof(int));
+        if (copy == NULL) return -1;
+        memcpy(copy, ids, count * sizeof(int));
+        group = &barrier.groups[barrier.group_count++];
+        group->key = key;
+        group->ids = copy;
+        group->count = count;
+        group->epoch = 0;
+    }
+    *epoch = group->epoch++ & BARRIER_EPOCH_MASK;
+
+    int kept = 0;
+    for (int i = 0; i < barrier.arrival_count; i++) {
+        struct arrival* arrival = &barrier.arrivals[i];
+        unsigned int ahead = ((arrival->argument >> 4) - *epoch) & BARRIER_EPOCH_MASK;
+        if ((arrival->argument >> 32) == key && ahead > BARRIER_EPOCH_MASK / 2) continue;
+        barrier.arrivals[kept++] = *arrival;
+    }
+    barrier.arrival_count = kept;
+    return 0;
+}
+
+/* take_arrival consumes one signal with the given argument, if there is one.
+   Must be called with barrier.mutex held. */
+static int take_arrival(uint64_t argument) {
+    for (int i = 0; i < barrier.arrival_count; i++) {
+        if (barrier.arrivals[i].argument != argument) continue;
+        if (--barrier.arrivals[i].count == 0) {
+            barrier.arrivals[i] = barrier.arrivals[--barrier.arrival_count];
+        }
+        return 1;
+    }
+    return 0;
+}
+
+void barrier_receive(const struct wire_frame* frame) {
+    pthread_mutex_lock(&barrier.mutex);
+    int i = 0;
+    while (i < barrier.arrival_count && barrier.arrivals[i].argument != frame->argument) i++;
+    if (i < barrier.arrival_count) {
+        barrier.arrivals[i].count++;
+    } else if (barrier.arrival_count < BARRIER_MAX_ARRIVALS) {
+        barrier.arrivals[barrier.arrival_count].argument = frame->argument;
+        barrier.arrivals[barrier.arrival_count].count = 1;
+        barrier.arrival_count++;
+    } else {
+        fprintf(stderr, "barrier: too many pending signals, dropping one from P%u\n", frame->source);
+    }
+    pthread_cond_broadcast(&barrier.arrived);
+    pthread_mutex_unlock(&barrier.mutex);
+}
+
+/* stub_barrier blocks until every member of the group has called it, or
+   until timeout_ms milliseconds pass (a negative timeout waits forever).
+   Returns 0 when the barrier completed and -1 on timeout or error. */
+int stub_barrier(const struct stub_group* group, int timeout_ms) {
+    if (group == NULL || group->count <= 0 || group->count > WIRE_MAX_PROCESS_ID) return -1;
+
+    int* ids = malloc(group->count * sizeof(int));
+    if (ids == NULL) return -1;
+    int rank = -1;
+    for (int i = 0; i < group->count; i++) {
+        ids[i] = wire_process_id(group->members[i]);
+        if (ids[i] < 0) {
+            free(ids);
+            return -1;
+        }
+        if (ids[i] == stub_process_id()) rank = i;
+    }
+    if (rank < 0) {
+        free(ids);
+        return -1;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (timeout_ms >= 0) {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    uint32_t key = group_key(ids, group->count);
+    unsigned int epoch;
+    pthread_mutex_lock(&barrier.mutex);
+    int result = next_epoch(key, ids, group->count, &epoch);
+    pthread_mutex_unlock(&barrier.mutex);
+
+    for (int round = 0, distance = 1; result == 0 && distance < group->count; round++, distance *= 2) {
+        uint64_t argument = BARRIER_ARGUMENT(key, epoch, round);
+        if (stub_send_control(ids[(rank + distance) % group->count], WIRE_OP_BARRIER, argument) != 0) {
+            result = -1;
+            break;
+        }
+
+        pthread_mutex_lock(&barrier.mutex);
+        while (result == 0 && !take_arrival(argument)) {
+            if (timeout_ms < 0) {
+                pthread_cond_wait(&barrier.arrived, &barrier.mutex);
+            } else if (pthread_cond_timedwait(&barrier.arrived, &barrier.mutex, &deadline) == ETIMEDOUT) {
+                result = -1;
+            }
+        }
+        pthread_mutex_unlock(&barrier.mutex);
+    }
+
+    free(ids);
+    return result;
+}
@@ -0,0 +1,262 @@
+#include "stub.h"
+#include "stub_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Ricart-Agrawala mutual exclusion. To take a resource, a process stamps a
+   request once and sends it to every other member of the lock group; it
+   holds the resource when all of them have replied. A member replies at
+   once unless it holds the resource, or wants it and its own request is
+   older in (clock, process id) order: then the reply is deferred until it
+   releases it. No process coordinates, and an uncontended acquisition
+   costs 2(N-1) frames.
+
+   A resource is identified on the wire by a 32-bit hash of its name, and
+   a reply echoes the clock of the request it answers, so a late reply to
+   an earlier request is never counted. Locally resources are kept by full
+   name; a request for a hash is deferred while any resource with that
+   hash blocks it. */
+#define LOCK_REPLY_ARGUMENT(key, clock) (((uint64_t)(clock) << 32) | (key))
+
+enum lock_state {
+    LOCK_RELEASED = 0,
+    LOCK_WANTED,
+    LOCK_HELD
+};
+
+struct deferred_reply {
+    int requester;
+    uint32_t clock;
+};
+
+struct resource {
+    char* name;
+    uint32_t key;
+    enum lock_state state;
+    uint32_t request_clock;
+    int replies;
+    struct deferred_reply* deferred;
+    int deferred_count;
+    int deferred_capacity;
+    pthread_cond_t changed;
+};
+
+static struct lock_table {
+    int* members;
+    int member_count;
+    struct resource** resources;
+    int count;
+    int capacity;
+    pthread_mutex_t mutex;
+} locks = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static uint32_t resource_key(const char* resource) {
+    uint32_t hash = 2166136261u;
+    for (; *resource; resource++) hash = (hash ^ (unsigned char)*resource) * 16777619u;
+    return hash;
+}
+
+/* find_resource returns the state of a resource, creating it if create is
+   set. Must be called with locks.mutex held. */
+static struct resource* find_resource(const char* name, int create) {
+    uint32_t key = resource_key(name);
+    for (int i = 0; i < locks.count; i++) {
+        if (locks.resources[i]->key == key && strcmp(locks.resources[i]->name, name) == 0) {
+            return locks.resources[i];
+        }
+    }
+    if (!create) return NULL;
+
+    if (locks.count == locks.capacity) {
+        int capacity = locks.capacity ? locks.capacity * 2 : 16;
+        struct resource** resources = realloc(locks.resources, capacity * sizeof(struct resource*));
+        if (resources == NULL) return NULL;
+        locks.resources = resources;
+        locks.capacity = capacity;
+    }
+    struct resource* resource = calloc(1, sizeof(struct resource));
+    if (resource == NULL) return NULL;
+    resource->name = strdup(name);
+    if (resource->name == NULL) {
+        free(resource);
+        return NULL;
+    }
+    resource->key = key;
+    pthread_cond_init(&resource->changed, NULL);
+    locks.resources[locks.count++] = resource;
+    return resource;
+}
+
+/* dist_lock_init sets the group that dist_lock and dist_unlock coordinate
+   with. Every member must call it with the same members before locking. */
+int dist_lock_init(const struct stub_group* group) {
+    if (group == NULL || group->count <= 0) return -1;
+
+    int* members = malloc(group->count * sizeof(int));
+    if (members == NULL) return -1;
+    int is_member = 0;
+    for (int i = 0; i < group->count; i++) {
+        members[i] = wire_process_id(group->members[i]);
+        if (members[i] < 0) {
+            free(members);
+            return -1;
+        }
+        if (members[i] == stub_process_id()) is_member = 1;
+    }
+    if (!is_member) {
+        free(members);
+        return -1;
+    }
+
+    pthread_mutex_lock(&locks.mutex);
+    free(locks.members);
+    locks.members = members;
+    locks.member_count = group->count;
+    pthread_mutex_unlock(&locks.mutex);
+    return 0;
+}
+
+/* find_blocking returns a resource with the given hash that must make the
+   request (clock, requester) wait: one this process holds, or wants with
+   an older request. Must be called with locks.mutex held. */
+static struct resource* find_blocking(uint32_t key, uint32_t clock, int requester) {
+    for (int i = 0; i < locks.count; i++) {
+        struct resource* resource = locks.resources[i];
+        if (resource->key != key) continue;
+        int ours_first = resource->request_clock < clock ||
+                         (resource->request_clock == clock && stub_process_id() < requester);
+        if (resource->state == LOCK_HELD || (resource->state == LOCK_WANTED && ours_first)) return resource;
+    }
+    return NULL;
+}
+
+/* defer_reply remembers a request to answer on release. Must be called
+   with locks.mutex held. */
+static int defer_reply(struct resource* resource, int requester, uint32_t clock) {
+    if (resource->deferred_count == resource->deferred_capacity) {
+        int capacity = resource->deferred_capacity ? resource->deferred_capacity * 2 : 8;
+        struct deferred_reply* deferred = realloc(resource->deferred, capacity * sizeof(struct deferred_reply));
+        if (deferred == NULL) return -1;
+        resource->deferred = deferred;
+        resource->deferred_capacity = capacity;
+    }
+    resource->deferred[resource->deferred_count].requester = requester;
+    resource->deferred[resource->deferred_count].clock = clock;
+    resource->deferred_count++;
+    return 0;
+}
+
+/* release_resource gives up a resource this process held or wanted and
+   answers the requests deferred meanwhile, except those another resource
+   with the same hash still blocks: they move to that resource. */
+static int release_resource(struct resource* resource) {
+    pthread_mutex_lock(&locks.mutex);
+    struct deferred_reply* deferred = resource->deferred;
+    int deferred_count = resource->deferred_count;
+    resource->deferred = NULL;
+    resource->deferred_count = resource->deferred_capacity = 0;
+    resource->state = LOCK_RELEASED;
+    pthread_cond_broadcast(&resource->changed);
+
+    int answered = 0;
+    for (int i = 0; i < deferred_count; i++) {
+        struct resource* blocking = find_blocking(resource->key, deferred[i].clock, deferred[i].requester);
+        if (blocking != NULL && defer_reply(blocking, deferred[i].requester, deferred[i].clock) == 0) continue;
+        deferred[answered++] = deferred[i];
+    }
+    pthread_mutex_unlock(&locks.mutex);
+
+    int result = 0;
+    for (int i = 0; i < answered; i++) {
+        uint64_t argument = LOCK_REPLY_ARGUMENT(resource->key, deferred[i].clock);
+        if (stub_send_control(deferred[i].requester, WIRE_OP_LOCK_REPLY, argument) != 0) result = -1;
+    }
+    free(deferred);
+    return result;
+}
+
+/* dist_lock blocks until this process holds the resource. Threads of the
+   same process take turns on it before asking the group.
+   Returns 0 once held, -1 on error. */
+int dist_lock(const char* resource_name) {
+    int targets[MAX_PEERS];
+    int target_count = 0;
+
+    pthread_mutex_lock(&locks.mutex);
+    struct resource* resource = find_resource(resource_name, 1);
+    if (resource == NULL || locks.members == NULL) {
+        pthread_mutex_unlock(&locks.mutex);
+        return -1;
+    }
+    while (resource->state != LOCK_RELEASED) {
+        pthread_cond_wait(&resource->changed, &locks.mutex);
+    }
+    resource->state = LOCK_WANTED;
+    resource->replies = 0;
+    resource->request_clock = stub_tick(1);
+    struct wire_frame request = {.opcode = WIRE_OP_LOCK_REQUEST, .clock = resource->request_clock,
+                                 .argument = resource->key};
+    for (int i = 0; i < locks.member_count && target_count < MAX_PEERS; i++) {
+        if (locks.members[i] != stub_process_id()) targets[target_count++] = locks.members[i];
+    }
+    pthread_mutex_unlock(&locks.mutex);
+
+    /* One request, one clock value, sent to every other member */
+    for (int i = 0; i < target_count; i++) {
+        if (stub_send_frames(targets[i], &request, 1) != 0) {
+            release_resource(resource);
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&locks.mutex);
+    while (resource->replies < target_count) {
+        pthread_cond_wait(&resource->changed, &locks.mutex);
+    }
+    resource->state = LOCK_HELD;
+    pthread_mutex_unlock(&locks.mutex);
+    return 0;
+}
+
+/* dist_unlock releases a resource taken with dist_lock. Returns -1 if the
+   resource was not held. */
+int dist_unlock(const char* resource_name) {
+    pthread_mutex_lock(&locks.mutex);
+    struct resource* resource = find_resource(resource_name, 0);
+    int held = (resource != NULL && resource->state == LOCK_HELD);
+    pthread_mutex_unlock(&locks.mutex);
+
+    if (!held) return -1;
+    return release_resource(resource);
+}
+
+void dist_lock_receive(const struct wire_frame* frame) {
+    uint32_t key = (uint32_t)frame->argument;
+    int reply = 0;
+
+    pthread_mutex_lock(&locks.mutex);
+    if (frame->opcode == WIRE_OP_LOCK_REPLY) {
+        /* Only a reply to the outstanding request counts */
+        uint32_t clock = (uint32_t)(frame->argument >> 32);
+        for (int i = 0; i < locks.count; i++) {
+            struct resource* resource = locks.resources[i];
+            if (resource->key == key && resource->state == LOCK_WANTED && resource->request_clock == clock) {
+                resource->replies++;
+                pthread_cond_broadcast(&resource->changed);
+                break;
+            }
+        }
+    } else {
+        struct resource* blocking = find_blocking(key, frame->clock, frame->source);
+        if (blocking == NULL) {
+            reply = 1;
+        } else if (defer_reply(blocking, frame->source, frame->clock) != 0) {
+            fprintf(stderr, "dist_lock: cannot defer the request of P%u\n", frame->source);
+        }
+    }
+    pthread_mutex_unlock(&locks.mutex);
+
+    if (reply) stub_send_control(frame->source, WIRE_OP_LOCK_REPLY, LOCK_REPLY_ARGUMENT(key, frame->clock));
+}
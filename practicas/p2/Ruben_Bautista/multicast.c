@@ -0,0 +1,320 @@
+#include "stub.h"
+#include "stub_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Totally ordered multicast over Lamport clocks. Every message sent with
+   multicast_total_order is stamped once and goes to all members of the
+   group, the sender included. Members keep it in a holdback queue ordered
+   by (clock, sender id) and deliver the head once it is stable: every
+   other member has sent this process something stamped at or after it.
+   Links are FIFO (every frame travels sender -> P2 -> receiver), so
+   nothing ordered before the head can still be on its way.
+
+   Members announce their clock with MULTICAST_ACK frames, but at most one
+   per member per read of the receiver thread, and only when no data frame
+   already carried a clock that high, so under load the multicasts
+   themselves acknowledge each other. */
+
+struct held_message {
+    uint32_t clock;
+    uint16_t source;
+    uint8_t action;
+    uint64_t hlc;
+};
+
+static struct multicast_state {
+    int* members;
+    int member_count;
+    /* Highest clock received from each process, indexed by process id */
+    uint32_t latest[WIRE_MAX_PROCESS_ID + 1];
+    /* Highest clock sent to each member, indexed like members */
+    uint32_t* acknowledged;
+    uint32_t highest_received;
+    int ack_pending;
+    struct held_message* holdback;
+    int held;
+    int capacity;
+    pthread_mutex_t mutex;
+    pthread_mutex_t send_mutex;
+    pthread_mutex_t delivery_mutex;
+} multicast = {.mutex = PTHREAD_MUTEX_INITIALIZER, .send_mutex = PTHREAD_MUTEX_INITIALIZER,
+               .delivery_mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/* Set while the thread is delivering, so a handler that multicasts does not
+   try to deliver again underneath itself. */
+static __thread int delivering;
+
+static int held_before(const struct held_message* a, const struct held_message* b) {
+    if (a->clock != b->clock) return a->clock < b->clock;
+    return a->source < b->source;
+}
+
+/* holdback_push and holdback_pop keep the holdback queue as a binary heap
+   ordered by (clock, source). Must be called with multicast.mutex held. */
+static int holdback_push(struct held_message message) {
+    if (multicast.held == multicast.capacity) {
+        int capacity = multicast.capacity ? multicast.capacity * 2 : 256;
+        struct held_message* holdback = realloc(multicast.holdback, capacity * sizeof(struct held_message));
+        if (holdback == NULL) return -1;
+        multicast.holdback = holdback;
+        multicast.capacity = capacity;
+    }
+    int i = multicast.held++;
+    while (i > 0 && held_before(&message, &multicast.holdback[(i - 1) / 2])) {
+        multicast.holdback[i] = multicast.holdback[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    multicast.holdback[i] = message;
+    return 0;
+}
+
+static struct held_message holdback_pop(void) {
+    struct held_message top = multicast.holdback[0];
+    struct held_message last = multicast.holdback[--multicast.held];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= multicast.held) break;
+        if (child + 1 < multicast.held && held_before(&multicast.holdback[child + 1], &multicast.holdback[child])) {
+            child++;
+        }
+        if (!held_before(&multicast.holdback[child], &last)) break;
+        multicast.holdback[i] = multicast.holdback[child];
+        i = child;
+    }
+    multicast.holdback[i] = last;
+    return top;
+}
+
+/* head_is_stable tells whether every other member has been heard from at
+   or after the clock of the first held message. Must be called with
+   multicast.mutex held. */
+static int head_is_stable(void) {
+    if (multicast.held == 0 || multicast.members == NULL) return 0;
+    uint32_t clock = multicast.holdback[0].clock;
+    int self = stub_process_id();
+    for (int i = 0; i < multicast.member_count; i++) {
+        if (multicast.members[i] != self && multicast.latest[multicast.members[i]] < clock) return 0;
+    }
+    return 1;
+}
+
+/* deliver_stable delivers the stable prefix of the holdback queue. Handlers
+   run outside multicast.mutex; delivery_mutex keeps two threads from
+   delivering out of order. */
+static void deliver_stable(void) {
+    struct message batch[MAX_SEND_BATCH];
+
+    if (delivering) return;
+    delivering = 1;
+    pthread_mutex_lock(&multicast.delivery_mutex);
+    for (;;) {
+        int count = 0;
+        pthread_mutex_lock(&multicast.mutex);
+        while (count < MAX_SEND_BATCH && head_is_stable()) {
+            struct held_message held = holdback_pop();
+            wire_process_name(held.source, batch[count].origin, MAX_PROCESS_NAME);
+            batch[count].action = (enum operations)held.action;
+            batch[count].clock_lamport = held.clock;
+            batch[count].clock_hlc = held.hlc;
+            count++;
+        }
+        pthread_mutex_unlock(&multicast.mutex);
+        if (count == 0) break;
+        stub_deliver(batch, count);
+    }
+    pthread_mutex_unlock(&multicast.delivery_mutex);
+    delivering = 0;
+}
+
+/* send_acks acknowledges the pending multicasts to the members that have
+   not been sent a clock at least as high since. The ack is stamped and sent
+   holding send_mutex, so it cannot overtake a multicast stamped before it;
+   it is sent without multicast.mutex, so a full outbox cannot stall the
+   receiver thread. Must be called with send_mutex held. */
+static void send_acks(void) {
+    struct wire_frame ack = {.opcode = WIRE_OP_MULTICAST_ACK};
+    int self = stub_process_id();
+
+    pthread_mutex_lock(&multicast.mutex);
+    if (multicast.members == NULL || !multicast.ack_pending) {
+        pthread_mutex_unlock(&multicast.mutex);
+        return;
+    }
+    int* joined = multicast.members;
+    int member_count = multicast.member_count;
+    int* targets = malloc(member_count * sizeof(int));
+    if (targets == NULL) {
+        pthread_mutex_unlock(&multicast.mutex);
+        return;
+    }
+    multicast.ack_pending = 0;
+    ack.clock = stub_tick(1);
+    for (int i = 0; i < member_count; i++) {
+        int wanted = joined[i] != self && multicast.acknowledged[i] < multicast.highest_received;
+        targets[i] = wanted ? joined[i] : -1;
+    }
+    pthread_mutex_unlock(&multicast.mutex);
+
+    for (int i = 0; i < member_count; i++) {
+        if (targets[i] >= 0 && stub_send_frames(targets[i], &ack, 1) != 0) targets[i] = -1;
+    }
+
+    pthread_mutex_lock(&multicast.mutex);
+    for (int i = 0; i < member_count && multicast.members == joined; i++) {
+        if (targets[i] >= 0 && multicast.acknowledged[i] < ack.clock) multicast.acknowledged[i] = ack.clock;
+    }
+    pthread_mutex_unlock(&multicast.mutex);
+    free(targets);
+}
+
+/* release_send_mutex unlocks send_mutex and then sends the acks the
+   receiver thread left pending while it was held. If another thread takes
+   send_mutex first, that thread sends them when it releases it, so a
+   pending ack is never left behind. */
+static void release_send_mutex(void) {
+    for (;;) {
+        pthread_mutex_unlock(&multicast.send_mutex);
+        pthread_mutex_lock(&multicast.mutex);
+        int pending = multicast.ack_pending;
+        pthread_mutex_unlock(&multicast.mutex);
+        if (!pending || pthread_mutex_trylock(&multicast.send_mutex) != 0) return;
+        send_acks();
+    }
+}
+
+/* multicast_join sets the group multicast_total_order sends to. Every member
+   must join the same group, with the members in any order. Messages that
+   arrived before the call are kept and delivered once stable. */
+int multicast_join(const struct stub_group* group) {
+    if (group == NULL || group->count <= 0) return -1;
+
+    int* members = malloc(group->count * sizeof(int));
+    uint32_t* acknowledged = calloc(group->count, sizeof(uint32_t));
+    int is_member = 0;
+    if (members == NULL || acknowledged == NULL) {
+        free(members);
+        free(acknowledged);
+        return -1;
+    }
+    for (int i = 0; i < group->count; i++) {
+        members[i] = wire_process_id(group->members[i]);
+        if (members[i] < 0) {
+            free(members);
+            free(acknowledged);
+            return -1;
+        }
+        if (members[i] == stub_process_id()) is_member = 1;
+    }
+    if (!is_member) {
+        free(members);
+        free(acknowledged);
+        return -1;
+    }
+
+    pthread_mutex_lock(&multicast.mutex);
+    free(multicast.members);
+    free(multicast.acknowledged);
+    multicast.members = members;
+    multicast.acknowledged = acknowledged;
+    multicast.member_count = group->count;
+    pthread_mutex_unlock(&multicast.mutex);
+
+    /* Acknowledge what arrived before the group was known */
+    multicast_flush_acks();
+    return 0;
+}
+
+/* multicast_total_order sends a batch of operations to every member of the
+   joined group. Each operation takes its own Lamport value; all members
+   deliver all multicasts, this process's own included, in the same order. */
+int multicast_total_order(const enum operations* actions, int count) {
+    struct wire_frame frames[MAX_SEND_BATCH];
+    if (count <= 0 || count > MAX_SEND_BATCH) return -1;
+
+    /* send_mutex makes concurrent callers send in clock order, which the
+       FIFO argument above relies on. The receiver thread never waits for
+       it, so waiting on a full outbox here cannot stall the reads. */
+    pthread_mutex_lock(&multicast.send_mutex);
+    pthread_mutex_lock(&multicast.mutex);
+    if (multicast.members == NULL) {
+        pthread_mutex_unlock(&multicast.mutex);
+        release_send_mutex();
+        return -1;
+    }
+    /* Stamped once: the held copy and every member's copy carry the same
+       Lamport and HLC values */
+    unsigned int first_clock = stub_tick(count);
+    unsigned long long first_hlc = stub_tick_hlc(count);
+    int self = stub_process_id();
+    int result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        unsigned long long hlc = first_hlc != 0 ? first_hlc + i : 0;
+        struct held_message held = {first_clock + i, self, actions[i], hlc};
+        frames[i].opcode = WIRE_OP_MULTICAST;
+        frames[i].clock = first_clock + i;
+        frames[i].argument = actions[i];
+        frames[i].hlc = hlc;
+        result = holdback_push(held);
+    }
+    int* joined = multicast.members;
+    int member_count = multicast.member_count;
+    int* members = malloc(member_count * sizeof(int));
+    if (members != NULL) memcpy(members, multicast.members, member_count * sizeof(int));
+    pthread_mutex_unlock(&multicast.mutex);
+
+    if (result != 0 || members == NULL) {
+        release_send_mutex();
+        free(members);
+        return -1;
+    }
+    for (int i = 0; i < member_count; i++) {
+        if (members[i] != self && stub_send_frames(members[i], frames, count) != 0) result = -1;
+    }
+
+    /* Every member has now been sent a clock at least this high */
+    pthread_mutex_lock(&multicast.mutex);
+    for (int i = 0; i < multicast.member_count && multicast.members == joined; i++) {
+        if (multicast.acknowledged[i] < first_clock + count - 1) multicast.acknowledged[i] = first_clock + count - 1;
+    }
+    pthread_mutex_unlock(&multicast.mutex);
+    release_send_mutex();
+    free(members);
+
+    deliver_stable();
+    return result;
+}
+
+void multicast_receive(const struct wire_frame* frame) {
+    pthread_mutex_lock(&multicast.mutex);
+    if (frame->clock > multicast.latest[frame->source]) multicast.latest[frame->source] = frame->clock;
+    if (frame->opcode == WIRE_OP_MULTICAST) {
+        struct held_message held = {frame->clock, frame->source, (uint8_t)frame->argument, frame->hlc};
+        if (frame->argument > SHUTDOWN_ACK || holdback_push(held) != 0) {
+            fprintf(stderr, "multicast: dropping message from P%u\n", frame->source);
+        }
+        if (frame->clock > multicast.highest_received) multicast.highest_received = frame->clock;
+        multicast.ack_pending = 1;
+    }
+    pthread_mutex_unlock(&multicast.mutex);
+}
+
+/* multicast_flush_acks runs after every read of the receiver thread: it
+   acknowledges the multicasts of that read, then delivers what became
+   stable. If a sender holds send_mutex, the acks stay pending and that
+   sender sends them when it releases it. */
+void multicast_flush_acks(void) {
+    if (pthread_mutex_trylock(&multicast.send_mutex) == 0) {
+        send_acks();
+        release_send_mutex();
+    }
+
+    pthread_mutex_lock(&multicast.mutex);
+    int stable = head_is_stable();
+    pthread_mutex_unlock(&multicast.mutex);
+
+    if (stable) deliver_stable();
+}
@@ -0,0 +1,179 @@
+#include "shm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static void segment_name(int port, char* name, size_t size) {
+    snprintf(name, size, "/stub.%d", port);
+}
+
+/* shm_enabled tells whether STUB_TRANSPORT allows the shared-memory transport. */
+int shm_enabled(void) {
+    const char* transport = getenv(SHM_TRANSPORT_ENV);
+    return transport == NULL || strcmp(transport, "tcp") != 0;
+}
+
+/* shm_create creates and maps the segment of the P2 listening on port,
+   replacing one a crashed P2 may have left behind. The segment is sparse:
+   only the rings of the links in use take memory. */
+struct shm_segment* shm_create(int port) {
+    char name[64];
+    segment_name(port, name, sizeof(name));
+    shm_unlink(name);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror("shm_open");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(struct shm_segment)) != 0) {
+        perror("shm ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    struct shm_segment* segment = mmap(NULL, sizeof(struct shm_segment), PROT_READ | PROT_WRITE,
+                                       MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        perror("shm mmap");
+        shm_unlink(name);
+        return NULL;
+    }
+    segment->link_count = SHM_MAX_LINKS;
+    __atomic_store_n(&segment->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return segment;
+}
+
+/* shm_attach maps the segment of the P2 listening on port, if there is one
+   on this host with the same layout. */
+struct shm_segment* shm_attach(int port) {
+    char name[64];
+    segment_name(port, name, sizeof(name));
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return NULL;
+    struct shm_segment* segment = mmap(NULL, sizeof(struct shm_segment), PROT_READ | PROT_WRITE,
+                                       MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) return NULL;
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+        segment->link_count != SHM_MAX_LINKS) {
+        munmap(segment, sizeof(struct shm_segment));
+        return NULL;
+    }
+    return segment;
+}
+
+/* shm_detach unmaps the segment; its creator also removes its name. */
+void shm_detach(struct shm_segment* segment, int port, int is_creator) {
+    char name[64];
+    if (segment == NULL) return;
+    munmap(segment, sizeof(struct shm_segment));
+    if (is_creator) {
+        segment_name(port, name, sizeof(name));
+        shm_unlink(name);
+    }
+}
+
+/* shm_claim_link takes a free link for the process and resets its rings.
+   Returns the link index, or -1 if every link is taken. */
+int shm_claim_link(struct shm_segment* segment, int process_id) {
+    for (int i = 0; i < SHM_MAX_LINKS; i++) {
+        struct shm_link* link = &segment->links[i];
+        uint32_t free_owner = 0;
+        if (!__atomic_compare_exchange_n(&link->owner, &free_owner, (uint32_t)process_id + 1, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        link->to_hub.head = link->to_hub.tail = link->to_hub.producer_waiting = 0;
+        link->to_client.head = link->to_client.tail = link->to_client.producer_waiting = 0;
+        link->client_doorbell.sleeping = 0;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        return i;
+    }
+    return -1;
+}
+
+/* shm_release_link frees a link; only P2 releases, once it stopped using it. */
+void shm_release_link(struct shm_segment* segment, int index) {
+    __atomic_store_n(&segment->links[index].owner, 0, __ATOMIC_RELEASE);
+}
+
+/* shm_ring_write copies as much of data as fits into the ring, wakes the
+   consumer if it sleeps, and returns the bytes copied. When not all of it
+   fits, the producer is flagged as waiting, so the consumer rings its
+   doorbell once it made room. */
+size_t shm_ring_write(struct shm_ring* ring, const uint8_t* data, size_t length, struct shm_doorbell* consumer) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t space = SHM_RING_SIZE - (tail - head);
+    if (space < length) {
+        /* Raise the flag before looking again, so a consumer that made
+           room meanwhile either is seen here or sees the flag */
+        __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+        space = SHM_RING_SIZE - (tail - head);
+    }
+    size_t count = length < space ? length : space;
+    if (count == 0) return 0;
+
+    size_t offset = tail % SHM_RING_SIZE;
+    size_t first = SHM_RING_SIZE - offset < count ? SHM_RING_SIZE - offset : count;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, data + first, count - first);
+    __atomic_store_n(&ring->tail, tail + (uint32_t)count, __ATOMIC_RELEASE);
+    shm_doorbell_ring(consumer);
+    return count;
+}
+
+/* shm_ring_read moves up to size bytes out of the ring and returns how
+   many, waking the producer if it waits for room. */
+size_t shm_ring_read(struct shm_ring* ring, uint8_t* data, size_t size, struct shm_doorbell* producer) {
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t count = tail - head < size ? tail - head : size;
+    if (count == 0) return 0;
+
+    size_t offset = head % SHM_RING_SIZE;
+    size_t first = SHM_RING_SIZE - offset < count ? SHM_RING_SIZE - offset : count;
+    memcpy(data, ring->data + offset, first);
+    memcpy(data + first, ring->data, count - first);
+    __atomic_store_n(&ring->head, head + (uint32_t)count, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->producer_waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&ring->producer_waiting, 0, __ATOMIC_SEQ_CST)) {
+        shm_doorbell_ring(producer);
+    }
+    return count;
+}
+
+/* shm_doorbell_sequence returns the value to pass to shm_doorbell_wait;
+   it must be read before looking at the rings. */
+uint32_t shm_doorbell_sequence(struct shm_doorbell* doorbell) {
+    return __atomic_load_n(&doorbell->sequence, __ATOMIC_SEQ_CST);
+}
+
+/* shm_doorbell_ring signals the owner of the doorbell, entering the kernel
+   only when it sleeps. */
+void shm_doorbell_ring(struct shm_doorbell* doorbell) {
+    __atomic_fetch_add(&doorbell->sequence, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&doorbell->sleeping, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &doorbell->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/* shm_doorbell_wait blocks until the doorbell rang after seen was read.
+   The futex is not private: the other side is another process. */
+void shm_doorbell_wait(struct shm_doorbell* doorbell, uint32_t seen) {
+    __atomic_store_n(&doorbell->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&doorbell->sequence, __ATOMIC_SEQ_CST) == seen) {
+        syscall(SYS_futex, &doorbell->sequence, FUTEX_WAIT, seen, NULL, NULL, 0);
+    }
+    __atomic_store_n(&doorbell->sleeping, 0, __ATOMIC_SEQ_CST);
+}
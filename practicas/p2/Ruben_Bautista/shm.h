@@ -0,0 +1,66 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Shared-memory transport between P2 and the processes on its host. P2
+   creates one segment, /stub.<port>, holding SHM_MAX_LINKS links. A client
+   claims a free link, and each direction of its connection becomes a
+   single-producer single-consumer byte ring in it, with the same frames
+   TCP would carry. Consumers sleep on a futex doorbell: P2 has one for all
+   its links, each client the one in its link. Setting STUB_TRANSPORT=tcp
+   keeps every process on TCP. */
+#define SHM_MAGIC 0x4D485353u
+#define SHM_RING_SIZE (64 * 1024)
+#define SHM_MAX_LINKS 256
+#define SHM_NO_LINK 0xFFFFFFFFu
+#define SHM_TRANSPORT_ENV "STUB_TRANSPORT"
+
+/* head and tail run freely and are only reduced modulo SHM_RING_SIZE to
+   index data; each is written by one side only, on its own cache line.
+   producer_waiting is set by a producer that found the ring full. */
+struct shm_ring {
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t producer_waiting;
+    uint32_t tail __attribute__((aligned(64)));
+    uint8_t data[SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+/* sequence changes on every ring; sleeping tells producers the consumer
+   is (about to be) blocked in FUTEX_WAIT on it. */
+struct shm_doorbell {
+    uint32_t sequence __attribute__((aligned(64)));
+    uint32_t sleeping;
+};
+
+/* owner is the client's process id + 1, or 0 while the link is free */
+struct shm_link {
+    uint32_t owner;
+    struct shm_doorbell client_doorbell;
+    struct shm_ring to_hub;
+    struct shm_ring to_client;
+};
+
+struct shm_segment {
+    uint32_t magic;
+    uint32_t link_count;
+    struct shm_doorbell hub_doorbell;
+    struct shm_link links[SHM_MAX_LINKS];
+};
+
+int shm_enabled(void);
+struct shm_segment* shm_create(int port);
+struct shm_segment* shm_attach(int port);
+void shm_detach(struct shm_segment* segment, int port, int is_creator);
+int shm_claim_link(struct shm_segment* segment, int process_id);
+void shm_release_link(struct shm_segment* segment, int index);
+
+size_t shm_ring_write(struct shm_ring* ring, const uint8_t* data, size_t length, struct shm_doorbell* consumer);
+size_t shm_ring_read(struct shm_ring* ring, uint8_t* data, size_t size, struct shm_doorbell* producer);
+
+uint32_t shm_doorbell_sequence(struct shm_doorbell* doorbell);
+void shm_doorbell_ring(struct shm_doorbell* doorbell);
+void shm_doorbell_wait(struct shm_doorbell* doorbell, uint32_t seen);
+
+#endif
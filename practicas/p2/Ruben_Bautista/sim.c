@@ -0,0 +1,285 @@
+#include "sim.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum sim_event_kind {
+    SIM_DELIVER = 0,
+    SIM_HOP,
+    SIM_TIMER
+};
+
+/* Events with the same time run in the order they were scheduled (seq),
+   which is what makes a run deterministic. */
+struct sim_event {
+    uint64_t time;
+    uint64_t seq;
+    enum sim_event_kind kind;
+    int node;
+    struct wire_frame frame;
+    sim_timer_fn fn;
+    void* arg;
+};
+
+/* Arrival time of the last frame scheduled on each directed link, in an
+   open-addressing table keyed by (source, destination): only the links
+   actually used take space. */
+struct sim_link {
+    uint64_t key;
+    uint64_t last_arrival;
+};
+
+struct sim {
+    struct sim_config config;
+    int node_count;
+    unsigned int* clocks;
+    sim_receive_fn receive;
+    void* ctx;
+    uint64_t now;
+    uint64_t next_seq;
+    uint64_t random_state;
+    int stopped;
+    struct sim_event* events;
+    size_t event_count;
+    size_t event_capacity;
+    struct sim_link* links;
+    size_t link_count;
+    size_t link_capacity;
+    struct sim_stats stats;
+};
+
+#define SIM_EMPTY_LINK UINT64_MAX
+
+/* splitmix64 spreads the seed over the state, so nearby seeds do not give
+   nearby sequences and seed 0 is as good as any other. */
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+/* sim_random returns the next value of the run's xorshift64* generator.
+   Protocols that need randomness should draw it from here so it is part
+   of the replayed schedule. */
+uint64_t sim_random(struct sim* sim) {
+    uint64_t x = sim->random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sim->random_state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+static double random_unit(struct sim* sim) {
+    return (sim_random(sim) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+struct sim* sim_create(int node_count, const struct sim_config* config, sim_receive_fn receive, void* ctx) {
+    if (node_count <= 0 || node_count > WIRE_MAX_PROCESS_ID + 1 || config == NULL || receive == NULL) return NULL;
+
+    struct sim* sim = calloc(1, sizeof(struct sim));
+    if (sim == NULL) return NULL;
+    sim->clocks = calloc(node_count, sizeof(unsigned int));
+    sim->link_capacity = 1024;
+    sim->links = malloc(sim->link_capacity * sizeof(struct sim_link));
+    if (sim->clocks == NULL || sim->links == NULL) {
+        sim_destroy(sim);
+        return NULL;
+    }
+    for (size_t i = 0; i < sim->link_capacity; i++) sim->links[i].key = SIM_EMPTY_LINK;
+    sim->config = *config;
+    sim->node_count = node_count;
+    sim->receive = receive;
+    sim->ctx = ctx;
+    sim->random_state = splitmix64(config->seed) | 1;
+    sim->stats.digest = 14695981039346656037ull;
+    return sim;
+}
+
+void sim_destroy(struct sim* sim) {
+    if (sim == NULL) return;
+    free(sim->clocks);
+    free(sim->events);
+    free(sim->links);
+    free(sim);
+}
+
+/* push_event and pop_event keep the events as a binary heap ordered by
+   (time, seq). */
+static int event_before(const struct sim_event* a, const struct sim_event* b) {
+    if (a->time != b->time) return a->time < b->time;
+    return a->seq < b->seq;
+}
+
+static int push_event(struct sim* sim, struct sim_event event) {
+    if (sim->event_count == sim->event_capacity) {
+        size_t capacity = sim->event_capacity ? sim->event_capacity * 2 : 4096;
+        struct sim_event* events = realloc(sim->events, capacity * sizeof(struct sim_event));
+        if (events == NULL) return -1;
+        sim->events = events;
+        sim->event_capacity = capacity;
+    }
+    event.seq = sim->next_seq++;
+    size_t i = sim->event_count++;
+    while (i > 0 && event_before(&event, &sim->events[(i - 1) / 2])) {
+        sim->events[i] = sim->events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim->events[i] = event;
+    return 0;
+}
+
+static struct sim_event pop_event(struct sim* sim) {
+    struct sim_event top = sim->events[0];
+    struct sim_event last = sim->events[--sim->event_count];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= sim->event_count) break;
+        if (child + 1 < sim->event_count && event_before(&sim->events[child + 1], &sim->events[child])) child++;
+        if (!event_before(&sim->events[child], &last)) break;
+        sim->events[i] = sim->events[child];
+        i = child;
+    }
+    sim->events[i] = last;
+    return top;
+}
+
+static uint64_t* link_last_arrival(struct sim* sim, int source, int destination) {
+    if (2 * (sim->link_count + 1) > sim->link_capacity) {
+        size_t capacity = sim->link_capacity * 2;
+        struct sim_link* links = malloc(capacity * sizeof(struct sim_link));
+        if (links == NULL) return NULL;
+        for (size_t i = 0; i < capacity; i++) links[i].key = SIM_EMPTY_LINK;
+        for (size_t i = 0; i < sim->link_capacity; i++) {
+            if (sim->links[i].key == SIM_EMPTY_LINK) continue;
+            size_t slot = splitmix64(sim->links[i].key) & (capacity - 1);
+            while (links[slot].key != SIM_EMPTY_LINK) slot = (slot + 1) & (capacity - 1);
+            links[slot] = sim->links[i];
+        }
+        free(sim->links);
+        sim->links = links;
+        sim->link_capacity = capacity;
+    }
+
+    uint64_t key = ((uint64_t)source << 32) | (uint32_t)destination;
+    size_t slot = splitmix64(key) & (sim->link_capacity - 1);
+    while (sim->links[slot].key != SIM_EMPTY_LINK && sim->links[slot].key != key) {
+        slot = (slot + 1) & (sim->link_capacity - 1);
+    }
+    if (sim->links[slot].key == SIM_EMPTY_LINK) {
+        sim->links[slot].key = key;
+        sim->links[slot].last_arrival = 0;
+        sim->link_count++;
+    }
+    return &sim->links[slot].last_arrival;
+}
+
+/* transmit puts a frame on the link from one node to another: it draws
+   its delay and whether it is lost or may overtake, then schedules its
+   arrival as kind. */
+static int transmit(struct sim* sim, int from, int to, const struct wire_frame* frame, enum sim_event_kind kind) {
+    const struct sim_config* config = &sim->config;
+    struct sim_event event = {.kind = kind, .node = to, .frame = *frame};
+
+    event.time = sim->now + config->delay_ns;
+    if (config->jitter_ns > 0) event.time += sim_random(sim) % config->jitter_ns;
+    uint64_t backoff = config->retransmit_ns;
+    while (config->loss > 0 && random_unit(sim) < config->loss) {
+        if (config->retransmit_ns == 0) {
+            sim->stats.frames_lost++;
+            return 0;
+        }
+        event.time += backoff;
+        backoff *= 2;
+        sim->stats.retransmissions++;
+    }
+
+    uint64_t* last_arrival = link_last_arrival(sim, from, to);
+    if (last_arrival == NULL) return -1;
+    if (config->reorder > 0 && random_unit(sim) < config->reorder) {
+        if (event.time < *last_arrival) sim->stats.frames_reordered++;
+    } else if (event.time < *last_arrival) {
+        event.time = *last_arrival;
+    }
+    if (event.time > *last_arrival) *last_arrival = event.time;
+    return push_event(sim, event);
+}
+
+/* sim_send stamps a frame with the next Lamport value of source, like
+   stub_send_frames, and puts it on the network. */
+int sim_send(struct sim* sim, int source, int destination, struct wire_frame* frame) {
+    uint8_t encoded[WIRE_MAX_FRAME];
+    if (source < 0 || source >= sim->node_count || destination < 0 || destination >= sim->node_count) return -1;
+
+    frame->source = source;
+    frame->destination = destination;
+    frame->clock = ++sim->clocks[source];
+    sim->stats.frames_sent++;
+    sim->stats.bytes_sent += wire_encode(frame, encoded);
+    if (sim->config.relay && source != 0 && destination != 0) {
+        return transmit(sim, source, 0, frame, SIM_HOP);
+    }
+    return transmit(sim, source, destination, frame, SIM_DELIVER);
+}
+
+/* sim_timer runs fn for the node delay_ns from now. */
+int sim_timer(struct sim* sim, int node, uint64_t delay_ns, sim_timer_fn fn, void* arg) {
+    struct sim_event event = {.time = sim->now + delay_ns, .kind = SIM_TIMER, .node = node, .fn = fn, .arg = arg};
+    if (node < 0 || node >= sim->node_count || fn == NULL) return -1;
+    return push_event(sim, event);
+}
+
+static void deliver(struct sim* sim, const struct sim_event* event) {
+    const struct wire_frame* frame = &event->frame;
+    unsigned int* clock = &sim->clocks[event->node];
+    if (frame->clock > *clock) *clock = frame->clock;
+    ++*clock;
+
+    uint64_t values[] = {event->time, frame->source, frame->destination, frame->opcode, frame->clock};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        sim->stats.digest = (sim->stats.digest ^ values[i]) * 1099511628211ull;
+    }
+    sim->stats.frames_delivered++;
+    sim->receive(sim, event->node, frame, sim->ctx);
+}
+
+/* sim_run processes events in virtual-time order until there are none
+   left, sim_stop is called or the next one is past until_ns. Returns the
+   number of events processed. */
+uint64_t sim_run(struct sim* sim, uint64_t until_ns) {
+    uint64_t processed = 0;
+    sim->stopped = 0;
+    while (!sim->stopped && sim->event_count > 0 && sim->events[0].time <= until_ns) {
+        struct sim_event event = pop_event(sim);
+        sim->now = event.time;
+        processed++;
+        switch (event.kind) {
+            case SIM_DELIVER: deliver(sim, &event); break;
+            /* The relay forwards without touching the frame or its clock */
+            case SIM_HOP:
+                sim->stats.frames_relayed++;
+                transmit(sim, 0, event.frame.destination, &event.frame, SIM_DELIVER);
+                break;
+            case SIM_TIMER: event.fn(sim, event.node, event.arg); break;
+        }
+    }
+    sim->stats.events += processed;
+    return processed;
+}
+
+void sim_stop(struct sim* sim) {
+    sim->stopped = 1;
+}
+
+uint64_t sim_now(const struct sim* sim) {
+    return sim->now;
+}
+
+unsigned int sim_clock(const struct sim* sim, int node) {
+    return sim->clocks[node];
+}
+
+void sim_get_stats(const struct sim* sim, struct sim_stats* stats) {
+    *stats = sim->stats;
+}
@@ -0,0 +1,62 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include "wire.h"
+
+/* Deterministic simulated network for protocols built on stub frames.
+   Nodes are plain numbers 0..N-1 inside one process; a discrete-event
+   scheduler delivers the frames they send in virtual time, applying the
+   Lamport rules of the stub, so thousands of nodes run in seconds and the
+   same seed always replays the same schedule.
+
+   Every frame takes delay_ns plus a uniform jitter in [0, jitter_ns). As
+   over TCP, frames on one link arrive in order, except that with
+   probability reorder a frame ignores the ones before it. With probability
+   loss a frame is lost: it arrives retransmit_ns later (doubling while it
+   keeps being lost, like a TCP retransmission) or, if retransmit_ns is 0,
+   never. With relay set, frames between two nodes other than node 0 go
+   through node 0 and pay two hops, like frames relayed by P2. */
+struct sim_config {
+    uint64_t seed;
+    uint64_t delay_ns;
+    uint64_t jitter_ns;
+    double reorder;
+    double loss;
+    uint64_t retransmit_ns;
+    int relay;
+};
+
+/* digest hashes every delivery (time, source, destination, opcode, clock)
+   in order: two runs followed the same schedule when their digests match. */
+struct sim_stats {
+    uint64_t events;
+    uint64_t frames_sent;
+    uint64_t frames_delivered;
+    uint64_t frames_relayed;
+    uint64_t frames_lost;
+    uint64_t frames_reordered;
+    uint64_t retransmissions;
+    uint64_t bytes_sent;
+    uint64_t digest;
+};
+
+struct sim;
+
+/* receive runs when a frame reaches its destination, after the Lamport
+   receive rule moved the node's clock; a timer runs when it expires. */
+typedef void (*sim_receive_fn)(struct sim* sim, int node, const struct wire_frame* frame, void* ctx);
+typedef void (*sim_timer_fn)(struct sim* sim, int node, void* arg);
+
+struct sim* sim_create(int node_count, const struct sim_config* config, sim_receive_fn receive, void* ctx);
+void sim_destroy(struct sim* sim);
+int sim_send(struct sim* sim, int source, int destination, struct wire_frame* frame);
+int sim_timer(struct sim* sim, int node, uint64_t delay_ns, sim_timer_fn fn, void* arg);
+uint64_t sim_run(struct sim* sim, uint64_t until_ns);
+void sim_stop(struct sim* sim);
+uint64_t sim_now(const struct sim* sim);
+unsigned int sim_clock(const struct sim* sim, int node);
+uint64_t sim_random(struct sim* sim);
+void sim_get_stats(const struct sim* sim, struct sim_stats* stats);
+
+#endif
@@ -0,0 +1,270 @@
+#include "sim.h"
+#include "stub.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+/* sim_bench runs the stub protocols on the simulated network of sim.h,
+   with N virtual processes in this one process:
+
+     shutdown  the P1/P2/P3 protocol with N-1 clients: each sends
+               READY_TO_SHUTDOWN to P2 (node 0), which answers all of
+               them with SHUTDOWN_NOW once every client is ready, and
+               waits for their SHUTDOWN_ACK
+     barrier   the dissemination barrier of stub_barrier, all N nodes
+
+   Each run repeats the protocol M times and reports the virtual time it
+   took, the events per second of wall-clock time and the digest of the
+   schedule. --verify runs everything twice and checks the digests match.
+
+   The stub itself keeps its state in globals, one instance per OS
+   process, so the nodes here run models of its protocols on the same
+   frames and Lamport rules rather than stub.c. */
+
+#define DEFAULT_PROCS 1000
+#define MAX_BARRIER_ROUNDS 16
+#define US 1000ull
+
+enum pattern {
+    SHUTDOWN = 0,
+    BARRIER
+};
+
+static enum pattern pattern = SHUTDOWN;
+static int node_count = DEFAULT_PROCS;
+static int repetitions = 10;
+static int verify = 0;
+static struct sim_config config = {.seed = 1, .delay_ns = 50 * US, .jitter_ns = 20 * US,
+                                   .retransmit_ns = 200000 * US};
+
+/* Protocol state of every node, reset for each run */
+static struct node {
+    int done;
+    /* shutdown: the replies P2 got in this phase */
+    int count;
+    /* barrier */
+    int round;
+    int arrivals[2][MAX_BARRIER_ROUNDS];
+} *nodes;
+static int barrier_rounds;
+static int finished;
+static int completed;
+static uint64_t last_completion;
+
+static void start_shutdown(struct sim* sim);
+
+static void send_opcode(struct sim* sim, int source, int destination, uint8_t opcode, uint32_t argument) {
+    struct wire_frame frame = {.opcode = opcode, .flags = WIRE_FLAG_ARGUMENT, .argument = argument};
+    sim_send(sim, source, destination, &frame);
+}
+
+/* client_ready is the timer that makes a client announce it is ready. */
+static void client_ready(struct sim* sim, int node, void* arg) {
+    send_opcode(sim, node, 0, READY_TO_SHUTDOWN, completed);
+}
+
+static void start_shutdown(struct sim* sim) {
+    /* Clients get ready at different times within one delay */
+    for (int i = 1; i < node_count; i++) {
+        uint64_t offset = config.delay_ns > 0 ? sim_random(sim) % config.delay_ns : 0;
+        sim_timer(sim, i, offset, client_ready, NULL);
+    }
+}
+
+static void on_shutdown_frame(struct sim* sim, int node, const struct wire_frame* frame, void* ctx) {
+    switch (frame->opcode) {
+        case READY_TO_SHUTDOWN:
+            if (++nodes[0].count < node_count - 1) break;
+            nodes[0].count = 0;
+            for (int i = 1; i < node_count; i++) send_opcode(sim, 0, i, SHUTDOWN_NOW, completed);
+            break;
+        case SHUTDOWN_NOW:
+            send_opcode(sim, node, 0, SHUTDOWN_ACK, completed);
+            break;
+        case SHUTDOWN_ACK:
+            if (++nodes[0].count < node_count - 1) break;
+            nodes[0].count = 0;
+            last_completion = sim_now(sim);
+            if (++completed == repetitions) {
+                sim_stop(sim);
+            } else {
+                start_shutdown(sim);
+            }
+            break;
+    }
+}
+
+/* The barrier argument is (epoch << 4) | round, as in barrier.c. A node
+   can only be one barrier ahead of another, so arrivals are kept for the
+   current epoch and the next one. */
+static void barrier_signal(struct sim* sim, int node) {
+    int distance = 1 << nodes[node].round;
+    send_opcode(sim, node, (node + distance) % node_count, WIRE_OP_BARRIER,
+                (nodes[node].done << 4) | nodes[node].round);
+}
+
+static void barrier_advance(struct sim* sim, int node) {
+    struct node* self = &nodes[node];
+    while (self->done < repetitions && self->arrivals[self->done & 1][self->round] > 0) {
+        self->arrivals[self->done & 1][self->round]--;
+        if (++self->round < barrier_rounds) {
+            barrier_signal(sim, node);
+            continue;
+        }
+        self->round = 0;
+        if (++self->done == repetitions) {
+            last_completion = sim_now(sim);
+            if (++finished == node_count) sim_stop(sim);
+            return;
+        }
+        barrier_signal(sim, node);
+    }
+}
+
+static void on_barrier_frame(struct sim* sim, int node, const struct wire_frame* frame, void* ctx) {
+    if (frame->opcode != WIRE_OP_BARRIER) return;
+    nodes[node].arrivals[(frame->argument >> 4) & 1][frame->argument & 0xF]++;
+    barrier_advance(sim, node);
+}
+
+static void start_barrier(struct sim* sim) {
+    for (int i = 0; i < node_count; i++) barrier_signal(sim, i);
+}
+
+static double elapsed_s(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* run simulates one whole benchmark and fills stats. Returns 0 if the
+   protocol completed, -1 if the network lost the frames it needed. */
+static int run(struct sim_stats* stats, double* wall_seconds) {
+    struct timespec start, end;
+
+    nodes = calloc(node_count, sizeof(struct node));
+    struct sim* sim = sim_create(node_count, &config, pattern == SHUTDOWN ? on_shutdown_frame : on_barrier_frame, NULL);
+    if (nodes == NULL || sim == NULL) {
+        fprintf(stderr, "sim_bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    finished = completed = 0;
+    last_completion = 0;
+    barrier_rounds = 0;
+    while ((1 << barrier_rounds) < node_count) barrier_rounds++;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pattern == SHUTDOWN) start_shutdown(sim);
+    else start_barrier(sim);
+    sim_run(sim, UINT64_MAX);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int result = (pattern == SHUTDOWN ? completed == repetitions : finished == node_count) ? 0 : -1;
+    sim_get_stats(sim, stats);
+    *wall_seconds = elapsed_s(start, end);
+    sim_destroy(sim);
+    free(nodes);
+    return result;
+}
+
+static void print_report(const struct sim_stats* stats, double wall_seconds, int result) {
+    const char* names[] = {"shutdown", "barrier"};
+    printf("sim %s, %d processes, %d runs, seed %llu, delay %.1f us + jitter %.1f us, "
+           "reorder %.3f, loss %.3f%s\n", names[pattern], node_count, repetitions,
+           (unsigned long long)config.seed, config.delay_ns / 1e3, config.jitter_ns / 1e3,
+           config.reorder, config.loss, config.relay ? ", relayed by P2" : "");
+    if (result != 0) {
+        printf("  DID NOT COMPLETE: the frames it needed were lost\n");
+    } else {
+        printf("  virtual time  %.3f ms, %.1f us per %s\n", last_completion / 1e6,
+               last_completion / 1e3 / repetitions, pattern == SHUTDOWN ? "shutdown" : "barrier");
+    }
+    printf("  events        %llu in %.3f s = %.0f events/s\n", (unsigned long long)stats->events,
+           wall_seconds, stats->events / wall_seconds);
+    printf("  frames        %llu sent (%llu bytes), %llu delivered, %llu relayed, %llu lost, "
+           "%llu reordered, %llu retransmissions\n",
+           (unsigned long long)stats->frames_sent, (unsigned long long)stats->bytes_sent,
+           (unsigned long long)stats->frames_delivered, (unsigned long long)stats->frames_relayed,
+           (unsigned long long)stats->frames_lost, (unsigned long long)stats->frames_reordered,
+           (unsigned long long)stats->retransmissions);
+    printf("  digest        %016llx\n", (unsigned long long)stats->digest);
+}
+
+static int parse_arguments(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"procs", required_argument, 0, 'n'},
+        {"runs", required_argument, 0, 'm'},
+        {"pattern", required_argument, 0, 't'},
+        {"seed", required_argument, 0, 's'},
+        {"delay-us", required_argument, 0, 'd'},
+        {"jitter-us", required_argument, 0, 'j'},
+        {"reorder", required_argument, 0, 'o'},
+        {"loss", required_argument, 0, 'l'},
+        {"retransmit-us", required_argument, 0, 'r'},
+        {"relay", no_argument, 0, 'y'},
+        {"verify", no_argument, 0, 'v'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "n:m:t:s:d:j:o:l:r:yv", long_options, NULL)) != -1) {
+        if (opt == 'n') {
+            node_count = atoi(optarg);
+        } else if (opt == 'm') {
+            repetitions = atoi(optarg);
+        } else if (opt == 's') {
+            config.seed = strtoull(optarg, NULL, 10);
+        } else if (opt == 'd') {
+            config.delay_ns = (uint64_t)(atof(optarg) * US);
+        } else if (opt == 'j') {
+            config.jitter_ns = (uint64_t)(atof(optarg) * US);
+        } else if (opt == 'o') {
+            config.reorder = atof(optarg);
+        } else if (opt == 'l') {
+            config.loss = atof(optarg);
+        } else if (opt == 'r') {
+            config.retransmit_ns = (uint64_t)(atof(optarg) * US);
+        } else if (opt == 'y') {
+            config.relay = 1;
+        } else if (opt == 'v') {
+            verify = 1;
+        } else if (opt == 't') {
+            if (strcmp(optarg, "shutdown") == 0) pattern = SHUTDOWN;
+            else if (strcmp(optarg, "barrier") == 0) pattern = BARRIER;
+            else return -1;
+        } else {
+            return -1;
+        }
+    }
+
+    if (node_count < 2 || node_count > WIRE_MAX_PROCESS_ID || repetitions < 1 ||
+        config.reorder < 0 || config.reorder > 1 || config.loss < 0 || config.loss >= 1 ||
+        (pattern == BARRIER && node_count > (1 << MAX_BARRIER_ROUNDS))) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (parse_arguments(argc, argv) != 0) {
+        fprintf(stderr, "Usage: %s [--procs N] [--runs M] [--pattern shutdown|barrier] [--seed S] "
+                "[--delay-us D] [--jitter-us J] [--reorder P] [--loss P] [--retransmit-us R] "
+                "[--relay] [--verify]\n", argv[0]);
+        return 1;
+    }
+
+    struct sim_stats stats;
+    double wall_seconds;
+    int result = run(&stats, &wall_seconds);
+    print_report(&stats, wall_seconds, result);
+
+    if (verify) {
+        struct sim_stats replay;
+        double replay_seconds;
+        run(&replay, &replay_seconds);
+        int same = (replay.digest == stats.digest && replay.events == stats.events);
+        printf("  replay        %s schedule\n", same ? "identical" : "DIFFERENT");
+        if (!same) return 1;
+    }
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,402 @@
+#include "stub.h"
+#include "stub_internal.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Chandy-Lamport snapshots. The initiator records its local state and
+   sends a SNAPSHOT_MARKER to every other member of the snapshot group; a
+   member records its own state when the first marker of the snapshot
+   reaches it and sends its markers in turn. From then on it keeps every
+   application message that arrives from each other member until that
+   member's marker does: those were in flight when the cut was taken.
+   Every frame travels sender -> P2 -> receiver in order, so a marker
+   separates the messages its sender sent before recording from the ones
+   it sent after, and nobody has to stop sending for the snapshot.
+
+   The state is recorded and the markers sent while the stub neither
+   dispatches frames nor sends application messages, so each message
+   falls on one side of the recording. A member whose markers all arrived
+   appends its section to the snapshot file and reports SNAPSHOT_DONE to
+   the initiator.
+
+   A snapshot is identified on the wire by (initiator id << 16) | sequence,
+   the argument of its frames, so snapshots of different initiators can be
+   in progress at the same time. Only application messages, sent directly
+   or multicast, are part of the channels; the stub's control frames are
+   not.
+
+   A snapshot that finds no free slot fails here for good: its id is kept
+   among the last SNAPSHOT_MAX_FAILED failed ones and the markers that
+   still arrive for it are ignored, instead of each one trying to record
+   it again. */
+#define SNAPSHOT_MAX_ACTIVE 8
+#define SNAPSHOT_MAX_FAILED 64
+#define SNAPSHOT_ID(initiator, sequence) (((uint32_t)(initiator) << 16) | ((sequence) & 0xFFFF))
+
+/* A snapshot this process recorded and whose markers are not all in yet.
+   channels and open are indexed by rank; open[i] is set while the channel
+   from members[i] is being recorded. */
+struct active_snapshot {
+    int in_use;
+    uint32_t id;
+    uint32_t lamport;
+    int markers_missing;
+    uint8_t* open;
+    struct snapshot_channel* channels;
+    struct snapshot_message* messages;
+    int message_count;
+    int message_capacity;
+    uint8_t* state;
+    size_t state_length;
+};
+
+/* The counters and the active snapshots are only used by the receiving
+   threads and by a thread holding the traffic, one at a time, so they need
+   no lock of their own; sent is also updated by senders, atomically.
+   mutex protects the reports the initiator waits for. */
+static struct snapshot_state {
+    int* members;
+    int member_count;
+    /* Rank + 1 of every member, 0 for other processes, indexed by process id */
+    uint16_t ranks[WIRE_MAX_PROCESS_ID + 1];
+    snapshot_record_fn record;
+    void* ctx;
+    /* Application messages sent to and received from each process */
+    uint32_t sent[WIRE_MAX_PROCESS_ID + 1];
+    uint32_t received[WIRE_MAX_PROCESS_ID + 1];
+    struct active_snapshot active[SNAPSHOT_MAX_ACTIVE];
+    /* Ring of the ids of failed snapshots, 0 in unused entries */
+    uint32_t failed[SNAPSHOT_MAX_FAILED];
+    int next_failed;
+    int recording;
+    uint16_t sequence;
+    uint32_t reporting_id;
+    int reports;
+    pthread_mutex_t mutex;
+    pthread_mutex_t start_mutex;
+    pthread_cond_t reported;
+} snapshot = {.mutex = PTHREAD_MUTEX_INITIALIZER, .start_mutex = PTHREAD_MUTEX_INITIALIZER,
+              .reported = PTHREAD_COND_INITIALIZER};
+
+/* snapshot_init sets the group that snapshots are taken of and the
+   callback recording this process's state, which may be NULL. Every
+   member must call it with the same members, after init_stub and before
+   sending: from then on application sends are counted per channel. */
+int snapshot_init(const struct stub_group* group, snapshot_record_fn record, void* ctx) {
+    if (group == NULL || group->count <= 0 || group->count > MAX_PEERS) return -1;
+
+    int* members = malloc(group->count * sizeof(int));
+    if (members == NULL) return -1;
+    int is_member = 0;
+    for (int i = 0; i < group->count; i++) {
+        members[i] = wire_process_id(group->members[i]);
+        if (members[i] < 0) {
+            free(members);
+            return -1;
+        }
+        if (members[i] == stub_process_id()) is_member = 1;
+    }
+    if (!is_member) {
+        free(members);
+        return -1;
+    }
+
+    stub_gate_sends();
+    stub_hold_traffic();
+    for (int i = 0; i < snapshot.member_count; i++) snapshot.ranks[snapshot.members[i]] = 0;
+    free(snapshot.members);
+    snapshot.members = members;
+    snapshot.member_count = group->count;
+    for (int i = 0; i < group->count; i++) snapshot.ranks[members[i]] = i + 1;
+    snapshot.record = record;
+    snapshot.ctx = ctx;
+    stub_release_traffic();
+    return 0;
+}
+
+static void snapshot_path(uint32_t id, char* path, size_t size) {
+    const char* directory = getenv(SNAPSHOT_DIR_ENV);
+    snprintf(path, size, "%s/snapshot-%08x.snap", directory != NULL ? directory : ".", id);
+}
+
+static void free_active(struct active_snapshot* active) {
+    free(active->open);
+    free(active->channels);
+    free(active->messages);
+    free(active->state);
+    memset(active, 0, sizeof(struct active_snapshot));
+}
+
+static void mark_failed(uint32_t id) {
+    snapshot.failed[snapshot.next_failed] = id;
+    snapshot.next_failed = (snapshot.next_failed + 1) % SNAPSHOT_MAX_FAILED;
+}
+
+static int has_failed(uint32_t id) {
+    for (int i = 0; i < SNAPSHOT_MAX_FAILED; i++) {
+        if (snapshot.failed[i] == id) return 1;
+    }
+    return 0;
+}
+
+/* record_state takes this process's part of snapshot id: the application
+   state, the clock and the message counters. It starts recording every
+   channel but the one from from, whose marker just arrived (-1 for the
+   initiator), and sends the markers. Must be called with the traffic held. */
+static struct active_snapshot* record_state(uint32_t id, int from) {
+    struct active_snapshot* active = NULL;
+    for (int i = 0; i < SNAPSHOT_MAX_ACTIVE && active == NULL; i++) {
+        if (!snapshot.active[i].in_use) active = &snapshot.active[i];
+    }
+    if (active == NULL) {
+        fprintf(stderr, "snapshot: too many snapshots in progress, ignoring %08x\n", id);
+        mark_failed(id);
+        return NULL;
+    }
+
+    int count = snapshot.member_count;
+    active->open = calloc(count, sizeof(uint8_t));
+    active->channels = calloc(count, sizeof(struct snapshot_channel));
+    active->state = malloc(SNAPSHOT_MAX_STATE);
+    if (active->open == NULL || active->channels == NULL || active->state == NULL) {
+        free_active(active);
+        mark_failed(id);
+        return NULL;
+    }
+    active->in_use = 1;
+    active->id = id;
+    if (snapshot.record != NULL) {
+        active->state_length = snapshot.record(active->state, SNAPSHOT_MAX_STATE, snapshot.ctx);
+        if (active->state_length > SNAPSHOT_MAX_STATE) active->state_length = SNAPSHOT_MAX_STATE;
+    }
+    active->lamport = get_clock_lamport();
+    for (int i = 0; i < count; i++) {
+        int member = snapshot.members[i];
+        active->channels[i].peer = member;
+        active->channels[i].sent = __atomic_load_n(&snapshot.sent[member], __ATOMIC_RELAXED);
+        active->channels[i].received = snapshot.received[member];
+        if (member != stub_process_id() && member != from) {
+            active->open[i] = 1;
+            active->markers_missing++;
+        }
+    }
+    snapshot.recording++;
+
+    for (int i = 0; i < count; i++) {
+        int member = snapshot.members[i];
+        if (member != stub_process_id() && stub_send_control(member, WIRE_OP_SNAPSHOT_MARKER, id) != 0) {
+            fprintf(stderr, "snapshot: cannot send the marker of %08x to P%d\n", id, member);
+        }
+    }
+    return active;
+}
+
+/* write_section appends this process's section of a finished snapshot to
+   the snapshot file with one write. */
+static int write_section(const struct active_snapshot* active) {
+    int channel_count = snapshot.member_count - 1;
+    size_t size = sizeof(struct snapshot_section) + active->state_length +
+                  channel_count * sizeof(struct snapshot_channel) +
+                  active->message_count * sizeof(struct snapshot_message);
+    uint8_t* buffer = malloc(size);
+    if (buffer == NULL) return -1;
+
+    struct snapshot_section section = {
+        .magic = SNAPSHOT_MAGIC, .version = SNAPSHOT_VERSION, .process_id = stub_process_id(),
+        .snapshot_id = active->id, .lamport = active->lamport, .state_length = active->state_length,
+        .channel_count = channel_count, .message_count = active->message_count
+    };
+    uint8_t* position = buffer;
+    memcpy(position, &section, sizeof(section));
+    position += sizeof(section);
+    memcpy(position, active->state, active->state_length);
+    position += active->state_length;
+
+    /* Channels in rank order, and the messages grouped the same way */
+    struct snapshot_message* messages = (struct snapshot_message*)
+        (position + channel_count * sizeof(struct snapshot_channel));
+    int* next = malloc(snapshot.member_count * sizeof(int));
+    if (next == NULL) {
+        free(buffer);
+        return -1;
+    }
+    int first = 0;
+    for (int i = 0; i < snapshot.member_count; i++) {
+        next[i] = first;
+        if (snapshot.members[i] == stub_process_id()) continue;
+        memcpy(position, &active->channels[i], sizeof(struct snapshot_channel));
+        position += sizeof(struct snapshot_channel);
+        first += active->channels[i].in_flight;
+    }
+    for (int i = 0; i < active->message_count; i++) {
+        int rank = snapshot.ranks[active->messages[i].source] - 1;
+        messages[next[rank]++] = active->messages[i];
+    }
+    free(next);
+
+    char path[512];
+    snapshot_path(active->id, path, sizeof(path));
+    int result = -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd >= 0) {
+        if (write(fd, buffer, size) == (ssize_t)size) result = 0;
+        close(fd);
+    }
+    if (result != 0) fprintf(stderr, "snapshot: cannot write %s: %s\n", path, strerror(errno));
+    free(buffer);
+    return result;
+}
+
+static void report(uint32_t id) {
+    pthread_mutex_lock(&snapshot.mutex);
+    if (snapshot.reporting_id == id) {
+        snapshot.reports++;
+        pthread_cond_broadcast(&snapshot.reported);
+    }
+    pthread_mutex_unlock(&snapshot.mutex);
+}
+
+/* finish_snapshot writes the section of a snapshot whose markers all
+   arrived and reports it to the initiator. A section that could not be
+   written is not reported, so the initiator does not wait for nothing. */
+static void finish_snapshot(struct active_snapshot* active) {
+    uint32_t id = active->id;
+    int written = (write_section(active) == 0);
+    free_active(active);
+    snapshot.recording--;
+
+    if (!written) return;
+    if ((int)(id >> 16) == stub_process_id()) {
+        report(id);
+    } else {
+        stub_send_control(id >> 16, WIRE_OP_SNAPSHOT_DONE, id);
+    }
+}
+
+/* start_snapshot takes a snapshot of the group set with snapshot_init,
+   while the application keeps running, and waits until every member
+   wrote its section, or until timeout_ms milliseconds pass (a negative
+   timeout waits forever). The path of the snapshot file is copied to path
+   if it is not NULL. Returns 0 when the snapshot is complete, -1 on
+   timeout or error. */
+int start_snapshot(int timeout_ms, char* path, size_t path_size) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (timeout_ms >= 0) {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    /* One snapshot at a time per initiator, so the reports are its own */
+    pthread_mutex_lock(&snapshot.start_mutex);
+    if (snapshot.members == NULL) {
+        pthread_mutex_unlock(&snapshot.start_mutex);
+        return -1;
+    }
+    pthread_mutex_lock(&snapshot.mutex);
+    if (++snapshot.sequence == 0) snapshot.sequence = 1;
+    uint32_t id = SNAPSHOT_ID(stub_process_id(), snapshot.sequence);
+    snapshot.reporting_id = id;
+    snapshot.reports = 0;
+    pthread_mutex_unlock(&snapshot.mutex);
+
+    stub_hold_traffic();
+    struct active_snapshot* active = record_state(id, -1);
+    int result = (active != NULL) ? 0 : -1;
+    if (active != NULL && active->markers_missing == 0) finish_snapshot(active);
+    stub_release_traffic();
+
+    pthread_mutex_lock(&snapshot.mutex);
+    while (result == 0 && snapshot.reports < snapshot.member_count) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&snapshot.reported, &snapshot.mutex);
+        } else if (pthread_cond_timedwait(&snapshot.reported, &snapshot.mutex, &deadline) == ETIMEDOUT) {
+            result = -1;
+        }
+    }
+    snapshot.reporting_id = 0;
+    pthread_mutex_unlock(&snapshot.mutex);
+    pthread_mutex_unlock(&snapshot.start_mutex);
+
+    if (path != NULL && path_size > 0) snapshot_path(id, path, path_size);
+    return result;
+}
+
+void snapshot_count_sent(int destination, int count) {
+    __atomic_fetch_add(&snapshot.sent[destination], count, __ATOMIC_RELAXED);
+}
+
+/* append_message keeps an in-flight message of the snapshot. */
+static int append_message(struct active_snapshot* active, const struct wire_frame* frame) {
+    if (active->message_count == active->message_capacity) {
+        int capacity = active->message_capacity ? active->message_capacity * 2 : 256;
+        struct snapshot_message* messages = realloc(active->messages, capacity * sizeof(struct snapshot_message));
+        if (messages == NULL) return -1;
+        active->messages = messages;
+        active->message_capacity = capacity;
+    }
+    struct snapshot_message* message = &active->messages[active->message_count++];
+    message->source = frame->source;
+    if (frame->opcode == WIRE_OP_MULTICAST) {
+        message->action = (uint8_t)frame->argument;
+        message->flags = SNAPSHOT_MESSAGE_MULTICAST;
+    } else {
+        message->action = frame->opcode;
+        message->flags = 0;
+    }
+    message->clock = frame->clock;
+    return 0;
+}
+
+void snapshot_observe(const struct wire_frame* frame) {
+    snapshot.received[frame->source]++;
+    if (snapshot.recording == 0) return;
+
+    int rank = snapshot.ranks[frame->source] - 1;
+    if (rank < 0) return;
+    for (int i = 0; i < SNAPSHOT_MAX_ACTIVE; i++) {
+        struct active_snapshot* active = &snapshot.active[i];
+        if (!active->in_use || !active->open[rank]) continue;
+        if (append_message(active, frame) == 0) {
+            active->channels[rank].in_flight++;
+        } else {
+            fprintf(stderr, "snapshot: cannot record a message from P%u in %08x\n", frame->source, active->id);
+        }
+    }
+}
+
+void snapshot_receive(const struct wire_frame* frame) {
+    if (frame->opcode == WIRE_OP_SNAPSHOT_DONE) {
+        report(frame->argument);
+        return;
+    }
+
+    int rank = snapshot.members != NULL ? snapshot.ranks[frame->source] - 1 : -1;
+    if (rank < 0) return;
+    struct active_snapshot* active = NULL;
+    for (int i = 0; i < SNAPSHOT_MAX_ACTIVE && active == NULL; i++) {
+        if (snapshot.active[i].in_use && snapshot.active[i].id == frame->argument) active = &snapshot.active[i];
+    }
+
+    if (active == NULL) {
+        if (has_failed(frame->argument)) return;
+        stub_hold_traffic();
+        active = record_state(frame->argument, frame->source);
+        stub_release_traffic();
+    } else if (active->open[rank]) {
+        active->open[rank] = 0;
+        active->markers_missing--;
+    }
+    if (active != NULL && active->markers_missing == 0) finish_snapshot(active);
+}
@@ -0,0 +1,57 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+/* Serialized global snapshot. Every member of the snapshot group appends
+   one section to snapshot-<id>.snap, in the directory named by
+   STUB_SNAPSHOT_DIR or else the working directory, with a single write,
+   so the sections of processes sharing the directory never interleave.
+   A section is a snapshot_section followed by state_length bytes of
+   application state, channel_count snapshot_channel records and
+   message_count snapshot_message records, in native byte order like the
+   traces. */
+#define SNAPSHOT_MAGIC 0x50414E53u
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_MAX_STATE (64 * 1024)
+#define SNAPSHOT_DIR_ENV "STUB_SNAPSHOT_DIR"
+
+/* lamport is the clock of the process when it recorded its state */
+struct snapshot_section {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t process_id;
+    uint32_t snapshot_id;
+    uint32_t lamport;
+    uint32_t state_length;
+    uint32_t channel_count;
+    uint32_t message_count;
+    uint32_t reserved;
+};
+
+/* One record per other member. sent and received count the application
+   messages exchanged with peer before the state was recorded; in_flight
+   counts those that arrived from peer after that but before its marker,
+   which are the state of the channel. In a consistent snapshot, what peer
+   sent to this process equals received + in_flight here. */
+struct snapshot_channel {
+    uint16_t peer;
+    uint16_t reserved;
+    uint32_t sent;
+    uint32_t received;
+    uint32_t in_flight;
+};
+
+/* The in-flight messages, grouped by channel in the order of the channel
+   records and in arrival order within each. Multicast messages are
+   marked with SNAPSHOT_MESSAGE_MULTICAST in flags. */
+#define SNAPSHOT_MESSAGE_MULTICAST 0x01
+
+struct snapshot_message {
+    uint16_t source;
+    uint8_t action;
+    uint8_t flags;
+    uint32_t clock;
+};
+
+#endif
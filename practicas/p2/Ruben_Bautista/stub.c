@@ -1,55 +1,246 @@
+#define _GNU_SOURCE
 #include "stub.h"
+#include "stub_internal.h"
+#include "wire.h"
+#include "trace.h"
+#include "shm.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
+#define RECV_BUFFER_SIZE 65536
+#define MAX_EPOLL_EVENTS 64
+#define MAX_BATCH 1024
+#define MAX_FORWARD (RECV_BUFFER_SIZE / WIRE_MIN_FRAME)
+#define OUTBOX_LIMIT (4 * 1024 * 1024)
+#define RETRANSMIT_LIMIT (1024 * 1024)
+#define RETRANSMIT_HARD_LIMIT (16 * RETRANSMIT_LIMIT)
+#define ACK_EVERY 32
+#define ACK_DELAY_MS 10
+#define RECONNECT_MIN_MS 10
+#define RECONNECT_MAX_MS 1000
+
 static unsigned int lamport_clock = 0;
 static int is_running = 1;
 static pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Hybrid logical clock, kept under clock_mutex next to the Lamport clock
+   once enable_hlc is called. hlc_enabled is set under clock_mutex too but
+   read atomically outside it. hlc_max_skew_ms is how far ahead of this
+   host's wall clock a received timestamp may be without being counted as
+   a skew violation, -1 for no bound. */
+static int hlc_enabled;
+static int event_log_enabled;
+static unsigned long long hlc_clock;
+static long long hlc_max_skew_ms = -1;
+
 static char process_name[MAX_PROCESS_NAME];
+static int process_id;
 static int server_socket;
 static int server_port;
+static struct sockaddr_in server_address;
+static int is_hub;
+static int epoll_fd = -1;
+static int wakeup_fd = -1;
 static pthread_t receiver_thread_id;
 
-static struct client_connections {
-    int p1_socket;
-    int p3_socket;
+/* With the shared-memory transport a second thread, the ring thread,
+   sleeps on this process's doorbell and reads the rings. receive_mutex
+   makes it and the receiver thread take turns, so frames are still
+   dispatched by one thread at a time. */
+static struct shm_segment* shm_segment;
+static struct shm_doorbell* local_doorbell;
+static pthread_t ring_thread_id;
+static pthread_mutex_t receive_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int is_receiving_thread;
+
+/* With snapshots, application messages are sent holding send_gate for
+   reading, and a snapshot is recorded holding it for writing together
+   with receive_mutex, so every message is sent and received either
+   before or after the recording. holds_send_gate marks a thread inside
+   the gate, which must not wait for room in an outbox. */
+static pthread_rwlock_t send_gate;
+static int send_gate_enabled;
+static __thread int holds_send_gate;
+
+/* Every connection owned by the receiver loop keeps the trailing bytes of a
+   frame split across recv calls, so partial messages are never lost.
+   process_id is -1 until the first frame tells who is on the other side.
+   Bytes the socket does not accept right away wait in the outbox until
+   epoll reports the socket writable; send_mutex orders all writers.
+
+   A slot holds a session, which outlives its connection: socket is -1
+   while the connection is down. Frames other than link frames are
+   numbered by their position in the session, so sent_frames and
+   received_frames are sequence numbers that cost nothing on the wire.
+   Sent frames stay in the retransmit buffer, from retransmit_start on,
+   until the peer acknowledges them; the first of them is number
+   retransmit_first. After a reconnect both sides exchange HELLOs with
+   the number of frames they received and resend the rest.
+
+   link is the shared-memory link of a local peer, or -1. Once ring_out is
+   set, frames to the peer go to that ring instead of the socket (the
+   outbox then holds what did not fit in the ring) and are not kept for
+   retransmission: the ring does not lose them. Frames from the peer are
+   read from ring_in, with their own trailing partial frame. The socket
+   stays open and carries the link frames. */
+struct peer {
+    int in_use;
+    int socket;
+    int process_id;
+    uint8_t partial[WIRE_MAX_FRAME];
+    size_t partial_length;
+    pthread_mutex_t send_mutex;
+    pthread_cond_t drained;
+    uint8_t* outbox;
+    size_t outbox_length;
+    size_t outbox_capacity;
+    uint32_t sent_frames;
+    uint32_t received_frames;
+    uint32_t acked_frames;
+    uint8_t* retransmit;
+    size_t retransmit_start;
+    size_t retransmit_length;
+    size_t retransmit_capacity;
+    uint32_t retransmit_first;
+    int resuming;
+    int closed;
+    int link;
+    struct shm_ring* ring_in;
+    struct shm_ring* ring_out;
+    struct shm_doorbell* remote_doorbell;
+    uint8_t ring_partial[WIRE_MAX_FRAME];
+    size_t ring_partial_length;
+};
+
+/* Scratch space of the thread holding receive_mutex: one recv (or ring
+   read) drains up to RECV_BUFFER_SIZE bytes and the whole frames in them
+   are dispatched in batches of up to MAX_BATCH messages. */
+static uint8_t receive_buffer[RECV_BUFFER_SIZE];
+static struct message receive_batch[MAX_BATCH];
+
+static struct peer_table {
+    struct peer peers[MAX_PEERS];
+    int count;
     pthread_mutex_t mutex;
-} clients = {-1, -1, PTHREAD_MUTEX_INITIALIZER};
+} peer_table = {.count = 0, .mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/* Frames P2 relays for other processes, collected per read */
+static struct forward_entry {
+    uint16_t destination;
+    uint32_t offset;
+    uint32_t length;
+} forward_list[MAX_FORWARD];
+static uint8_t forward_buffer[RECV_BUFFER_SIZE];
+
+static struct stub_stats stats;
+
+/* Pending acks are sent when this timer, armed on the first unacknowledged frame, expires */
+static int ack_timer_armed;
+static struct timespec ack_deadline;
+
+/* A client whose connection to P2 failed tries again when this timer
+   expires. connecting_socket is the attempt in progress, or -1; the timer
+   then bounds how long it may take. */
+static int reconnect_armed;
+static struct timespec reconnect_deadline;
+static int reconnect_delay_ms;
+static int connecting_socket = -1;
+
+/* Markers stored in epoll_event.data.ptr for the descriptors that are not peers */
+static int listen_marker;
+static int wakeup_marker;
+static int connect_marker;
+
+/* The message queue has one FIFO lane of MAX_MESSAGE_QUEUE messages per
+   priority. receive_message takes from the highest lane that is not
+   empty, except that a lane passed over QUEUE_STARVATION_LIMIT times in a
+   row is served next, so busy higher lanes can only delay a message by a
+   bounded number of others. Messages of one operation share a lane and
+   keep their order. */
+#define QUEUE_STARVATION_LIMIT 8
+
+struct queued_message {
+    struct message message;
+    struct timespec queued;
+};
 
 static struct message_queue {
-    struct message messages[MAX_MESSAGE_QUEUE];
-    int front;
-    int rear;
+    struct queue_lane {
+        struct queued_message entries[MAX_MESSAGE_QUEUE];
+        int front;
+        int rear;
+        int count;
+        int passed_over;
+    } lanes[PRIORITY_LANES];
     int count;
+    enum message_priority priorities[SHUTDOWN_ACK + 1];
+    pthread_mutex_t mutex;
+} msg_queue = {.priorities = {PRIORITY_NORMAL, PRIORITY_HIGH, PRIORITY_HIGH},
+               .mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static struct handler_table {
+    struct handler_entry {
+        message_handler handler;
+        void* ctx;
+    } entries[SHUTDOWN_ACK + 1];
     pthread_mutex_t mutex;
-} msg_queue;
+} handler_table = {.mutex = PTHREAD_MUTEX_INITIALIZER};
 
 static void init_message_queue() {
-    msg_queue.front = 0;
-    msg_queue.rear = 0;
+    for (int lane = 0; lane < PRIORITY_LANES; lane++) {
+        msg_queue.lanes[lane].front = 0;
+        msg_queue.lanes[lane].rear = 0;
+        msg_queue.lanes[lane].count = 0;
+        msg_queue.lanes[lane].passed_over = 0;
+    }
     msg_queue.count = 0;
     pthread_mutex_init(&msg_queue.mutex, NULL);
 }
 
-/* enqueue_message adds a message to the message queue by locking the mutex,
-checking if there is space in the queue, and then adding the message. */
-static void enqueue_message(const struct message* msg) {
+/* enqueue_messages adds a batch of messages to the message queue under a
+single lock, dropping whatever does not fit in the queue. */
+static void enqueue_messages(const struct message* msgs, int count) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
     pthread_mutex_lock(&msg_queue.mutex);
-    if (msg_queue.count < MAX_MESSAGE_QUEUE) {
-        msg_queue.messages[msg_queue.rear] = *msg;
-        msg_queue.rear = (msg_queue.rear + 1) % MAX_MESSAGE_QUEUE;
+    for (int i = 0; i < count; i++) {
+        struct queue_lane* lane = &msg_queue.lanes[msg_queue.priorities[msgs[i].action]];
+        if (lane->count == MAX_MESSAGE_QUEUE) continue;
+        lane->entries[lane->rear].message = msgs[i];
+        lane->entries[lane->rear].queued = now;
+        lane->rear = (lane->rear + 1) % MAX_MESSAGE_QUEUE;
+        lane->count++;
         msg_queue.count++;
     }
     pthread_mutex_unlock(&msg_queue.mutex);
 }
 
+/* set_operation_priority picks the queue lane of the messages with the
+   given action that arrive from now on. */
+int set_operation_priority(enum operations action, enum message_priority priority) {
+    if (action < READY_TO_SHUTDOWN || action > SHUTDOWN_ACK || priority < PRIORITY_HIGH || priority >= PRIORITY_LANES) {
+        return -1;
+    }
+    pthread_mutex_lock(&msg_queue.mutex);
+    msg_queue.priorities[action] = priority;
+    pthread_mutex_unlock(&msg_queue.mutex);
+    return 0;
+}
+
 int get_clock_lamport() {
     int current_clock;
     pthread_mutex_lock(&clock_mutex);
@@ -58,116 +249,1136 @@ int get_clock_lamport() {
     return current_clock;
 }
 
-static void increment_clock() {
+/* hlc_wall_clock returns the wall clock as an HLC value with a zero counter. */
+static unsigned long long hlc_wall_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return ((unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000) << HLC_LOGICAL_BITS;
+}
+
+/* hlc_send reserves count consecutive HLC values for sends and returns the
+   first: the wall clock if it is ahead of the clock, else the next
+   counter value. Must be called with clock_mutex held. */
+static unsigned long long hlc_send(int count) {
+    unsigned long long wall = hlc_wall_clock();
+    unsigned long long first = wall > hlc_clock ? wall : hlc_clock + 1;
+    hlc_clock = first + count - 1;
+    return first;
+}
+
+/* hlc_receive applies the HLC receive rule to a received timestamp, with
+   wall read once for the whole batch. A timestamp beyond the skew bound
+   is rejected: it is counted and the HLC is left untouched, so one host
+   with a clock far ahead cannot drag every other clock with it. The
+   frame is still delivered and its Lamport clock still merged, which
+   keeps the causal order of that message; only its HLC order is lost.
+   Must be called with clock_mutex held. */
+static void hlc_receive(unsigned long long remote, unsigned long long wall) {
+    if (hlc_max_skew_ms >= 0 && remote > wall + ((unsigned long long)hlc_max_skew_ms << HLC_LOGICAL_BITS)) {
+        __atomic_fetch_add(&stats.hlc_skew_exceeded, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    unsigned long long latest = remote > hlc_clock ? remote : hlc_clock;
+    hlc_clock = wall > latest ? wall : latest + 1;
+}
+
+/* enable_event_log turns on or off the text log of the SEND and RECV
+   events of application messages on stdout, off by default. */
+void enable_event_log(int enabled) {
+    __atomic_store_n(&event_log_enabled, enabled != 0, __ATOMIC_RELAXED);
+}
+
+/* enable_hlc makes the stub stamp every frame it sends with its hybrid
+   logical clock and merge the timestamps it receives, like the Lamport
+   clock. With a non-negative max_skew_ms, received timestamps further
+   ahead of the local wall clock are not merged into the HLC (their
+   Lamport clock still is) and are counted in hlc_skew_exceeded. The
+   clock never goes back, even if the wall clock does. */
+int enable_hlc(int max_skew_ms) {
+    pthread_mutex_lock(&clock_mutex);
+    hlc_max_skew_ms = max_skew_ms < 0 ? -1 : max_skew_ms;
+    unsigned long long wall = hlc_wall_clock();
+    if (wall > hlc_clock) hlc_clock = wall;
+    __atomic_store_n(&hlc_enabled, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&clock_mutex);
+    return 0;
+}
+
+/* get_clock_hlc returns the hybrid logical clock, 0 until enable_hlc. */
+unsigned long long get_clock_hlc(void) {
+    pthread_mutex_lock(&clock_mutex);
+    unsigned long long current_clock = hlc_enabled ? hlc_clock : 0;
+    pthread_mutex_unlock(&clock_mutex);
+    return current_clock;
+}
+
+/* deliver_messages logs a batch of messages, if the event log is on, and
+   hands them to the application: messages whose operation has a registered handler are
+   delivered to it right away, on the calling thread; the rest go to the
+   message queue. */
+static void deliver_messages(const struct message* msgs, int count) {
+    struct message unhandled[MAX_BATCH];
+    struct handler_entry handlers[SHUTDOWN_ACK + 1];
+    int unhandled_count = 0;
+
+    for (int i = 0; i < count && __atomic_load_n(&event_log_enabled, __ATOMIC_RELAXED); i++) {
+        printf("%s, %d, RECV (%s), ", process_name, msgs[i].clock_lamport, msgs[i].origin);
+        switch (msgs[i].action) {
+            case READY_TO_SHUTDOWN: printf("READY_TO_SHUTDOWN\n"); break;
+            case SHUTDOWN_NOW: printf("SHUTDOWN_NOW\n"); break;
+            case SHUTDOWN_ACK: printf("SHUTDOWN_ACK\n"); break;
+        }
+    }
+
+    pthread_mutex_lock(&handler_table.mutex);
+    memcpy(handlers, handler_table.entries, sizeof(handlers));
+    pthread_mutex_unlock(&handler_table.mutex);
+
+    for (int i = 0; i < count; i++) {
+        if (handlers[msgs[i].action].handler == NULL) {
+            unhandled[unhandled_count++] = msgs[i];
+        }
+    }
+    if (unhandled_count > 0) enqueue_messages(unhandled, unhandled_count);
+
+    for (int i = 0; i < count; i++) {
+        struct handler_entry* entry = &handlers[msgs[i].action];
+        if (entry->handler != NULL) entry->handler(&msgs[i], entry->ctx);
+    }
+}
+
+void stub_deliver(const struct message* msgs, int count) {
+    for (int first = 0; first < count; first += MAX_BATCH) {
+        deliver_messages(msgs + first, count - first < MAX_BATCH ? count - first : MAX_BATCH);
+    }
+}
+
+/* process_received_messages merges the clocks of a whole batch under one
+   lock acquisition, applying the Lamport receive rule message by message,
+   and delivers the batch. */
+static void process_received_messages(const struct message* msgs, int count) {
+    static unsigned int local_clocks[MAX_BATCH];
+    struct timespec merge_start, merge_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &merge_start);
+    unsigned long long wall = __atomic_load_n(&hlc_enabled, __ATOMIC_ACQUIRE) ? hlc_wall_clock() : 0;
     pthread_mutex_lock(&clock_mutex);
-    lamport_clock++;
+    for (int i = 0; i < count; i++) {
+        if (msgs[i].clock_lamport > lamport_clock) {
+            lamport_clock = msgs[i].clock_lamport;
+        }
+        local_clocks[i] = ++lamport_clock;
+        if (wall != 0 && msgs[i].clock_hlc != 0) hlc_receive(msgs[i].clock_hlc, wall);
+    }
     pthread_mutex_unlock(&clock_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &merge_end);
+
+    __atomic_fetch_add(&stats.messages_received, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.receive_batches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.clock_merge_ns,
+                       (merge_end.tv_sec - merge_start.tv_sec) * 1000000000ull +
+                       merge_end.tv_nsec - merge_start.tv_nsec, __ATOMIC_RELAXED);
+
+    uint32_t first_sequence = trace_reserve(count);
+    for (int i = 0; i < count; i++) {
+        trace_event(TRACE_RECV, first_sequence + i, msgs[i].action, wire_process_id(msgs[i].origin),
+                    msgs[i].clock_lamport, local_clocks[i]);
+    }
+    deliver_messages(msgs, count);
 }
 
-static void update_clock_on_receive(int received_clock) {
+/* process_control_frame applies the Lamport receive rule to a frame of one
+   of the stub's own protocols and hands it to the protocol owning the opcode. */
+static void process_control_frame(const struct wire_frame* frame) {
+    unsigned long long wall = __atomic_load_n(&hlc_enabled, __ATOMIC_ACQUIRE) && frame->hlc != 0 ? hlc_wall_clock() : 0;
     pthread_mutex_lock(&clock_mutex);
-    if (received_clock > lamport_clock) {
-        lamport_clock = received_clock;
+    if (frame->clock > lamport_clock) {
+        lamport_clock = frame->clock;
     }
-    lamport_clock++;
+    unsigned int local_clock = ++lamport_clock;
+    if (wall != 0) hlc_receive(frame->hlc, wall);
     pthread_mutex_unlock(&clock_mutex);
+
+    __atomic_fetch_add(&stats.control_received, 1, __ATOMIC_RELAXED);
+    trace_event(TRACE_RECV, trace_reserve(1), frame->opcode, frame->source, frame->clock, local_clock);
+    switch (frame->opcode) {
+        case WIRE_OP_BARRIER: barrier_receive(frame); break;
+        case WIRE_OP_MULTICAST:
+        case WIRE_OP_MULTICAST_ACK: multicast_receive(frame); break;
+        case WIRE_OP_LOCK_REQUEST:
+        case WIRE_OP_LOCK_REPLY: dist_lock_receive(frame); break;
+        case WIRE_OP_SNAPSHOT_MARKER:
+        case WIRE_OP_SNAPSHOT_DONE: snapshot_receive(frame); break;
+        default: break;
+    }
 }
 
-static void process_received_message(const struct message* msg) {
-    update_clock_on_receive(msg->clock_lamport);
-    enqueue_message(msg);
-    
-    printf("%s, %d, RECV (%s), ", process_name, msg->clock_lamport, msg->origin);
-    switch (msg->action) {
-        case READY_TO_SHUTDOWN: printf("READY_TO_SHUTDOWN\n"); break;
-        case SHUTDOWN_NOW: printf("SHUTDOWN_NOW\n"); break;
-        case SHUTDOWN_ACK: printf("SHUTDOWN_ACK\n"); break;
+/* register_handler makes the receiver thread call handler for every message
+   with the given action instead of queueing it. A NULL handler restores
+   delivery through receive_message. Handlers run on the receiver thread, or
+   on the ring thread for messages that came through shared memory, so
+   they must not block for long: no other message is read meanwhile. */
+int register_handler(enum operations action, message_handler handler, void* ctx) {
+    if (action < READY_TO_SHUTDOWN || action > SHUTDOWN_ACK) return -1;
+
+    pthread_mutex_lock(&handler_table.mutex);
+    handler_table.entries[action].handler = handler;
+    handler_table.entries[action].ctx = ctx;
+    pthread_mutex_unlock(&handler_table.mutex);
+    return 0;
+}
+
+/* attach_socket makes a connected socket the connection of a peer slot and
+   registers it in the epoll set. Nagle is disabled: frames are tiny and
+   writes are already batched, so holding one back for the previous ACK
+   only adds delayed-ACK stalls. */
+static int attach_socket(struct peer* peer, int socket) {
+    int nodelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    pthread_mutex_lock(&peer->send_mutex);
+    peer->socket = socket;
+    peer->partial_length = 0;
+    if (peer->ring_out == NULL) peer->outbox_length = 0;
+    pthread_mutex_unlock(&peer->send_mutex);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = peer;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &event) < 0) {
+        pthread_mutex_lock(&peer->send_mutex);
+        peer->socket = -1;
+        pthread_mutex_unlock(&peer->send_mutex);
+        return -1;
     }
+    return 0;
 }
 
-/* process manages communication with a connected client,
-   including receiving messages and updating client information. */
-static void* process(void* arg) {
-    int client_socket = *((int*)arg);
-    free(arg);
+/* add_peer opens a new session in a free slot of the peer table for a
+   connected socket. */
+static int add_peer(int socket) {
+    pthread_mutex_lock(&peer_table.mutex);
+    struct peer* peer = NULL;
+    for (int i = 0; i < peer_table.count; i++) {
+        if (!peer_table.peers[i].in_use) {
+            peer = &peer_table.peers[i];
+            break;
+        }
+    }
+    if (peer == NULL && peer_table.count < MAX_PEERS) {
+        peer = &peer_table.peers[peer_table.count++];
+        pthread_mutex_init(&peer->send_mutex, NULL);
+        pthread_cond_init(&peer->drained, NULL);
+        peer->outbox = NULL;
+        peer->outbox_capacity = 0;
+        peer->retransmit = NULL;
+        peer->retransmit_capacity = 0;
+    }
+    if (peer == NULL) {
+        pthread_mutex_unlock(&peer_table.mutex);
+        return -1;
+    }
+    pthread_mutex_lock(&peer->send_mutex);
+    peer->in_use = 1;
+    peer->process_id = -1;
+    peer->sent_frames = peer->received_frames = peer->acked_frames = 0;
+    peer->retransmit_start = peer->retransmit_length = 0;
+    peer->retransmit_first = 0;
+    peer->resuming = 0;
+    peer->closed = 0;
+    peer->link = -1;
+    peer->ring_in = peer->ring_out = NULL;
+    peer->ring_partial_length = 0;
+    pthread_mutex_unlock(&peer->send_mutex);
+    pthread_mutex_unlock(&peer_table.mutex);
 
-    /* Handle incoming messages from the client .
-    If the message is valid, process it; otherwise, ignore it. */
-    while (is_running) {
-        struct message received_msg;
-        ssize_t bytes_read = recv(client_socket, &received_msg, sizeof(received_msg), 0);
-        
-        if (bytes_read == sizeof(received_msg)) {
-            pthread_mutex_lock(&clients.mutex);
-            if (strcmp(received_msg.origin, "P1") == 0) {
-                if (clients.p1_socket != -1) close(clients.p1_socket);
-                clients.p1_socket = client_socket;
-            } else if (strcmp(received_msg.origin, "P3") == 0) {
-                if (clients.p3_socket != -1) close(clients.p3_socket);
-                clients.p3_socket = client_socket;
+    if (attach_socket(peer, socket) != 0) {
+        pthread_mutex_lock(&peer_table.mutex);
+        peer->in_use = 0;
+        pthread_mutex_unlock(&peer_table.mutex);
+        return -1;
+    }
+    return 0;
+}
+
+/* detach_socket closes the connection of a peer but keeps its session, so a
+   new connection can resume it. Frames sent meanwhile wait in the
+   retransmit buffer. Must be called with send_mutex held. */
+static void detach_socket(struct peer* peer) {
+    if (peer->socket != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, peer->socket, NULL);
+        close(peer->socket);
+        peer->socket = -1;
+    }
+    peer->partial_length = 0;
+    if (peer->ring_out == NULL) peer->outbox_length = 0;
+    peer->resuming = 1;
+    pthread_cond_broadcast(&peer->drained);
+}
+
+/* drop_link stops using the shared-memory link of a peer; P2 frees it for
+   other clients. Must be called with send_mutex held. */
+static void drop_link(struct peer* peer) {
+    if (peer->link < 0) return;
+    if (is_hub) shm_release_link(shm_segment, peer->link);
+    if (peer->ring_out != NULL) peer->outbox_length = 0;
+    peer->link = -1;
+    peer->ring_in = peer->ring_out = NULL;
+    peer->ring_partial_length = 0;
+}
+
+/* remove_peer closes a peer connection and ends its session, freeing the
+   slot. Only the receiver thread calls it, so the slot cannot be reused
+   underneath it. Senders blocked on a full outbox are woken up and fail. */
+static void remove_peer(struct peer* peer) {
+    pthread_mutex_lock(&peer_table.mutex);
+    pthread_mutex_lock(&peer->send_mutex);
+    detach_socket(peer);
+    drop_link(peer);
+    peer->in_use = 0;
+    peer->process_id = -1;
+    peer->retransmit_start = peer->retransmit_length = 0;
+    pthread_mutex_unlock(&peer->send_mutex);
+    pthread_mutex_unlock(&peer_table.mutex);
+}
+
+/* watch_writable asks epoll to report when the peer socket can take more
+   bytes, which is only needed while the outbox holds data. */
+static void watch_writable(struct peer* peer, int enabled) {
+    struct epoll_event event;
+    event.events = EPOLLIN | (enabled ? EPOLLOUT : 0);
+    event.data.ptr = peer;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, peer->socket, &event);
+}
+
+/* send_pending writes as much of data as the socket takes without
+   blocking and returns the bytes written, or -1 if the connection failed.
+   Must be called with send_mutex held. */
+static ssize_t send_pending(struct peer* peer, const uint8_t* data, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t bytes_sent = send(peer->socket, data + written, length - written,
+                                  MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (bytes_sent < 0 && errno == EINTR) continue;
+        if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (bytes_sent <= 0) return -1;
+        written += bytes_sent;
+    }
+    return written;
+}
+
+/* write_pending hands data to the transport of the peer, its ring or its
+   socket, and returns the bytes it took or -1 if the connection failed.
+   Must be called with send_mutex held. */
+static ssize_t write_pending(struct peer* peer, const uint8_t* data, size_t length) {
+    if (peer->ring_out != NULL) return shm_ring_write(peer->ring_out, data, length, peer->remote_doorbell);
+    return send_pending(peer, data, length);
+}
+
+/* queue_bytes writes data to the peer, keeping in the outbox whatever the
+   transport does not take right away. Returns -1 if the connection
+   failed. Must be called with send_mutex held. */
+static int queue_bytes(struct peer* peer, const uint8_t* data, size_t length) {
+    ssize_t written = 0;
+    if (peer->outbox_length == 0) {
+        written = write_pending(peer, data, length);
+        if (written < 0) return -1;
+    }
+    if ((size_t)written < length) {
+        size_t needed = peer->outbox_length + length - written;
+        if (needed > peer->outbox_capacity) {
+            size_t capacity = peer->outbox_capacity ? peer->outbox_capacity : RECV_BUFFER_SIZE;
+            while (capacity < needed) capacity *= 2;
+            uint8_t* outbox = realloc(peer->outbox, capacity);
+            if (outbox == NULL) return -1;
+            peer->outbox = outbox;
+            peer->outbox_capacity = capacity;
+        }
+        if (peer->outbox_length == 0 && peer->ring_out == NULL) watch_writable(peer, 1);
+        memcpy(peer->outbox + peer->outbox_length, data + written, length - written);
+        peer->outbox_length += length - written;
+    }
+    return 0;
+}
+
+/* retransmit_skip drops up to count frames from the front of the
+   retransmit buffer and returns how many it dropped. Frames carry their
+   own length, so the buffer needs no index. Must be called with
+   send_mutex held. */
+static uint32_t retransmit_skip(struct peer* peer, uint32_t count) {
+    struct wire_frame frame;
+    uint32_t skipped = 0;
+    while (skipped < count && peer->retransmit_start < peer->retransmit_length) {
+        int used = wire_decode(peer->retransmit + peer->retransmit_start,
+                               peer->retransmit_length - peer->retransmit_start, &frame);
+        if (used <= 0) break;
+        peer->retransmit_start += used;
+        skipped++;
+    }
+    peer->retransmit_first += skipped;
+    return skipped;
+}
+
+/* retransmit_full tells whether keeping length more bytes would take the
+   retransmit buffer of the peer over limit. An empty buffer always takes
+   a batch. Must be called with send_mutex held. */
+static int retransmit_full(const struct peer* peer, size_t length, size_t limit) {
+    size_t pending = peer->retransmit_length - peer->retransmit_start;
+    return length > 0 && peer->ring_out == NULL && pending > 0 && pending + length > limit;
+}
+
+/* encode_link_frame encodes a link frame for the peer into buffer and
+   returns its length. */
+static size_t encode_link_frame(const struct peer* peer, uint8_t opcode, uint32_t argument, uint8_t* buffer) {
+    struct wire_frame frame = {.opcode = opcode, .flags = WIRE_FLAG_ARGUMENT, .source = process_id,
+                               .destination = peer->process_id >= 0 ? peer->process_id : 0,
+                               .clock = 0, .argument = argument};
+    return wire_encode(&frame, buffer);
+}
+
+/* end_session closes the session with the peer for good when it can no
+   longer be resumed without losing frames, and the receiver thread removes
+   it once the connection is gone. The peer is told with a LINK_CLOSE when
+   the socket is free to take one; otherwise it finds out when it tries
+   to resume, since this end then has no session to resume. Must be called
+   with send_mutex held. */
+static void end_session(struct peer* peer, const char* reason) {
+    fprintf(stderr, "%s: closing the session with process %d: %s\n", process_name, peer->process_id, reason);
+    peer->closed = 1;
+    if (peer->socket != -1) {
+        uint8_t buffer[WIRE_MAX_FRAME];
+        if (peer->ring_out != NULL || peer->outbox_length == 0) {
+            send_pending(peer, buffer, encode_link_frame(peer, WIRE_OP_LINK_CLOSE, 0, buffer));
+        }
+        shutdown(peer->socket, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&peer->drained);
+}
+
+/* retransmit_append keeps a copy of frames sent in the session until the
+   peer acknowledges them; nothing unacknowledged is ever dropped.
+   Application threads wait for room below RETRANSMIT_LIMIT before calling
+   it, but the threads that cannot wait may go past it. Past
+   RETRANSMIT_HARD_LIMIT, which only a peer that stays away for long can
+   cause, the session is ended instead. Must be called with send_mutex
+   held. */
+static int retransmit_append(struct peer* peer, const uint8_t* data, size_t length, int frames) {
+    if (retransmit_full(peer, length, RETRANSMIT_HARD_LIMIT)) {
+        end_session(peer, "too many frames waiting for acknowledgement");
+        return -1;
+    }
+    size_t pending = peer->retransmit_length - peer->retransmit_start;
+    if (peer->retransmit_length + length > peer->retransmit_capacity) {
+        memmove(peer->retransmit, peer->retransmit + peer->retransmit_start, pending);
+        peer->retransmit_start = 0;
+        peer->retransmit_length = pending;
+    }
+    if (pending + length > peer->retransmit_capacity) {
+        size_t capacity = peer->retransmit_capacity ? peer->retransmit_capacity : RECV_BUFFER_SIZE;
+        while (capacity < pending + length) capacity *= 2;
+        uint8_t* retransmit = realloc(peer->retransmit, capacity);
+        if (retransmit == NULL) return -1;
+        peer->retransmit = retransmit;
+        peer->retransmit_capacity = capacity;
+    }
+    memcpy(peer->retransmit + peer->retransmit_length, data, length);
+    peer->retransmit_length += length;
+    peer->sent_frames += frames;
+    return 0;
+}
+
+/* wait_for_room blocks while the peer's outbox is over OUTBOX_LIMIT, or
+   while its retransmit buffer has no room for retained more bytes. The
+   latter also waits while the connection is down: the sender is held
+   back until the session resumes and the peer acknowledges what it got,
+   or the session ends. Must be called with peer->send_mutex held. */
+static void wait_for_room(struct peer* peer, size_t retained) {
+    while (peer->in_use && !peer->closed &&
+           (((peer->socket != -1 || peer->ring_out != NULL) && peer->outbox_length > OUTBOX_LIMIT) ||
+            retransmit_full(peer, retained, RETRANSMIT_LIMIT))) {
+        pthread_cond_wait(&peer->drained, &peer->send_mutex);
+    }
+}
+
+/* peer_send queues frames for the peer without ever blocking on the socket:
+   whatever it does not accept right away goes to the outbox, which the
+   receiver (or ring) thread flushes. Application threads wait while the
+   outbox is over OUTBOX_LIMIT or the retransmit buffer is full; those two
+   threads never wait, so relaying frames or replying from a handler cannot
+   deadlock two processes. Neither does a thread inside the send gate,
+   which would keep a snapshot from recording.
+   frames is how many frames data holds; they are kept for retransmission,
+   and while the connection is down or resuming they are only kept there.
+   Link frames (frames == 0) are not, nor frames going to a ring.
+   expected_id guards against the slot having been reused meanwhile. */
+static int peer_send(struct peer* peer, int expected_id, const uint8_t* data, size_t length, int frames) {
+    pthread_mutex_lock(&peer->send_mutex);
+    if (!is_receiving_thread && !holds_send_gate) wait_for_room(peer, frames > 0 ? length : 0);
+    if (!peer->in_use || peer->closed || (expected_id >= 0 && peer->process_id != expected_id) ||
+        (frames > 0 && peer->ring_out == NULL && retransmit_append(peer, data, length, frames) != 0)) {
+        pthread_mutex_unlock(&peer->send_mutex);
+        return -1;
+    }
+
+    /* A failed write leaves the frames for the reconnection to resend */
+    int result = 0;
+    if (peer->ring_out != NULL) {
+        result = queue_bytes(peer, data, length);
+    } else if (peer->socket != -1 && !peer->resuming && queue_bytes(peer, data, length) != 0 && frames == 0) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&peer->send_mutex);
+    return result;
+}
+
+/* link_send sends a link frame: it belongs to this connection only, is not
+   sequenced and leaves the Lamport clock alone. Link frames always travel
+   on the socket; once the peer is written through a ring nothing else
+   does, so they are written straight away. */
+static void link_send(struct peer* peer, uint8_t opcode, uint32_t argument) {
+    uint8_t buffer[WIRE_MAX_FRAME];
+    size_t length = encode_link_frame(peer, opcode, argument, buffer);
+
+    pthread_mutex_lock(&peer->send_mutex);
+    if (peer->socket != -1 && peer->ring_out != NULL) {
+        send_pending(peer, buffer, length);
+    } else if (peer->socket != -1) {
+        queue_bytes(peer, buffer, length);
+    }
+    pthread_mutex_unlock(&peer->send_mutex);
+}
+
+/* switch_to_ring sends the peer a LINK_SHM marker on the socket and, if
+   nothing is left queued for the socket before it, sends every later
+   frame through the ring. The peer only starts reading the ring after the
+   marker, so it still gets all frames in order. While bytes wait in the
+   outbox no marker is sent and the peer keeps being written through the
+   socket. Must be called with send_mutex held. */
+static void switch_to_ring(struct peer* peer, struct shm_ring* ring) {
+    uint8_t buffer[WIRE_MAX_FRAME];
+    size_t length = encode_link_frame(peer, WIRE_OP_LINK_SHM, peer->link, buffer);
+
+    if (peer->socket == -1 || peer->outbox_length > 0) return;
+    if (queue_bytes(peer, buffer, length) == 0 && peer->outbox_length == 0) {
+        peer->ring_out = ring;
+        __atomic_fetch_add(&stats.shm_links, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* offer_link claims a link in the segment of the local P2 and offers it
+   with a LINK_SHM frame. The handshake then takes three frames, all on
+   the socket: the offer; P2's marker, after which P2 writes to the ring;
+   and this side's marker, after which it does too. */
+static void offer_link(struct peer* peer) {
+    shm_segment = shm_attach(server_port);
+    if (shm_segment == NULL) return;
+    int index = shm_claim_link(shm_segment, process_id);
+    if (index < 0) {
+        shm_detach(shm_segment, server_port, 0);
+        shm_segment = NULL;
+        return;
+    }
+    struct shm_link* link = &shm_segment->links[index];
+    local_doorbell = &link->client_doorbell;
+    peer->link = index;
+    peer->remote_doorbell = &shm_segment->hub_doorbell;
+    link_send(peer, WIRE_OP_LINK_SHM, index);
+}
+
+/* process_link_offer handles a LINK_SHM frame. In P2 it is either a new
+   offer, answered with P2's marker (or SHM_NO_LINK), or the client's
+   marker, after which its ring is read. In a client it is P2's marker,
+   answered with the client's own. The ring thread is woken up so it
+   looks at a newly enabled ring. */
+static void process_link_offer(struct peer* peer, uint32_t index) {
+    if (!is_hub) {
+        pthread_mutex_lock(&peer->send_mutex);
+        if (index != SHM_NO_LINK && (int)index == peer->link) {
+            peer->ring_in = &shm_segment->links[index].to_client;
+            switch_to_ring(peer, &shm_segment->links[index].to_hub);
+        } else if (peer->link >= 0) {
+            shm_release_link(shm_segment, peer->link);
+            peer->link = -1;
+        }
+        pthread_mutex_unlock(&peer->send_mutex);
+        shm_doorbell_ring(local_doorbell);
+        return;
+    }
+
+    if (shm_segment == NULL || index >= SHM_MAX_LINKS ||
+        __atomic_load_n(&shm_segment->links[index].owner, __ATOMIC_ACQUIRE) != (uint32_t)peer->process_id + 1) {
+        link_send(peer, WIRE_OP_LINK_SHM, SHM_NO_LINK);
+        return;
+    }
+    struct shm_link* link = &shm_segment->links[index];
+    pthread_mutex_lock(&peer->send_mutex);
+    if ((int)index == peer->link) {
+        peer->ring_in = &link->to_hub;
+    } else {
+        /* A restarted process brings a new link; the old one is freed */
+        drop_link(peer);
+        peer->link = index;
+        peer->remote_doorbell = &link->client_doorbell;
+        switch_to_ring(peer, &link->to_client);
+    }
+    pthread_mutex_unlock(&peer->send_mutex);
+    shm_doorbell_ring(local_doorbell);
+}
+
+/* send_ack acknowledges every frame received from the peer so far. */
+static void send_ack(struct peer* peer) {
+    peer->acked_frames = peer->received_frames;
+    link_send(peer, WIRE_OP_LINK_ACK, peer->received_frames);
+}
+
+/* flush_acks acknowledges the frames of every peer that received some
+   since its last ack; the receiver thread calls it ACK_DELAY_MS after the
+   first unacknowledged frame. */
+static void flush_acks(void) {
+    for (int i = 0; i < peer_table.count; i++) {
+        struct peer* peer = &peer_table.peers[i];
+        if (peer->in_use && peer->socket != -1 && peer->received_frames != peer->acked_frames) send_ack(peer);
+    }
+    ack_timer_armed = 0;
+}
+
+/* resume_session resends, on a new connection, the frames the peer did
+   not receive before the previous one failed. peer_received is the count
+   the peer sent in its HELLO. A session ended meanwhile, or a count
+   outside the frames still kept, cannot be resumed without losing or
+   repeating frames, so the session is closed instead. */
+static void resume_session(struct peer* peer, uint32_t peer_received) {
+    pthread_mutex_lock(&peer->send_mutex);
+    uint32_t pending = peer->sent_frames - peer->retransmit_first;
+    uint32_t delivered = peer_received - peer->retransmit_first;
+    if (peer->closed || delivered > pending) {
+        end_session(peer, peer->closed ? "it ended while the connection was down"
+                                       : "it reports frames received that were never kept");
+        pthread_mutex_unlock(&peer->send_mutex);
+        return;
+    }
+    retransmit_skip(peer, delivered);
+    pthread_cond_broadcast(&peer->drained);
+    peer->resuming = 0;
+    if (peer->socket != -1 && peer->retransmit_length > peer->retransmit_start) {
+        queue_bytes(peer, peer->retransmit + peer->retransmit_start,
+                    peer->retransmit_length - peer->retransmit_start);
+    }
+    __atomic_fetch_add(&stats.frames_resent, pending - delivered, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&peer->send_mutex);
+}
+
+/* process_link_frame handles the frames that manage the connection itself. */
+static void process_link_frame(struct peer* peer, const struct wire_frame* frame) {
+    uint32_t acked;
+
+    switch (frame->opcode) {
+        case WIRE_OP_LINK_HELLO:
+            if (is_hub) link_send(peer, WIRE_OP_LINK_HELLO, peer->received_frames);
+            if (peer->resuming) resume_session(peer, frame->argument);
+            break;
+        case WIRE_OP_LINK_ACK:
+            pthread_mutex_lock(&peer->send_mutex);
+            acked = (uint32_t)frame->argument;
+            if (acked - peer->retransmit_first <= peer->sent_frames - peer->retransmit_first) {
+                retransmit_skip(peer, acked - peer->retransmit_first);
+                pthread_cond_broadcast(&peer->drained);
             }
-            pthread_mutex_unlock(&clients.mutex);
-            
-            process_received_message(&received_msg);
-        } else if (bytes_read <= 0) {
+            pthread_mutex_unlock(&peer->send_mutex);
+            break;
+        case WIRE_OP_LINK_CLOSE:
+            peer->closed = 1;
+            break;
+        case WIRE_OP_LINK_SHM:
+            process_link_offer(peer, frame->argument);
+            break;
+    }
+}
+
+/* deadline_after sets deadline to ms milliseconds from now. */
+static void deadline_after(struct timespec* deadline, int ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/* schedule_reconnect arms the reconnect timer delay_ms from now. */
+static void schedule_reconnect(int delay_ms) {
+    reconnect_delay_ms = delay_ms;
+    deadline_after(&reconnect_deadline, delay_ms);
+    reconnect_armed = 1;
+}
+
+/* abandon_connect drops the connection attempt in progress and retries
+   after twice the previous delay, up to RECONNECT_MAX_MS. */
+static void abandon_connect(void) {
+    if (connecting_socket != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connecting_socket, NULL);
+        close(connecting_socket);
+        connecting_socket = -1;
+    }
+    int delay = reconnect_delay_ms * 2;
+    schedule_reconnect(delay > RECONNECT_MAX_MS ? RECONNECT_MAX_MS : delay);
+}
+
+/* connection_established moves a connected socket into the session with
+   P2 and starts resuming it with a HELLO carrying how many frames this
+   side received. */
+static void connection_established(void) {
+    struct peer* peer = &peer_table.peers[0];
+    int new_socket = connecting_socket;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, new_socket, NULL);
+    connecting_socket = -1;
+    if (attach_socket(peer, new_socket) != 0) {
+        close(new_socket);
+        abandon_connect();
+        return;
+    }
+    reconnect_armed = 0;
+    __atomic_fetch_add(&stats.reconnects, 1, __ATOMIC_RELAXED);
+    link_send(peer, WIRE_OP_LINK_HELLO, peer->received_frames);
+}
+
+/* start_connect runs when the reconnect timer expires. It starts a
+   non-blocking connect to P2 that epoll reports on, so the receiver
+   thread never waits for it; an attempt still pending when the timer
+   expires again, RECONNECT_MAX_MS later, is abandoned. */
+static void start_connect(void) {
+    if (connecting_socket != -1) {
+        abandon_connect();
+        return;
+    }
+    connecting_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (connecting_socket < 0) {
+        abandon_connect();
+        return;
+    }
+    int result = connect(connecting_socket, (struct sockaddr*)&server_address, sizeof(server_address));
+    if (result == 0) {
+        connection_established();
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.ptr = &connect_marker;
+    if (errno != EINPROGRESS || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connecting_socket, &event) < 0) {
+        abandon_connect();
+        return;
+    }
+    deadline_after(&reconnect_deadline, RECONNECT_MAX_MS);
+}
+
+/* connect_finished runs when epoll reports the pending connect done. */
+static void connect_finished(void) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (connecting_socket == -1) return;
+    if (getsockopt(connecting_socket, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+        abandon_connect();
+        return;
+    }
+    connection_established();
+}
+
+static void read_ring(struct peer* peer);
+
+/* connection_lost runs on the receiver thread when a peer connection fails.
+   The session survives unless the peer said goodbye: P2 waits for the
+   process to come back, the other processes reconnect to P2. */
+static void connection_lost(struct peer* peer) {
+    /* What the peer wrote to its ring before leaving comes first */
+    if (peer->ring_in != NULL) read_ring(peer);
+    if (peer->closed || (is_hub && peer->process_id < 0)) {
+        remove_peer(peer);
+        return;
+    }
+    pthread_mutex_lock(&peer->send_mutex);
+    detach_socket(peer);
+    pthread_mutex_unlock(&peer->send_mutex);
+    if (!is_hub && !reconnect_armed) schedule_reconnect(RECONNECT_MIN_MS);
+}
+
+/* flush_outbox runs on the receiver thread when a peer socket with queued
+   bytes becomes writable, and on the ring thread when the peer made room
+   in its ring. */
+static void flush_outbox(struct peer* peer) {
+    pthread_mutex_lock(&peer->send_mutex);
+    if ((peer->socket == -1 && peer->ring_out == NULL) || peer->outbox_length == 0) {
+        pthread_mutex_unlock(&peer->send_mutex);
+        return;
+    }
+    ssize_t written = write_pending(peer, peer->outbox, peer->outbox_length);
+    if (written > 0) {
+        memmove(peer->outbox, peer->outbox + written, peer->outbox_length - written);
+        peer->outbox_length -= written;
+        if (peer->outbox_length == 0 && peer->ring_out == NULL) watch_writable(peer, 0);
+        if (peer->outbox_length <= OUTBOX_LIMIT) pthread_cond_broadcast(&peer->drained);
+    }
+    pthread_mutex_unlock(&peer->send_mutex);
+
+    if (written < 0) connection_lost(peer);
+}
+
+/* find_peer returns the session with the given process, connected or
+   not, or NULL. Every process other than P2 only has its session with P2,
+   kept in the first slot. */
+static struct peer* find_peer(int target_id) {
+    struct peer* found = NULL;
+    pthread_mutex_lock(&peer_table.mutex);
+    if (!is_hub) {
+        if (peer_table.count > 0 && peer_table.peers[0].in_use) found = &peer_table.peers[0];
+        pthread_mutex_unlock(&peer_table.mutex);
+        return found;
+    }
+    for (int i = 0; i < peer_table.count; i++) {
+        if (peer_table.peers[i].in_use && peer_table.peers[i].process_id == target_id) {
+            found = &peer_table.peers[i];
             break;
         }
     }
-    
-    close(client_socket);
-    return NULL;
+    pthread_mutex_unlock(&peer_table.mutex);
+    return found;
 }
 
-/* receiver_thread_server listens for incoming client connections
-   and spawns a new thread to handle each connection. */
-static void* receiver_thread_server(void* arg) {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+/* identify_peer binds a new connection to the process id carried in its
+   frames. If that process already has a session, the connection moves
+   into it, replacing the old connection if P2 has not noticed yet that it
+   failed, and the session resumes there. Returns the slot that owns the
+   connection from now on. */
+static struct peer* identify_peer(struct peer* peer, int id) {
+    struct peer* session = NULL;
+
+    pthread_mutex_lock(&peer_table.mutex);
+    for (int i = 0; i < peer_table.count; i++) {
+        struct peer* other = &peer_table.peers[i];
+        if (other != peer && other->in_use && other->process_id == id) {
+            session = other;
+            break;
+        }
+    }
+    if (session == NULL) {
+        peer->process_id = id;
+        pthread_mutex_unlock(&peer_table.mutex);
+        return peer;
+    }
+
+    pthread_mutex_lock(&session->send_mutex);
+    detach_socket(session);
+    session->socket = peer->socket;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->socket, &event);
+    pthread_mutex_unlock(&session->send_mutex);
 
-    /* Accept incoming client connections */
+    pthread_mutex_lock(&peer->send_mutex);
+    peer->socket = -1;
+    peer->in_use = 0;
+    pthread_mutex_unlock(&peer->send_mutex);
+    pthread_mutex_unlock(&peer_table.mutex);
+
+    __atomic_fetch_add(&stats.reconnects, 1, __ATOMIC_RELAXED);
+    return session;
+}
+
+/* accept_peers drains the listening socket's accept queue. */
+static void accept_peers(void) {
     while (is_running) {
-        int client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        if (client_socket < 0) continue;
-        
-        int* client_sock_ptr = malloc(sizeof(int));
-        *client_sock_ptr = client_socket;
-        
-        pthread_t client_thread;
-        if (pthread_create(&client_thread, NULL, process, client_sock_ptr) != 0) {
-            free(client_sock_ptr);
-            close(client_socket);
+        int client_socket = accept(server_socket, NULL, NULL);
+        if (client_socket < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (add_peer(client_socket) != 0) close(client_socket);
+    }
+}
+
+/* frame_to_message converts a decoded frame into the struct message the
+   application sees. Returns -1 for opcodes outside enum operations.
+   Consecutive frames nearly always share a source, so its name is cached. */
+static int frame_to_message(const struct wire_frame* frame, struct message* msg) {
+    static int cached_source = -1;
+    static char cached_origin[MAX_PROCESS_NAME];
+
+    if (frame->opcode > SHUTDOWN_ACK) return -1;
+    if (frame->source != cached_source) {
+        wire_process_name(frame->source, cached_origin, MAX_PROCESS_NAME);
+        cached_source = frame->source;
+    }
+    memcpy(msg->origin, cached_origin, MAX_PROCESS_NAME);
+    msg->action = (enum operations)frame->opcode;
+    msg->clock_lamport = frame->clock;
+    msg->clock_hlc = frame->hlc;
+    return 0;
+}
+
+static int compare_forward_entries(const void* a, const void* b) {
+    const struct forward_entry* x = a;
+    const struct forward_entry* y = b;
+    if (x->destination != y->destination) return x->destination < y->destination ? -1 : 1;
+    return x->offset < y->offset ? -1 : 1;
+}
+
+/* forward_frames relays the frames of the last read that are addressed to
+   other processes. Frames are grouped by destination, keeping their order,
+   so each destination gets one write per read. Frames for processes that
+   never connected are dropped; a process whose connection failed gets
+   them when it resumes its session. */
+static void forward_frames(int forward_count) {
+    qsort(forward_list, forward_count, sizeof(struct forward_entry), compare_forward_entries);
+
+    int first = 0;
+    while (first < forward_count) {
+        int destination = forward_list[first].destination;
+        size_t length = 0;
+        int last = first;
+        for (; last < forward_count && forward_list[last].destination == destination; last++) {
+            memcpy(forward_buffer + length, receive_buffer + forward_list[last].offset,
+                   forward_list[last].length);
+            length += forward_list[last].length;
+        }
+        struct peer* target = find_peer(destination);
+        if (target != NULL && peer_send(target, destination, forward_buffer, length, last - first) == 0) {
+            __atomic_fetch_add(&stats.frames_forwarded, last - first, __ATOMIC_RELAXED);
         } else {
-            pthread_detach(client_thread);
+            __atomic_fetch_add(&stats.frames_dropped, last - first, __ATOMIC_RELAXED);
         }
+        first = last;
     }
-    return NULL;
 }
 
-/* receiver_thread_client continuously receives messages from the server
-   and processes them. */
-static void* receiver_thread_client(void* arg) {
+/* dispatch_frames decodes the whole frames among the first buffered bytes
+   of receive_buffer and dispatches them in batches. sequenced tells that
+   they came from the socket, where every frame but link frames counts as
+   received. Returns how many bytes it consumed, or -1 if a frame could not
+   be decoded. *peer_ref changes if identify_peer moves the connection. */
+static ssize_t dispatch_frames(struct peer** peer_ref, size_t buffered, int sequenced) {
+    struct peer* peer = *peer_ref;
+    int count = 0;
+    int forward_count = 0;
+    size_t offset = 0;
+    struct wire_frame frame;
+    int used;
+    while ((used = wire_decode(receive_buffer + offset, buffered - offset, &frame)) > 0) {
+        if (is_hub && peer->process_id != frame.source) {
+            if (count > 0) process_received_messages(receive_batch, count);
+            count = 0;
+            peer = identify_peer(peer, frame.source);
+        }
+        if (frame.opcode >= WIRE_FIRST_LINK_OPCODE) {
+            offset += used;
+            process_link_frame(peer, &frame);
+            continue;
+        }
+        if (sequenced) peer->received_frames++;
+        if (is_hub && frame.destination != process_id) {
+            forward_list[forward_count].destination = frame.destination;
+            forward_list[forward_count].offset = offset;
+            forward_list[forward_count].length = used;
+            forward_count++;
+            offset += used;
+            continue;
+        }
+        offset += used;
+        if (frame.opcode >= WIRE_FIRST_CONTROL_OPCODE) {
+            if (count > 0) process_received_messages(receive_batch, count);
+            count = 0;
+            if (frame.opcode == WIRE_OP_MULTICAST) snapshot_observe(&frame);
+            process_control_frame(&frame);
+            continue;
+        }
+        if (frame_to_message(&frame, &receive_batch[count]) != 0) continue;
+        snapshot_observe(&frame);
+        if (++count == MAX_BATCH) {
+            process_received_messages(receive_batch, count);
+            count = 0;
+        }
+    }
+    if (count > 0) process_received_messages(receive_batch, count);
+    if (forward_count > 0) forward_frames(forward_count);
+    multicast_flush_acks();
+    *peer_ref = peer;
+    return used < 0 ? -1 : (ssize_t)offset;
+}
+
+/* read_peer drains the socket in RECV_BUFFER_SIZE reads and dispatches the
+   whole frames in them. A trailing partial frame is kept in the peer until
+   the rest of it arrives; a frame that cannot be decoded drops the
+   connection since the stream cannot be resynchronised. Every sequenced
+   frame is acknowledged once ACK_EVERY of them pile up or ACK_DELAY_MS
+   after the first one. */
+static void read_peer(struct peer* peer) {
+    while (is_running && peer->socket != -1) {
+        size_t buffered = peer->partial_length;
+        memcpy(receive_buffer, peer->partial, buffered);
+
+        ssize_t bytes_read = recv(peer->socket, receive_buffer + buffered,
+                                  RECV_BUFFER_SIZE - buffered, MSG_DONTWAIT);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (bytes_read <= 0) {
+            connection_lost(peer);
+            return;
+        }
+        buffered += bytes_read;
+
+        ssize_t offset = dispatch_frames(&peer, buffered, 1);
+        if (offset < 0) {
+            fprintf(stderr, "%s: malformed frame, dropping connection\n", process_name);
+            connection_lost(peer);
+            return;
+        }
+        peer->partial_length = buffered - offset;
+        memcpy(peer->partial, receive_buffer + offset, peer->partial_length);
+
+        if (peer->received_frames - peer->acked_frames >= ACK_EVERY) {
+            send_ack(peer);
+        } else if (peer->received_frames != peer->acked_frames && !ack_timer_armed) {
+            deadline_after(&ack_deadline, ACK_DELAY_MS);
+            ack_timer_armed = 1;
+        }
+
+        /* A short read means the socket buffer is empty; epoll reports the rest */
+        if (buffered < RECV_BUFFER_SIZE) return;
+    }
+}
+
+/* read_ring is read_peer for the ring of a local peer. The ring is written
+   by one process only and cannot fail, so there is nothing to acknowledge;
+   a malformed frame stops reading it. */
+static void read_ring(struct peer* peer) {
+    while (is_running && peer->ring_in != NULL) {
+        size_t buffered = peer->ring_partial_length;
+        memcpy(receive_buffer, peer->ring_partial, buffered);
+
+        size_t bytes_read = shm_ring_read(peer->ring_in, receive_buffer + buffered,
+                                          RECV_BUFFER_SIZE - buffered, peer->remote_doorbell);
+        if (bytes_read == 0) return;
+        buffered += bytes_read;
+
+        ssize_t offset = dispatch_frames(&peer, buffered, 0);
+        if (offset < 0) {
+            fprintf(stderr, "%s: malformed frame in shared memory, ignoring the ring\n", process_name);
+            peer->ring_in = NULL;
+            return;
+        }
+        peer->ring_partial_length = buffered - offset;
+        memcpy(peer->ring_partial, receive_buffer + offset, peer->ring_partial_length);
+    }
+}
+
+/* ms_until returns the milliseconds left until deadline, 0 once it passed. */
+static int ms_until(const struct timespec* deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long remaining = (deadline->tv_sec - now.tv_sec) * 1000L +
+                     (deadline->tv_nsec - now.tv_nsec) / 1000000L;
+    return remaining > 0 ? (int)remaining : 0;
+}
+
+/* epoll_timeout returns how long epoll may wait before the pending acks or
+   the next reconnect attempt are due, in milliseconds, or -1 when neither
+   timer is armed. */
+static int epoll_timeout(void) {
+    int ack = ack_timer_armed ? ms_until(&ack_deadline) : -1;
+    int reconnect = reconnect_armed ? ms_until(&reconnect_deadline) : -1;
+    if (ack < 0) return reconnect;
+    if (reconnect < 0) return ack;
+    return ack < reconnect ? ack : reconnect;
+}
+
+/* receiver_thread is the only thread that reads from the network. It waits
+   on every peer socket (and, in P2, on the listening socket) with epoll,
+   so the number of threads does not grow with the number of peers. */
+static void* receiver_thread(void* arg) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    is_receiving_thread = 1;
     while (is_running) {
-        struct message received_msg;
-        ssize_t bytes_read = recv(server_socket, &received_msg, sizeof(received_msg), 0);
-        if (bytes_read == sizeof(received_msg)) {
-            process_received_message(&received_msg);
-        } else if (bytes_read <= 0) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, epoll_timeout());
+        if (ready < 0) {
+            if (errno == EINTR) continue;
             break;
         }
+        pthread_mutex_lock(&receive_mutex);
+        for (int i = 0; i < ready && is_running; i++) {
+            if (events[i].data.ptr == &wakeup_marker) {
+                is_running = 0;
+            } else if (events[i].data.ptr == &listen_marker) {
+                accept_peers();
+            } else if (events[i].data.ptr == &connect_marker) {
+                connect_finished();
+            } else {
+                struct peer* peer = events[i].data.ptr;
+                if (events[i].events & EPOLLOUT) flush_outbox(peer);
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) read_peer(peer);
+            }
+        }
+        if (ack_timer_armed && ms_until(&ack_deadline) == 0) flush_acks();
+        if (is_running && reconnect_armed && ms_until(&reconnect_deadline) == 0) start_connect();
+        pthread_mutex_unlock(&receive_mutex);
     }
     return NULL;
 }
 
+/* ring_thread reads the rings of the local peers and refills the rings
+   that had no room, sleeping on this process's doorbell in between. The
+   doorbell sequence is read before looking at the rings, so a ring that
+   fills meanwhile ends the wait at once. */
+static void* ring_thread(void* arg) {
+    is_receiving_thread = 1;
+    while (is_running) {
+        uint32_t seen = shm_doorbell_sequence(local_doorbell);
+        pthread_mutex_lock(&receive_mutex);
+        for (int i = 0; i < peer_table.count && is_running; i++) {
+            struct peer* peer = &peer_table.peers[i];
+            if (!peer->in_use) continue;
+            if (peer->ring_in != NULL) read_ring(peer);
+            if (peer->ring_out != NULL) flush_outbox(peer);
+        }
+        pthread_mutex_unlock(&receive_mutex);
+        shm_doorbell_wait(local_doorbell, seen);
+    }
+    return NULL;
+}
+
+/* is_local_connection tells whether both ends of a connected socket are
+   on this host, which is when P2's shared memory can be reached. */
+static int is_local_connection(int socket) {
+    struct sockaddr_in local, remote;
+    socklen_t local_length = sizeof(local), remote_length = sizeof(remote);
+    if (getsockname(socket, (struct sockaddr*)&local, &local_length) != 0 ||
+        getpeername(socket, (struct sockaddr*)&remote, &remote_length) != 0) {
+        return 0;
+    }
+    return local.sin_addr.s_addr == remote.sin_addr.s_addr;
+}
+
 /* init_stub initializes the stub for the given process name, IP, and port.
    It sets up the server or client socket and starts the receiver thread. */
 int init_stub(const char* proc_name, const char* ip, int port) {
+    process_id = wire_process_id(proc_name);
+    if (process_id < 0) {
+        fprintf(stderr, "Invalid process name %s, expected P<number>\n", proc_name);
+        return -1;
+    }
     strncpy(process_name, proc_name, MAX_PROCESS_NAME - 1);
     process_name[MAX_PROCESS_NAME - 1] = '\0';
     server_port = port;
     
-    int is_p2 = (strcmp(proc_name, "P2") == 0);
+    is_hub = (strcmp(proc_name, "P2") == 0);
     init_message_queue();
     
+    const char* trace_directory = getenv(TRACE_DIR_ENV);
+    if (trace_directory != NULL && trace_open(trace_directory, process_name, process_id) != 0) {
+        fprintf(stderr, "%s: tracing disabled\n", process_name);
+    }
+    
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
         perror("socket creation failed");
@@ -178,84 +1389,333 @@ int init_stub(const char* proc_name, const char* ip, int port) {
     setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
     
     struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(port);
     
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (epoll_fd < 0 || wakeup_fd < 0) {
+        perror("epoll setup failed");
+        close(server_socket);
+        return -1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &wakeup_marker;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event);
+    
     /* Setup server or client socket based on the process */
-    if (is_p2) {
+    if (is_hub) {
         server_addr.sin_addr.s_addr = INADDR_ANY;
         if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 ||
-            listen(server_socket, MAX_CLIENTS) < 0) {
+            listen(server_socket, MAX_PEERS) < 0) {
             close(server_socket);
             return -1;
         }
-        pthread_create(&receiver_thread_id, NULL, receiver_thread_server, NULL);
+        fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+        event.events = EPOLLIN;
+        event.data.ptr = &listen_marker;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event);
+        if (shm_enabled() && (shm_segment = shm_create(port)) != NULL) {
+            local_doorbell = &shm_segment->hub_doorbell;
+        }
     } else {
         server_addr.sin_addr.s_addr = inet_addr(ip);
-        if (connect(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        server_address = server_addr;
+        if (connect(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 ||
+            add_peer(server_socket) != 0) {
             close(server_socket);
             return -1;
         }
-        pthread_create(&receiver_thread_id, NULL, receiver_thread_client, NULL);
+        link_send(&peer_table.peers[0], WIRE_OP_LINK_HELLO, 0);
+        if (shm_enabled() && is_local_connection(server_socket)) offer_link(&peer_table.peers[0]);
     }
     
+    pthread_create(&receiver_thread_id, NULL, receiver_thread, NULL);
+    if (local_doorbell != NULL) pthread_create(&ring_thread_id, NULL, ring_thread, NULL);
     return 0;
 }
 
+/* drain_outboxes gives the receiver thread up to a second to flush what is
+   still queued for each peer, so the last messages sent are not lost. */
+static void drain_outboxes(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+
+    pthread_mutex_lock(&peer_table.mutex);
+    int count = peer_table.count;
+    pthread_mutex_unlock(&peer_table.mutex);
+
+    for (int i = 0; i < count; i++) {
+        struct peer* peer = &peer_table.peers[i];
+        pthread_mutex_lock(&peer->send_mutex);
+        while ((peer->socket != -1 || peer->ring_out != NULL) && peer->outbox_length > 0) {
+            if (pthread_cond_timedwait(&peer->drained, &peer->send_mutex, &deadline) != 0) break;
+        }
+        pthread_mutex_unlock(&peer->send_mutex);
+    }
+}
+
 /* close_stub cleans up resources, stops the receiver thread,
    and closes all sockets. */
 void close_stub() {
+    uint64_t wake = 1;
+    drain_outboxes();
+
+    /* Tell every peer this is a goodbye, not a failure to recover from */
+    for (int i = 0; i < peer_table.count; i++) {
+        if (peer_table.peers[i].in_use) link_send(&peer_table.peers[i], WIRE_OP_LINK_CLOSE, 0);
+    }
+    drain_outboxes();
     is_running = 0;
-    pthread_cancel(receiver_thread_id);
+    if (write(wakeup_fd, &wake, sizeof(wake)) < 0) perror("wakeup receiver");
     pthread_join(receiver_thread_id, NULL);
-    close(server_socket);
+    if (local_doorbell != NULL) {
+        shm_doorbell_ring(local_doorbell);
+        pthread_join(ring_thread_id, NULL);
+    }
+    trace_close();
+    if (connecting_socket != -1) close(connecting_socket);
+    connecting_socket = -1;
+    reconnect_armed = 0;
     
-    if (strcmp(process_name, "P2") == 0) {
-        pthread_mutex_lock(&clients.mutex);
-        if (clients.p1_socket != -1) close(clients.p1_socket);
-        if (clients.p3_socket != -1) close(clients.p3_socket);
-        pthread_mutex_unlock(&clients.mutex);
+    pthread_mutex_lock(&peer_table.mutex);
+    for (int i = 0; i < peer_table.count; i++) {
+        struct peer* peer = &peer_table.peers[i];
+        if (peer->socket != -1) close(peer->socket);
+        peer->socket = -1;
+        free(peer->outbox);
+        peer->outbox = NULL;
+        peer->outbox_length = peer->outbox_capacity = 0;
+        free(peer->retransmit);
+        peer->retransmit = NULL;
+        peer->retransmit_start = peer->retransmit_length = peer->retransmit_capacity = 0;
+        peer->in_use = 0;
+        pthread_mutex_destroy(&peer->send_mutex);
+        pthread_cond_destroy(&peer->drained);
     }
+    peer_table.count = 0;
+    pthread_mutex_unlock(&peer_table.mutex);
     
+    if (is_hub) close(server_socket);
+    shm_detach(shm_segment, server_port, is_hub);
+    shm_segment = NULL;
+    local_doorbell = NULL;
+    close(wakeup_fd);
+    close(epoll_fd);
     pthread_mutex_destroy(&msg_queue.mutex);
 }
 
-/* send_message_to_process constructs and sends a message to the specified target process.
-   It increments the Lamport clock and logs the sending action. */
-int send_message_to_process(const char* target_process, enum operations action) {
-    int target_socket = server_socket;
-    
-    if (strcmp(process_name, "P2") == 0) {
-        pthread_mutex_lock(&clients.mutex);
-        if (strcmp(target_process, "P1") == 0) target_socket = clients.p1_socket;
-        else if (strcmp(target_process, "P3") == 0) target_socket = clients.p3_socket;
-        pthread_mutex_unlock(&clients.mutex);
-        
-        if (target_socket == -1) return -1;
+/* log_send prints a SEND event in the same format as the received ones. */
+static void log_send(unsigned int clock, enum operations action) {
+    printf("%s, %d, SEND, ", process_name, clock);
+    switch (action) {
+        case READY_TO_SHUTDOWN: printf("READY_TO_SHUTDOWN\n"); break;
+        case SHUTDOWN_NOW: printf("SHUTDOWN_NOW\n"); break;
+        case SHUTDOWN_ACK: printf("SHUTDOWN_ACK\n"); break;
+    }
+}
+
+/* enter_send_gate enters send_gate for reading before an application
+   message is sent to target, unless snapshots are off or the thread is
+   inside already. Room is waited for before entering the gate, never
+   inside it. Returns whether leave_send_gate must leave it. */
+static int enter_send_gate(struct peer* target) {
+    if (!send_gate_enabled || holds_send_gate) return 0;
+    if (!is_receiving_thread) {
+        pthread_mutex_lock(&target->send_mutex);
+        wait_for_room(target, 1);
+        pthread_mutex_unlock(&target->send_mutex);
     }
+    pthread_rwlock_rdlock(&send_gate);
+    holds_send_gate = 1;
+    return 1;
+}
+
+static void leave_send_gate(int entered) {
+    if (!entered) return;
+    holds_send_gate = 0;
+    pthread_rwlock_unlock(&send_gate);
+}
+
+/* send_messages sends a batch of operations to the target process with a
+   single write. The batch takes a contiguous range of Lamport values, one
+   per message, exactly as if they had been sent one by one. */
+int send_messages(const char* target_process, const enum operations* actions, int count) {
+    if (count <= 0 || count > MAX_SEND_BATCH) return -1;
+
+    int target_id = wire_process_id(target_process);
+    if (target_id < 0) return -1;
+    struct peer* target = find_peer(target_id);
+    if (target == NULL) return -1;
+
+    int gated = enter_send_gate(target);
     
-    increment_clock();
-    int current_clock = get_clock_lamport();
+    pthread_mutex_lock(&clock_mutex);
+    unsigned int first_clock = lamport_clock + 1;
+    lamport_clock += count;
+    unsigned long long first_hlc = hlc_enabled ? hlc_send(count) : 0;
+    pthread_mutex_unlock(&clock_mutex);
     
-    struct message msg;
-    memset(&msg, 0, sizeof(msg));
-    strncpy(msg.origin, process_name, MAX_PROCESS_NAME - 1);
-    msg.origin[MAX_PROCESS_NAME - 1] = '\0';
-    msg.action = action;
-    msg.clock_lamport = current_clock;
+    uint8_t buffer[MAX_SEND_BATCH * WIRE_MAX_FRAME];
+    size_t length = 0;
+    struct wire_frame frame = {.flags = first_hlc != 0 ? WIRE_FLAG_HLC : 0, .source = process_id,
+                               .destination = target_id};
+    for (int i = 0; i < count; i++) {
+        frame.opcode = actions[i];
+        frame.clock = first_clock + i;
+        frame.hlc = first_hlc != 0 ? first_hlc + i : 0;
+        length += wire_encode(&frame, buffer + length);
+    }
     
-    ssize_t bytes_sent = send(target_socket, &msg, sizeof(msg), 0);
+    /* The sequence is taken before the bytes leave, so a reply cannot be
+       numbered ahead of the send; the records are written only once the
+       send succeeded. */
+    uint32_t first_sequence = trace_reserve(count);
+    int result = peer_send(target, is_hub ? target_id : -1, buffer, length, count);
+    if (result == 0) snapshot_count_sent(target_id, count);
+    leave_send_gate(gated);
+    if (result != 0) return -1;
+    __atomic_fetch_add(&stats.messages_sent, count, __ATOMIC_RELAXED);
     
-    if (bytes_sent == sizeof(msg)) {
-        printf("%s, %d, SEND, ", process_name, current_clock);
-        switch (action) {
-            case READY_TO_SHUTDOWN: printf("READY_TO_SHUTDOWN\n"); break;
-            case SHUTDOWN_NOW: printf("SHUTDOWN_NOW\n"); break;
-            case SHUTDOWN_ACK: printf("SHUTDOWN_ACK\n"); break;
-        }
-        return 0;
+    for (int i = 0; i < count; i++) {
+        trace_event(TRACE_SEND, first_sequence + i, actions[i], target_id, first_clock + i, first_clock + i);
+        if (__atomic_load_n(&event_log_enabled, __ATOMIC_RELAXED)) log_send(first_clock + i, actions[i]);
+    }
+    return 0;
+}
+
+int stub_process_id(void) {
+    return process_id;
+}
+
+/* stub_gate_sends makes application messages go through send_gate from
+   now on. Writers are preferred, so a stream of sends cannot keep a
+   snapshot waiting. */
+void stub_gate_sends(void) {
+    if (send_gate_enabled) return;
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&send_gate, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+    __atomic_store_n(&send_gate_enabled, 1, __ATOMIC_RELEASE);
+}
+
+/* stub_hold_traffic stops dispatching frames and sending application
+   messages until stub_release_traffic. The receiving threads already hold
+   receive_mutex while they dispatch. */
+void stub_hold_traffic(void) {
+    if (!is_receiving_thread) pthread_mutex_lock(&receive_mutex);
+    if (send_gate_enabled) pthread_rwlock_wrlock(&send_gate);
+    holds_send_gate = 1;
+}
+
+void stub_release_traffic(void) {
+    holds_send_gate = 0;
+    if (send_gate_enabled) pthread_rwlock_unlock(&send_gate);
+    if (!is_receiving_thread) pthread_mutex_unlock(&receive_mutex);
+}
+
+/* stub_tick reserves count consecutive Lamport values for sends and
+   returns the first one. */
+unsigned int stub_tick(int count) {
+    pthread_mutex_lock(&clock_mutex);
+    unsigned int first_clock = lamport_clock + 1;
+    lamport_clock += count;
+    pthread_mutex_unlock(&clock_mutex);
+    return first_clock;
+}
+
+/* stub_tick_hlc reserves count consecutive HLC values for sends and
+   returns the first one, or 0 while the HLC is disabled. */
+unsigned long long stub_tick_hlc(int count) {
+    if (!__atomic_load_n(&hlc_enabled, __ATOMIC_ACQUIRE)) return 0;
+    pthread_mutex_lock(&clock_mutex);
+    unsigned long long first_hlc = hlc_send(count);
+    pthread_mutex_unlock(&clock_mutex);
+    return first_hlc;
+}
+
+/* stub_send_frames sends control frames, already stamped by the caller,
+   to one process with a single write. Nothing is printed for them.
+   Frames the caller left without an HLC value get a fresh one here; a
+   caller sending the same frames to several processes stamps them once
+   and they keep their values. Multicast data frames carry application
+   messages, so they go through the send gate and are counted in the
+   snapshot channels like those. */
+int stub_send_frames(int target_id, struct wire_frame* frames, int count) {
+    if (count <= 0 || count > MAX_SEND_BATCH) return -1;
+    struct peer* target = find_peer(target_id);
+    if (target == NULL) return -1;
+
+    int application = 0;
+    for (int i = 0; i < count; i++) {
+        if (frames[i].opcode == WIRE_OP_MULTICAST) application++;
+    }
+    int gated = application > 0 ? enter_send_gate(target) : 0;
+
+    int unstamped = 0;
+    for (int i = 0; i < count; i++) {
+        if (frames[i].hlc == 0) unstamped++;
+    }
+    unsigned long long next_hlc = unstamped > 0 ? stub_tick_hlc(unstamped) : 0;
+
+    uint8_t buffer[MAX_SEND_BATCH * WIRE_MAX_FRAME];
+    size_t length = 0;
+    uint32_t first_sequence = trace_reserve(count);
+    for (int i = 0; i < count; i++) {
+        if (frames[i].hlc == 0 && next_hlc != 0) frames[i].hlc = next_hlc++;
+        frames[i].flags = WIRE_FLAG_ARGUMENT | (frames[i].hlc != 0 ? WIRE_FLAG_HLC : 0);
+        frames[i].source = process_id;
+        frames[i].destination = target_id;
+        length += wire_encode(&frames[i], buffer + length);
+    }
+    int result = peer_send(target, is_hub ? target_id : -1, buffer, length, count);
+    if (result == 0 && application > 0) snapshot_count_sent(target_id, application);
+    leave_send_gate(gated);
+    if (result != 0) return -1;
+    __atomic_fetch_add(&stats.control_sent, count, __ATOMIC_RELAXED);
+    for (int i = 0; i < count; i++) {
+        trace_event(TRACE_SEND, first_sequence + i, frames[i].opcode, target_id, frames[i].clock, frames[i].clock);
+    }
+    return 0;
+}
+
+/* stub_send_control sends one control frame with a fresh Lamport value. */
+int stub_send_control(int target_id, uint8_t opcode, uint64_t argument) {
+    struct wire_frame frame = {.opcode = opcode, .argument = argument};
+    frame.clock = stub_tick(1);
+    return stub_send_frames(target_id, &frame, 1);
+}
+
+/* send_message_to_process constructs and sends a message to the specified target process.
+   It increments the Lamport clock and logs the sending action. */
+int send_message_to_process(const char* target_process, enum operations action) {
+    return send_messages(target_process, &action, 1);
+}
+
+/* get_stub_stats copies the stub counters. */
+void get_stub_stats(struct stub_stats* out) {
+    out->messages_sent = __atomic_load_n(&stats.messages_sent, __ATOMIC_RELAXED);
+    out->messages_received = __atomic_load_n(&stats.messages_received, __ATOMIC_RELAXED);
+    out->receive_batches = __atomic_load_n(&stats.receive_batches, __ATOMIC_RELAXED);
+    out->frames_forwarded = __atomic_load_n(&stats.frames_forwarded, __ATOMIC_RELAXED);
+    out->frames_dropped = __atomic_load_n(&stats.frames_dropped, __ATOMIC_RELAXED);
+    out->clock_merge_ns = __atomic_load_n(&stats.clock_merge_ns, __ATOMIC_RELAXED);
+    out->control_sent = __atomic_load_n(&stats.control_sent, __ATOMIC_RELAXED);
+    out->control_received = __atomic_load_n(&stats.control_received, __ATOMIC_RELAXED);
+    out->reconnects = __atomic_load_n(&stats.reconnects, __ATOMIC_RELAXED);
+    out->frames_resent = __atomic_load_n(&stats.frames_resent, __ATOMIC_RELAXED);
+    out->shm_links = __atomic_load_n(&stats.shm_links, __ATOMIC_RELAXED);
+    out->hlc_skew_exceeded = __atomic_load_n(&stats.hlc_skew_exceeded, __ATOMIC_RELAXED);
+    for (int lane = 0; lane < PRIORITY_LANES; lane++) {
+        out->queue_received[lane] = __atomic_load_n(&stats.queue_received[lane], __ATOMIC_RELAXED);
+        out->queue_wait_ns[lane] = __atomic_load_n(&stats.queue_wait_ns[lane], __ATOMIC_RELAXED);
+        out->queue_max_wait_ns[lane] = __atomic_load_n(&stats.queue_max_wait_ns[lane], __ATOMIC_RELAXED);
     }
-    return -1;
 }
 
 /* has_pending_message checks if there are any messages in the queue
@@ -267,14 +1727,51 @@ int has_pending_message(void) {
     return result;
 }
 
+/* next_lane returns the lane receive_message serves: a starved lane,
+   lowest first, or else the highest lane with messages. Every other lane
+   with messages counts one more pass. Must be called with msg_queue.mutex
+   held and the queue not empty. */
+static int next_lane(void) {
+    int chosen = -1;
+    for (int lane = PRIORITY_LANES - 1; lane > 0 && chosen < 0; lane--) {
+        if (msg_queue.lanes[lane].count > 0 && msg_queue.lanes[lane].passed_over >= QUEUE_STARVATION_LIMIT) {
+            chosen = lane;
+        }
+    }
+    for (int lane = 0; lane < PRIORITY_LANES && chosen < 0; lane++) {
+        if (msg_queue.lanes[lane].count > 0) chosen = lane;
+    }
+    for (int lane = 0; lane < PRIORITY_LANES; lane++) {
+        if (lane == chosen) msg_queue.lanes[lane].passed_over = 0;
+        else if (msg_queue.lanes[lane].count > 0) msg_queue.lanes[lane].passed_over++;
+    }
+    return chosen;
+}
+
 /* receive_message retrieves a message from the queue if available,
    locking the mutex to ensure thread safety. */
 int receive_message(struct message* msg) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
     pthread_mutex_lock(&msg_queue.mutex);
     if (msg_queue.count > 0) {
-        *msg = msg_queue.messages[msg_queue.front];
-        msg_queue.front = (msg_queue.front + 1) % MAX_MESSAGE_QUEUE;
+        int index = next_lane();
+        struct queue_lane* lane = &msg_queue.lanes[index];
+        struct queued_message* entry = &lane->entries[lane->front];
+        *msg = entry->message;
+        lane->front = (lane->front + 1) % MAX_MESSAGE_QUEUE;
+        lane->count--;
         msg_queue.count--;
+
+        unsigned long long wait = (now.tv_sec - entry->queued.tv_sec) * 1000000000ull +
+                                  now.tv_nsec - entry->queued.tv_nsec;
+        if ((long long)wait < 0) wait = 0;
+        __atomic_fetch_add(&stats.queue_received[index], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.queue_wait_ns[index], wait, __ATOMIC_RELAXED);
+        if (wait > stats.queue_max_wait_ns[index]) {
+            __atomic_store_n(&stats.queue_max_wait_ns[index], wait, __ATOMIC_RELAXED);
+        }
         pthread_mutex_unlock(&msg_queue.mutex);
         return 1;
     }
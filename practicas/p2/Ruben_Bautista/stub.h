@@ -1,10 +1,13 @@
 #ifndef STUB_H
 #define STUB_H
 
+#include <stddef.h>
+
 #define MAX_PROCESS_NAME 20
 #define MAX_MESSAGE_QUEUE 100
 #define SLEEP_TIME 100000
-#define MAX_CLIENTS 2
+#define MAX_PEERS 256
+#define MAX_SEND_BATCH 256
 
 enum operations {
     READY_TO_SHUTDOWN = 0,
@@ -12,19 +15,95 @@ enum operations {
     SHUTDOWN_ACK
 };
 
+/* Lanes of the message queue, served highest first. By default
+   SHUTDOWN_NOW and SHUTDOWN_ACK go to the high lane and READY_TO_SHUTDOWN
+   to the normal one. */
+enum message_priority {
+    PRIORITY_HIGH = 0,
+    PRIORITY_NORMAL,
+    PRIORITY_LOW,
+    PRIORITY_LANES
+};
+
+/* Hybrid logical clock values pack physical milliseconds since the epoch
+   in the high 48 bits and a logical counter in the low 16, so they compare
+   as plain integers. clock_hlc is 0 when the sender did not enable it. */
+#define HLC_LOGICAL_BITS 16
+#define HLC_PHYSICAL_MS(hlc) ((hlc) >> HLC_LOGICAL_BITS)
+#define HLC_LOGICAL(hlc) ((hlc) & ((1ull << HLC_LOGICAL_BITS) - 1))
+
 struct message {
     char origin[MAX_PROCESS_NAME];
     enum operations action;
     unsigned int clock_lamport;
+    unsigned long long clock_hlc;
+};
+
+/* Counters kept by the stub since init_stub. clock_merge_ns is the time
+   spent applying the Lamport receive rule, lock wait included. Control
+   frames are the stub's own protocol traffic (barriers, multicast acks).
+   reconnects counts resumed sessions, frames_resent what they resent.
+   shm_links counts the directions of connections moved to shared memory.
+   hlc_skew_exceeded counts received timestamps further ahead of the wall
+   clock than enable_hlc allows, which were left out of the HLC. The queue counters are per priority lane:
+   messages taken with receive_message, and their total and longest wait
+   in the queue. */
+struct stub_stats {
+    unsigned long messages_sent;
+    unsigned long messages_received;
+    unsigned long receive_batches;
+    unsigned long frames_forwarded;
+    unsigned long frames_dropped;
+    unsigned long long clock_merge_ns;
+    unsigned long control_sent;
+    unsigned long control_received;
+    unsigned long reconnects;
+    unsigned long frames_resent;
+    unsigned long shm_links;
+    unsigned long hlc_skew_exceeded;
+    unsigned long queue_received[PRIORITY_LANES];
+    unsigned long long queue_wait_ns[PRIORITY_LANES];
+    unsigned long long queue_max_wait_ns[PRIORITY_LANES];
+};
+
+typedef void (*message_handler)(const struct message* msg, void* ctx);
+
+/* Records the application state of this process for a snapshot: writes at
+   most capacity bytes into buffer and returns how many it wrote. It runs
+   on the thread that records the snapshot while no message is sent or
+   received, so it must not send nor wait for the stub's threads. */
+typedef size_t (*snapshot_record_fn)(void* buffer, size_t capacity, void* ctx);
+
+/* A group of processes taking part in a collective operation. Every member
+   must pass the same names in the same order: a member's position is its
+   rank in the group. */
+struct stub_group {
+    const char* const* members;
+    int count;
 };
 
 int init_stub(const char* process_name, const char* ip, int port);
 void close_stub();
 int get_clock_lamport();
+void enable_event_log(int enabled);
+int enable_hlc(int max_skew_ms);
+unsigned long long get_clock_hlc(void);
 int send_message_to_process(const char* process_name, enum operations action);
+int send_messages(const char* process_name, const enum operations* actions, int count);
 int wait_for_ready_messages(void);
 int has_pending_message(void);
 int receive_message(struct message* msg);
 void reset_clock(void);
+int register_handler(enum operations action, message_handler handler, void* ctx);
+int set_operation_priority(enum operations action, enum message_priority priority);
+void get_stub_stats(struct stub_stats* stats);
+int stub_barrier(const struct stub_group* group, int timeout_ms);
+int multicast_join(const struct stub_group* group);
+int multicast_total_order(const enum operations* actions, int count);
+int dist_lock_init(const struct stub_group* group);
+int dist_lock(const char* resource);
+int dist_unlock(const char* resource);
+int snapshot_init(const struct stub_group* group, snapshot_record_fn record, void* ctx);
+int start_snapshot(int timeout_ms, char* path, size_t path_size);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,861 @@
+#include "stub.h"
+#include "shm.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* stub_bench launches N stub processes on this host (P2 plus N-1 others)
+   and makes them exchange messages in one of three patterns:
+
+     pingpong  every process does M round trips with P2
+     fanin     every process streams M messages to P2
+     alltoall  every process streams M messages to each other process,
+               relayed by P2
+     barrier   all processes, P2 included, run M stub_barrier calls
+     multicast all processes, P2 included, send M totally ordered
+               multicasts to the whole group
+     lock      all processes, P2 included, take and release one of R
+               dist_lock resources M times
+
+   It reports delivered messages per second, one-way latency percentiles
+   (half the round trip of a ping, or of a probe sent every PROBE_INTERVAL
+   messages while streaming) and the cost of merging Lamport clocks.
+   For barrier the latency samples are whole stub_barrier calls; for
+   multicast, the time from sending a multicast to delivering it locally,
+   which is when it became stable. Multicast also checks that every
+   process delivered the same sequence. For lock the samples are the
+   waits in dist_lock, and the critical sections check, through shared
+   memory, that no two processes hold a resource at once.
+
+   --transport tcp keeps every process on loopback TCP; by default they
+   talk to P2 through shared memory, so running both shows what the
+   transport costs.
+
+   --snapshot-ms T makes P2 take a Chandy-Lamport snapshot of all the
+   processes every T ms while the pattern runs, and check in each file
+   that what every process sent to another was received before the cut
+   or recorded in flight. It reports how long the snapshots took; the
+   message rate compared with a run without them is what they cost.
+
+   --hlc makes every process stamp its frames with the hybrid logical
+   clock, with a skew bound of HLC_MAX_SKEW_MS, to measure its overhead.
+
+   READY_TO_SHUTDOWN carries data and pings, SHUTDOWN_NOW probes and ping
+   replies, SHUTDOWN_ACK probe replies and the initial hello to P2. */
+
+#define HUB_NAME "P2"
+#define PROBE_INTERVAL 64
+#define MAX_SAMPLES 100000
+#define BENCH_TIMEOUT 300
+#define BARRIER_TIMEOUT_MS 30000
+#define MAX_RESOURCES 64
+#define MAX_SNAPSHOTS 10000
+#define HLC_MAX_SKEW_MS 1000
+
+enum pattern {
+    PINGPONG = 0,
+    FANIN,
+    ALLTOALL,
+    BARRIER,
+    MULTICAST,
+    LOCK
+};
+
+struct process_result {
+    long delivered;
+    int samples;
+    int failed;
+    unsigned long long order_hash;
+    struct timespec done;
+    struct stub_stats stats;
+};
+
+/* Shared with every child through an anonymous MAP_SHARED mapping */
+struct bench_shared {
+    struct timespec start;
+    struct process_result results[MAX_PEERS];
+    int holders[MAX_RESOURCES];
+    long violations;
+    int snapshots;
+    int snapshots_failed;
+    int snapshots_inconsistent;
+    long snapshot_ns[MAX_SNAPSHOTS];
+    long samples[];
+};
+
+static struct bench_shared* shared;
+static enum pattern pattern = PINGPONG;
+static int process_count = 3;
+static int messages = 10000;
+static int batch_size = 1;
+static int port = 0;
+static int resources = 1;
+static int use_tcp = 0;
+static int snapshot_ms = 0;
+static int use_hlc = 0;
+
+/* Every process, P2 first, in the group patterns */
+static const char* group_members[MAX_PEERS];
+static char group_names[MAX_PEERS][MAX_PROCESS_NAME];
+static struct stub_group whole_group = {group_members, 0};
+
+/* State of one process, updated by handlers on the receiver thread */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    long delivered;
+    long replies;
+    int hellos;
+    int probe_outstanding;
+    struct timespec probe_sent;
+    struct timespec* multicast_sent;
+    long own_delivered;
+    unsigned long long order_hash;
+} state = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, {0, 0}, NULL, 0, 14695981039346656037ull};
+
+static int self_index;
+static int registered_pipe[2];
+static int start_pipe[2];
+static int stop_pipe[2];
+
+/* Process index 0 is P2; the others are P1, P3, P4, ... */
+static int index_to_id(int index) {
+    if (index == 0) return 2;
+    return index == 1 ? 1 : index + 1;
+}
+
+static int id_to_index(int id) {
+    if (id == 2) return 0;
+    return id == 1 ? 1 : id - 1;
+}
+
+static void index_to_name(int index, char* name) {
+    snprintf(name, MAX_PROCESS_NAME, "P%d", index_to_id(index));
+}
+
+/* In the group patterns P2 is one more member, not only the relay */
+static int is_group_pattern(void) {
+    return pattern == BARRIER || pattern == MULTICAST || pattern == LOCK;
+}
+
+static long elapsed_ns(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+}
+
+/* store_sample appends a latency sample of this process. */
+static void store_sample(long ns) {
+    struct process_result* result = &shared->results[self_index];
+    if (result->samples < MAX_SAMPLES) {
+        shared->samples[(long)self_index * MAX_SAMPLES + result->samples++] = ns;
+    }
+}
+
+/* record_sample stores half a round trip, started at sent, as a one-way
+   latency sample. Must be called with state.mutex held. */
+static void record_sample(struct timespec sent) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    store_sample(elapsed_ns(sent, now) / 2);
+}
+
+/* Hub handlers */
+
+static void hub_on_hello(const struct message* msg, void* ctx) {
+    pthread_mutex_lock(&state.mutex);
+    if (++state.hellos == process_count - 1) {
+        char ready = 1;
+        if (write(registered_pipe[1], &ready, 1) != 1) perror("registered pipe");
+    }
+    pthread_mutex_unlock(&state.mutex);
+}
+
+static void hub_on_data(const struct message* msg, void* ctx) {
+    if (pattern == PINGPONG) {
+        send_message_to_process(msg->origin, SHUTDOWN_NOW);
+        return;
+    }
+    pthread_mutex_lock(&state.mutex);
+    if (++state.delivered == (long)messages * (process_count - 1)) {
+        clock_gettime(CLOCK_MONOTONIC, &shared->results[0].done);
+        pthread_cond_broadcast(&state.changed);
+    }
+    pthread_mutex_unlock(&state.mutex);
+}
+
+static void hub_on_probe(const struct message* msg, void* ctx) {
+    send_message_to_process(msg->origin, SHUTDOWN_ACK);
+}
+
+/* Handlers of the other processes */
+
+static void on_data(const struct message* msg, void* ctx) {
+    pthread_mutex_lock(&state.mutex);
+    state.delivered++;
+    pthread_cond_broadcast(&state.changed);
+    pthread_mutex_unlock(&state.mutex);
+}
+
+/* SHUTDOWN_NOW is the reply to a ping, or a probe from another process */
+static void on_ping_reply_or_probe(const struct message* msg, void* ctx) {
+    if (pattern == ALLTOALL) {
+        send_message_to_process(msg->origin, SHUTDOWN_ACK);
+        return;
+    }
+    pthread_mutex_lock(&state.mutex);
+    state.replies++;
+    pthread_cond_broadcast(&state.changed);
+    pthread_mutex_unlock(&state.mutex);
+}
+
+static void on_probe_reply(const struct message* msg, void* ctx) {
+    pthread_mutex_lock(&state.mutex);
+    if (state.probe_outstanding) {
+        record_sample(state.probe_sent);
+        state.probe_outstanding = 0;
+        pthread_cond_broadcast(&state.changed);
+    }
+    pthread_mutex_unlock(&state.mutex);
+}
+
+/* on_multicast_delivery runs for every delivered multicast and folds its
+   (origin, clock) into a hash of the delivery order. */
+static void on_multicast_delivery(const struct message* msg, void* ctx) {
+    char self[MAX_PROCESS_NAME];
+    index_to_name(self_index, self);
+
+    pthread_mutex_lock(&state.mutex);
+    for (const char* c = msg->origin; *c; c++) {
+        state.order_hash = (state.order_hash ^ (unsigned char)*c) * 1099511628211ull;
+    }
+    state.order_hash = (state.order_hash ^ msg->clock_lamport) * 1099511628211ull;
+    if (strcmp(msg->origin, self) == 0 && state.own_delivered < messages) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        store_sample(elapsed_ns(state.multicast_sent[state.own_delivered++], now));
+    }
+    state.delivered++;
+    pthread_cond_broadcast(&state.changed);
+    pthread_mutex_unlock(&state.mutex);
+}
+
+/* send_stream sends count data messages to target in batches and
+   launches a latency probe every PROBE_INTERVAL messages if none is
+   in flight. */
+static int send_stream(const char* target, int count, long* streamed) {
+    enum operations actions[MAX_SEND_BATCH];
+    for (int i = 0; i < batch_size; i++) actions[i] = READY_TO_SHUTDOWN;
+
+    for (int sent = 0; sent < count; ) {
+        int chunk = count - sent < batch_size ? count - sent : batch_size;
+        int result = (chunk == 1) ? send_message_to_process(target, READY_TO_SHUTDOWN)
+                                  : send_messages(target, actions, chunk);
+        if (result != 0) return -1;
+        sent += chunk;
+
+        long before = *streamed;
+        *streamed += chunk;
+        if (before / PROBE_INTERVAL == *streamed / PROBE_INTERVAL) continue;
+
+        pthread_mutex_lock(&state.mutex);
+        if (!state.probe_outstanding) {
+            state.probe_outstanding = 1;
+            clock_gettime(CLOCK_MONOTONIC, &state.probe_sent);
+            pthread_mutex_unlock(&state.mutex);
+            if (send_message_to_process(target, SHUTDOWN_NOW) != 0) return -1;
+        } else {
+            pthread_mutex_unlock(&state.mutex);
+        }
+    }
+    return 0;
+}
+
+static int run_pingpong(void) {
+    for (int i = 0; i < messages; i++) {
+        struct timespec sent;
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        if (send_message_to_process(HUB_NAME, READY_TO_SHUTDOWN) != 0) return -1;
+
+        pthread_mutex_lock(&state.mutex);
+        while (state.replies <= i) {
+            pthread_cond_wait(&state.changed, &state.mutex);
+        }
+        record_sample(sent);
+        pthread_mutex_unlock(&state.mutex);
+    }
+    return 0;
+}
+
+static int run_fanin(void) {
+    long streamed = 0;
+    return send_stream(HUB_NAME, messages, &streamed);
+}
+
+/* Every process sends to the others in chunks of batch_size, round robin,
+   so all destinations are loaded at the same time. */
+static int run_alltoall(void) {
+    long streamed = 0;
+    char name[MAX_PROCESS_NAME];
+
+    for (int sent = 0; sent < messages; sent += batch_size) {
+        int chunk = messages - sent < batch_size ? messages - sent : batch_size;
+        for (int other = 1; other < process_count; other++) {
+            if (other == self_index) continue;
+            index_to_name(other, name);
+            if (send_stream(name, chunk, &streamed) != 0) return -1;
+        }
+    }
+
+    long expected = (long)messages * (process_count - 2);
+    pthread_mutex_lock(&state.mutex);
+    while (state.delivered < expected) {
+        pthread_cond_wait(&state.changed, &state.mutex);
+    }
+    pthread_mutex_unlock(&state.mutex);
+    return 0;
+}
+
+/* Every process runs one untimed barrier first, so the samples do not
+   include how long each one took to wake up after the start signal. */
+static int run_barrier(void) {
+    if (stub_barrier(&whole_group, BARRIER_TIMEOUT_MS) != 0) return -1;
+    for (int i = 0; i < messages; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (stub_barrier(&whole_group, BARRIER_TIMEOUT_MS) != 0) return -1;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        store_sample(elapsed_ns(start, end));
+    }
+    shared->results[self_index].delivered = messages;
+    return 0;
+}
+
+/* Every process multicasts in chunks of batch_size and then waits until
+   it delivered the multicasts of the whole group. */
+static int run_multicast(void) {
+    enum operations actions[MAX_SEND_BATCH];
+    for (int i = 0; i < batch_size; i++) actions[i] = READY_TO_SHUTDOWN;
+
+    state.multicast_sent = malloc(messages * sizeof(struct timespec));
+    if (state.multicast_sent == NULL || multicast_join(&whole_group) != 0) return -1;
+    for (int sent = 0; sent < messages; sent += batch_size) {
+        int chunk = messages - sent < batch_size ? messages - sent : batch_size;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&state.mutex);
+        for (int i = 0; i < chunk; i++) state.multicast_sent[sent + i] = now;
+        pthread_mutex_unlock(&state.mutex);
+        if (multicast_total_order(actions, chunk) != 0) return -1;
+    }
+
+    long expected = (long)messages * process_count;
+    pthread_mutex_lock(&state.mutex);
+    while (state.delivered < expected) {
+        pthread_cond_wait(&state.changed, &state.mutex);
+    }
+    shared->results[self_index].delivered = state.delivered;
+    shared->results[self_index].order_hash = state.order_hash;
+    pthread_mutex_unlock(&state.mutex);
+    return 0;
+}
+
+/* Processes start on different resources and walk through all of them,
+   so every resource is contended when there are more processes than
+   resources. */
+static int run_lock(void) {
+    char resource[32];
+
+    if (dist_lock_init(&whole_group) != 0) return -1;
+    for (int i = 0; i < messages; i++) {
+        int index = (i + self_index) % resources;
+        snprintf(resource, sizeof(resource), "resource-%d", index);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (dist_lock(resource) != 0) return -1;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        store_sample(elapsed_ns(start, end));
+
+        if (__atomic_add_fetch(&shared->holders[index], 1, __ATOMIC_SEQ_CST) != 1) {
+            __atomic_fetch_add(&shared->violations, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_sub_fetch(&shared->holders[index], 1, __ATOMIC_SEQ_CST);
+        if (dist_unlock(resource) != 0) return -1;
+    }
+    shared->results[self_index].delivered = messages;
+    /* Stay until everyone is done: the others still need our replies */
+    return stub_barrier(&whole_group, BARRIER_TIMEOUT_MS);
+}
+
+static int run_group_pattern(void) {
+    switch (pattern) {
+        case BARRIER: return run_barrier();
+        case MULTICAST: return run_multicast();
+        case LOCK: return run_lock();
+        default: return -1;
+    }
+}
+
+/* record_bench_state is the application state kept in the snapshots:
+   the messages this process delivered so far. */
+static size_t record_bench_state(void* buffer, size_t capacity, void* ctx) {
+    pthread_mutex_lock(&state.mutex);
+    long delivered = state.delivered;
+    pthread_mutex_unlock(&state.mutex);
+    memcpy(buffer, &delivered, sizeof(delivered));
+    return sizeof(delivered);
+}
+
+/* check_snapshot reads a snapshot file and tells whether it is a
+   consistent cut: it holds a section of every process and, on every
+   channel, the messages sent before the sender's cut are those received
+   before the receiver's plus those it recorded in flight. */
+static int check_snapshot(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return -1;
+    long* sent = calloc((size_t)process_count * process_count, sizeof(long));
+    long* arrived = calloc((size_t)process_count * process_count, sizeof(long));
+    struct snapshot_section section;
+    struct snapshot_channel channel;
+    int sections = 0;
+    int result = (sent != NULL && arrived != NULL) ? 0 : -1;
+
+    while (result == 0 && fread(&section, sizeof(section), 1, file) == 1) {
+        int self = id_to_index(section.process_id);
+        if (section.magic != SNAPSHOT_MAGIC || section.channel_count != (uint32_t)process_count - 1 ||
+            self < 0 || self >= process_count || fseek(file, section.state_length, SEEK_CUR) != 0) {
+            result = -1;
+            break;
+        }
+        uint32_t in_flight = 0;
+        for (uint32_t i = 0; i < section.channel_count && result == 0; i++) {
+            int other = -1;
+            if (fread(&channel, sizeof(channel), 1, file) == 1) other = id_to_index(channel.peer);
+            if (other < 0 || other >= process_count) {
+                result = -1;
+                break;
+            }
+            sent[self * process_count + other] = channel.sent;
+            arrived[other * process_count + self] = (long)channel.received + channel.in_flight;
+            in_flight += channel.in_flight;
+        }
+        if (in_flight != section.message_count ||
+            fseek(file, (long)section.message_count * sizeof(struct snapshot_message), SEEK_CUR) != 0) {
+            result = -1;
+        }
+        sections++;
+    }
+    if (sections != process_count) result = -1;
+    for (long i = 0; result == 0 && i < (long)process_count * process_count; i++) {
+        if (sent[i] != arrived[i]) result = -1;
+    }
+    free(sent);
+    free(arrived);
+    fclose(file);
+    return result;
+}
+
+static int snapshots_stop;
+
+/* snapshot_thread takes snapshots in P2 every snapshot_ms until told to
+   stop, timing and checking each one. */
+static void* snapshot_thread(void* arg) {
+    char path[512];
+    while (!__atomic_load_n(&snapshots_stop, __ATOMIC_ACQUIRE)) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = start_snapshot(BARRIER_TIMEOUT_MS, path, sizeof(path));
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (result != 0) {
+            shared->snapshots_failed++;
+        } else {
+            if (shared->snapshots < MAX_SNAPSHOTS) shared->snapshot_ns[shared->snapshots] = elapsed_ns(start, end);
+            shared->snapshots++;
+            if (check_snapshot(path) != 0) shared->snapshots_inconsistent++;
+            unlink(path);
+        }
+        usleep(snapshot_ms * 1000);
+    }
+    return NULL;
+}
+
+/* Every process waits at one barrier for all patterns to end, so the
+   snapshots P2 takes until then find everybody, and at a second one for
+   P2 to stop taking them. */
+static int stay_for_snapshots(pthread_t* thread) {
+    if (stub_barrier(&whole_group, -1) != 0) return -1;
+    if (thread != NULL) {
+        __atomic_store_n(&snapshots_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(*thread, NULL);
+    }
+    return stub_barrier(&whole_group, -1);
+}
+
+static int wait_start(void) {
+    char byte;
+    return read(start_pipe[0], &byte, 1) == 0 ? 0 : -1;
+}
+
+static void run_hub(void) {
+    char byte;
+    pthread_t snapshot_thread_id;
+
+    register_handler(SHUTDOWN_ACK, hub_on_hello, NULL);
+    register_handler(READY_TO_SHUTDOWN, pattern == MULTICAST ? on_multicast_delivery : hub_on_data, NULL);
+    register_handler(SHUTDOWN_NOW, hub_on_probe, NULL);
+    if (init_stub(HUB_NAME, "127.0.0.1", port) != 0) {
+        perror("hub init_stub");
+        exit(EXIT_FAILURE);
+    }
+    if (use_hlc) enable_hlc(HLC_MAX_SKEW_MS);
+
+    if (snapshot_ms > 0 && snapshot_init(&whole_group, record_bench_state, NULL) != 0) {
+        shared->results[0].failed = 1;
+        exit(EXIT_FAILURE);
+    }
+
+    if (is_group_pattern() || snapshot_ms > 0) {
+        if (wait_start() != 0 ||
+            (snapshot_ms > 0 && pthread_create(&snapshot_thread_id, NULL, snapshot_thread, NULL) != 0) ||
+            (is_group_pattern() && run_group_pattern() != 0)) {
+            shared->results[0].failed = 1;
+            exit(EXIT_FAILURE);
+        }
+        if (is_group_pattern()) clock_gettime(CLOCK_MONOTONIC, &shared->results[0].done);
+        if (snapshot_ms > 0 && stay_for_snapshots(&snapshot_thread_id) != 0) {
+            shared->results[0].failed = 1;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* P2 stays up until the parent closes the stop pipe and, in fanin,
+       until the streams of the processes that already left are consumed */
+    if (read(stop_pipe[0], &byte, 1) != 0) perror("stop pipe");
+
+    pthread_mutex_lock(&state.mutex);
+    while (pattern == FANIN && state.delivered < (long)messages * (process_count - 1)) {
+        pthread_cond_wait(&state.changed, &state.mutex);
+    }
+    if (!is_group_pattern()) shared->results[0].delivered = state.delivered;
+    pthread_mutex_unlock(&state.mutex);
+    get_stub_stats(&shared->results[0].stats);
+    close_stub();
+    exit(EXIT_SUCCESS);
+}
+
+static void run_process(void) {
+    char name[MAX_PROCESS_NAME];
+    struct process_result* result = &shared->results[self_index];
+    int status = -1;
+
+    register_handler(READY_TO_SHUTDOWN, pattern == MULTICAST ? on_multicast_delivery : on_data, NULL);
+    register_handler(SHUTDOWN_NOW, on_ping_reply_or_probe, NULL);
+    register_handler(SHUTDOWN_ACK, on_probe_reply, NULL);
+
+    index_to_name(self_index, name);
+    if (init_stub(name, "127.0.0.1", port) != 0 || (use_hlc && enable_hlc(HLC_MAX_SKEW_MS) != 0) ||
+        (snapshot_ms > 0 && snapshot_init(&whole_group, record_bench_state, NULL) != 0) ||
+        send_message_to_process(HUB_NAME, SHUTDOWN_ACK) != 0 || wait_start() != 0) {
+        result->failed = 1;
+        exit(EXIT_FAILURE);
+    }
+
+    switch (pattern) {
+        case PINGPONG: status = run_pingpong(); break;
+        case FANIN: status = run_fanin(); break;
+        case ALLTOALL: status = run_alltoall(); break;
+        default: status = run_group_pattern(); break;
+    }
+
+    /* The last probe must come back before the process leaves */
+    pthread_mutex_lock(&state.mutex);
+    while (status == 0 && state.probe_outstanding) {
+        pthread_cond_wait(&state.changed, &state.mutex);
+    }
+    if (!is_group_pattern()) result->delivered = state.delivered;
+    pthread_mutex_unlock(&state.mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &result->done);
+    if (status == 0 && snapshot_ms > 0) status = stay_for_snapshots(NULL);
+    get_stub_stats(&result->stats);
+    result->failed = (status != 0);
+    close_stub();
+    exit(status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static int compare_samples(const void* a, const void* b) {
+    long x = *(const long*)a;
+    long y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_report(void) {
+    struct timespec end = shared->start;
+    long delivered = 0;
+    long total_samples = 0;
+    unsigned long long merge_ns = 0;
+    unsigned long received = 0, batches = 0;
+
+    for (int i = 0; i < process_count; i++) {
+        struct process_result* result = &shared->results[i];
+        if (elapsed_ns(end, result->done) > 0) end = result->done;
+        merge_ns += result->stats.clock_merge_ns;
+        received += result->stats.messages_received;
+        batches += result->stats.receive_batches;
+        total_samples += result->samples;
+        if (i > 0 || pattern == FANIN || is_group_pattern()) delivered += result->delivered;
+    }
+    if (pattern == PINGPONG) delivered = 2L * messages * (process_count - 1);
+
+    long* samples = malloc((total_samples + 1) * sizeof(long));
+    long count = 0;
+    for (int i = 0; i < process_count; i++) {
+        memcpy(samples + count, shared->samples + (long)i * MAX_SAMPLES,
+               shared->results[i].samples * sizeof(long));
+        count += shared->results[i].samples;
+    }
+    qsort(samples, count, sizeof(long), compare_samples);
+
+    double seconds = elapsed_ns(shared->start, end) / 1e9;
+    const char* names[] = {"pingpong", "fanin", "alltoall", "barrier", "multicast", "lock"};
+    unsigned long shm_links = 0;
+    for (int i = 0; i < process_count; i++) shm_links += shared->results[i].stats.shm_links;
+    printf("pattern %s, %d processes, %d messages, batch %d, %s%s (%lu of %d links in shared memory)\n",
+           names[pattern], process_count, messages, batch_size, use_tcp ? "tcp" : "shm",
+           use_hlc ? ", hlc" : "", shm_links, 2 * (process_count - 1));
+    if (pattern == BARRIER) {
+        int rounds = 0;
+        while ((1 << rounds) < process_count) rounds++;
+        printf("  barriers      %d in %.3f s = %.0f barriers/s, %d rounds, %d messages each\n",
+               messages, seconds, messages / seconds, rounds, rounds * process_count);
+        if (count > 0) {
+            printf("  barrier (us)  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f  (%ld samples)\n",
+                   samples[count / 2] / 1e3, samples[count * 90 / 100] / 1e3,
+                   samples[count * 99 / 100] / 1e3, samples[count - 1] / 1e3, count);
+        }
+    } else if (pattern == LOCK) {
+        printf("  acquisitions  %ld in %.3f s = %.0f locks/s over %d resources, %ld exclusion violations\n",
+               delivered, seconds, delivered / seconds, resources, shared->violations);
+        if (count > 0) {
+            printf("  wait (us)     p50 %.1f  p90 %.1f  p99 %.1f  max %.1f  (%ld samples)\n",
+                   samples[count / 2] / 1e3, samples[count * 90 / 100] / 1e3,
+                   samples[count * 99 / 100] / 1e3, samples[count - 1] / 1e3, count);
+        }
+    } else {
+        printf("  delivered     %ld messages in %.3f s = %.0f msg/s\n", delivered, seconds, delivered / seconds);
+    }
+    if (pattern == MULTICAST) {
+        int same = 1;
+        unsigned long control = 0;
+        for (int i = 0; i < process_count; i++) {
+            if (shared->results[i].order_hash != shared->results[0].order_hash) same = 0;
+            control += shared->results[i].stats.control_sent;
+        }
+        long multicasts = (long)messages * process_count;
+        printf("  order         %s in all %d processes\n", same ? "identical" : "DIFFERS", process_count);
+        unsigned long acks = control - multicasts * (process_count - 1);
+        printf("  acks          %lu, %.3f per multicast (%d data frames each)\n",
+               acks, (double)acks / multicasts, process_count - 1);
+        if (count > 0) {
+            printf("  delivery (us) p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  (%ld samples)\n",
+                   samples[count / 2] / 1e3, samples[count * 90 / 100] / 1e3,
+                   samples[count * 99 / 100] / 1e3, samples[count * 999 / 1000] / 1e3,
+                   samples[count - 1] / 1e3, count);
+        }
+    } else if (count > 0 && !is_group_pattern()) {
+        printf("  one-way (us)  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  (%ld samples)\n",
+               samples[count / 2] / 1e3, samples[count * 90 / 100] / 1e3,
+               samples[count * 99 / 100] / 1e3, samples[count * 999 / 1000] / 1e3,
+               samples[count - 1] / 1e3, count);
+    }
+    if (received > 0) {
+        printf("  clock merge   %.1f ns/msg, %.1f msgs per received batch\n",
+               (double)merge_ns / received, (double)received / batches);
+    }
+    if (use_hlc) {
+        unsigned long exceeded = 0;
+        for (int i = 0; i < process_count; i++) exceeded += shared->results[i].stats.hlc_skew_exceeded;
+        printf("  hlc           max skew %d ms, %lu timestamps beyond it rejected\n", HLC_MAX_SKEW_MS, exceeded);
+    }
+    if (snapshot_ms > 0) {
+        int timed = shared->snapshots < MAX_SNAPSHOTS ? shared->snapshots : MAX_SNAPSHOTS;
+        qsort(shared->snapshot_ns, timed, sizeof(long), compare_samples);
+        printf("  snapshots     %d every %d ms, %d consistent, %d inconsistent, %d failed\n",
+               shared->snapshots, snapshot_ms, shared->snapshots - shared->snapshots_inconsistent,
+               shared->snapshots_inconsistent, shared->snapshots_failed);
+        if (timed > 0) {
+            printf("  snapshot (us) p50 %.1f  p90 %.1f  max %.1f\n", shared->snapshot_ns[timed / 2] / 1e3,
+                   shared->snapshot_ns[timed * 90 / 100] / 1e3, shared->snapshot_ns[timed - 1] / 1e3);
+        }
+    }
+    if (shared->results[0].stats.frames_forwarded > 0 || shared->results[0].stats.frames_dropped > 0) {
+        printf("  P2 relayed    %lu frames, dropped %lu\n",
+               shared->results[0].stats.frames_forwarded, shared->results[0].stats.frames_dropped);
+    }
+    free(samples);
+}
+
+static void on_timeout(int signal) {
+    const char message[] = "stub_bench: timed out\n";
+    if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0) _exit(2);
+    kill(0, SIGKILL);
+}
+
+/* remove_directory removes the snapshot directory and the files that
+   failed snapshots left in it. */
+static void remove_directory(const char* path) {
+    char file[1024];
+    DIR* directory = opendir(path);
+    if (directory == NULL) return;
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        unlink(file);
+    }
+    closedir(directory);
+    rmdir(path);
+}
+
+static int parse_arguments(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"procs", required_argument, 0, 'n'},
+        {"messages", required_argument, 0, 'm'},
+        {"pattern", required_argument, 0, 't'},
+        {"batch", required_argument, 0, 'b'},
+        {"port", required_argument, 0, 'p'},
+        {"resources", required_argument, 0, 'r'},
+        {"transport", required_argument, 0, 'x'},
+        {"snapshot-ms", required_argument, 0, 's'},
+        {"hlc", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "n:m:t:b:p:r:x:s:h", long_options, NULL)) != -1) {
+        if (opt == 'n') {
+            process_count = atoi(optarg);
+        } else if (opt == 'm') {
+            messages = atoi(optarg);
+        } else if (opt == 'b') {
+            batch_size = atoi(optarg);
+        } else if (opt == 'p') {
+            port = atoi(optarg);
+        } else if (opt == 'r') {
+            resources = atoi(optarg);
+        } else if (opt == 'h') {
+            use_hlc = 1;
+        } else if (opt == 's') {
+            snapshot_ms = atoi(optarg);
+        } else if (opt == 'x') {
+            if (strcmp(optarg, "tcp") == 0) use_tcp = 1;
+            else if (strcmp(optarg, "shm") == 0) use_tcp = 0;
+            else return -1;
+        } else if (opt == 't') {
+            if (strcmp(optarg, "pingpong") == 0) pattern = PINGPONG;
+            else if (strcmp(optarg, "fanin") == 0) pattern = FANIN;
+            else if (strcmp(optarg, "alltoall") == 0) pattern = ALLTOALL;
+            else if (strcmp(optarg, "barrier") == 0) pattern = BARRIER;
+            else if (strcmp(optarg, "multicast") == 0) pattern = MULTICAST;
+            else if (strcmp(optarg, "lock") == 0) pattern = LOCK;
+            else return -1;
+        } else {
+            return -1;
+        }
+    }
+
+    if (port <= 0 || messages <= 0 || process_count < 2 || process_count > MAX_PEERS ||
+        batch_size < 1 || batch_size > MAX_SEND_BATCH || (pattern == ALLTOALL && process_count < 3) ||
+        resources < 1 || resources > MAX_RESOURCES || snapshot_ms < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (parse_arguments(argc, argv) != 0) {
+        fprintf(stderr, "Usage: %s --port PORT [--procs N] [--messages M] "
+                "[--pattern pingpong|fanin|alltoall|barrier|multicast|lock] [--batch B] [--resources R] "
+                "[--transport tcp|shm] [--snapshot-ms T] [--hlc]\n", argv[0]);
+        return 1;
+    }
+
+    size_t size = sizeof(struct bench_shared) + (size_t)process_count * MAX_SAMPLES * sizeof(long);
+    shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED || pipe(registered_pipe) != 0 || pipe(start_pipe) != 0 || pipe(stop_pipe) != 0) {
+        perror("stub_bench setup");
+        return 1;
+    }
+    for (int i = 0; i < process_count; i++) {
+        index_to_name(i, group_names[i]);
+        group_members[i] = group_names[i];
+    }
+    whole_group.count = process_count;
+    if (use_tcp) setenv(SHM_TRANSPORT_ENV, "tcp", 1);
+    else unsetenv(SHM_TRANSPORT_ENV);
+    char snapshot_dir[] = "/tmp/stub_bench.XXXXXX";
+    if (snapshot_ms > 0) {
+        if (mkdtemp(snapshot_dir) == NULL) {
+            perror("stub_bench snapshot directory");
+            return 1;
+        }
+        setenv(SNAPSHOT_DIR_ENV, snapshot_dir, 1);
+    }
+    signal(SIGALRM, on_timeout);
+    alarm(BENCH_TIMEOUT);
+    fflush(stdout);
+
+    pid_t pids[MAX_PEERS];
+    for (self_index = 0; self_index < process_count; self_index++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(start_pipe[1]);
+            close(stop_pipe[1]);
+            close(registered_pipe[0]);
+            if (self_index == 0) run_hub();
+            run_process();
+        }
+        if (pid < 0) {
+            perror("fork");
+            kill(0, SIGKILL);
+        }
+        pids[self_index] = pid;
+        /* Let P2 listen before the others connect */
+        if (self_index == 0) usleep(SLEEP_TIME);
+    }
+
+    char byte;
+    close(registered_pipe[1]);
+    if (read(registered_pipe[0], &byte, 1) != 1) {
+        fprintf(stderr, "stub_bench: processes failed to register with P2\n");
+        kill(0, SIGKILL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &shared->start);
+    close(start_pipe[1]);
+
+    int failed = 0;
+    for (int i = 1; i < process_count; i++) {
+        int status;
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+    }
+    close(stop_pipe[1]);
+    waitpid(pids[0], NULL, 0);
+    if (shared->results[0].failed) failed = 1;
+    if (snapshot_ms > 0) remove_directory(snapshot_dir);
+
+    if (failed) {
+        fprintf(stderr, "stub_bench: a process failed\n");
+        return 1;
+    }
+    print_report();
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef STUB_INTERNAL_H
+#define STUB_INTERNAL_H
+
+#include "stub.h"
+#include "wire.h"
+#include <stdint.h>
+
+/* Interface between stub.c and the protocols built on top of it. Their
+   frames use the control opcodes of wire.h: they move the Lamport clock
+   like any other message but are never shown to the application. */
+int stub_process_id(void);
+unsigned int stub_tick(int count);
+unsigned long long stub_tick_hlc(int count);
+int stub_send_frames(int target_id, struct wire_frame* frames, int count);
+int stub_send_control(int target_id, uint8_t opcode, uint64_t argument);
+void stub_deliver(const struct message* msgs, int count);
+
+/* Once stub_gate_sends is called, application messages are sent through a
+   gate. A thread holding the traffic has the gate to itself and no frame
+   is dispatched meanwhile; it must not send application messages. */
+void stub_gate_sends(void);
+void stub_hold_traffic(void);
+void stub_release_traffic(void);
+
+/* Called on the receiving threads, one at a time, for each control frame addressed to this process */
+void barrier_receive(const struct wire_frame* frame);
+void multicast_receive(const struct wire_frame* frame);
+void dist_lock_receive(const struct wire_frame* frame);
+void snapshot_receive(const struct wire_frame* frame);
+
+/* Called on the receiving threads for each application message addressed
+   to this process, and inside the gate for each batch this process sends */
+void snapshot_observe(const struct wire_frame* frame);
+void snapshot_count_sent(int destination, int count);
+
+/* Called on the receiving threads once the frames of a read are processed */
+void multicast_flush_acks(void);
+
+#endif
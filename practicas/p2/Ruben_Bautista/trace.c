@@ -0,0 +1,97 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+static struct trace_header* trace_map = NULL;
+static struct trace_record* trace_records = NULL;
+static size_t trace_map_size = 0;
+static uint32_t trace_sequence = 0;
+
+/* trace_open creates <directory>/<process_name>.trace sized for the number
+   of records in STUB_TRACE_RECORDS (or TRACE_DEFAULT_RECORDS) and maps it.
+   The file is sparse, so only the records actually written use disk. */
+int trace_open(const char* directory, const char* process_name, int process_id) {
+    char path[512];
+    uint32_t capacity = TRACE_DEFAULT_RECORDS;
+    const char* records = getenv(TRACE_RECORDS_ENV);
+
+    if (records != NULL && atol(records) > 0) capacity = (uint32_t)atol(records);
+    snprintf(path, sizeof(path), "%s/%s.trace", directory, process_name);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("trace open");
+        return -1;
+    }
+    size_t size = sizeof(struct trace_header) + (size_t)capacity * sizeof(struct trace_record);
+    if (ftruncate(fd, size) != 0) {
+        perror("trace ftruncate");
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("trace mmap");
+        return -1;
+    }
+
+    trace_map = map;
+    trace_map_size = size;
+    trace_records = (struct trace_record*)(trace_map + 1);
+    trace_map->magic = TRACE_MAGIC;
+    trace_map->version = TRACE_VERSION;
+    trace_map->record_size = sizeof(struct trace_record);
+    trace_map->process_id = process_id;
+    trace_map->capacity = capacity;
+    return 0;
+}
+
+/* trace_reserve takes count consecutive sequence numbers and returns the
+   first. Take them when the event happens, before a send leaves or once a
+   receive is merged, so the sequence follows the order of the events even
+   if their records are written later. */
+uint32_t trace_reserve(unsigned int count) {
+    if (trace_map == NULL) return 0;
+    return __atomic_fetch_add(&trace_sequence, count, __ATOMIC_RELAXED);
+}
+
+/* trace_event appends one record. The slot comes from an atomic increment
+   and the type is stored last, so concurrent writers never block each
+   other and a reader never mistakes a half-written record for a real one.
+   Events beyond the capacity are only counted. */
+void trace_event(enum trace_event type, uint32_t sequence, int opcode, int peer,
+                 unsigned int lamport, unsigned int local_clock) {
+    struct timespec now;
+
+    if (trace_map == NULL) return;
+
+    uint64_t slot = __atomic_fetch_add(&trace_map->next, 1, __ATOMIC_RELAXED);
+    if (slot >= trace_map->capacity) {
+        __atomic_fetch_add(&trace_map->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct trace_record* record = &trace_records[slot];
+    record->opcode = (uint8_t)opcode;
+    record->peer = (uint16_t)peer;
+    record->lamport = lamport;
+    record->local_clock = local_clock;
+    record->sequence = sequence;
+    record->wall_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    __atomic_store_n(&record->type, (uint8_t)type, __ATOMIC_RELEASE);
+}
+
+/* trace_close unmaps the trace; the kernel writes the pages back. */
+void trace_close(void) {
+    if (trace_map == NULL) return;
+    munmap(trace_map, trace_map_size);
+    trace_map = NULL;
+    trace_records = NULL;
+}
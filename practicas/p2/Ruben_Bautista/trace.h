@@ -0,0 +1,52 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Binary event trace of one process: a header followed by fixed-size
+   records in an mmap'd file named <process>.trace. Writers claim a slot
+   with an atomic increment, so recording never takes a lock. */
+#define TRACE_MAGIC 0x43525453u
+#define TRACE_VERSION 2
+#define TRACE_DEFAULT_RECORDS (1u << 20)
+#define TRACE_DIR_ENV "STUB_TRACE_DIR"
+#define TRACE_RECORDS_ENV "STUB_TRACE_RECORDS"
+
+enum trace_event {
+    TRACE_SEND = 1,
+    TRACE_RECV
+};
+
+/* lamport is the value carried by the message; local_clock is the clock
+   of the recording process once the event happened (equal for a SEND).
+   sequence orders the events of one process: it comes from trace_reserve
+   and, unlike the clock, never restarts. A record whose type is still 0
+   was claimed but never completed. */
+struct trace_record {
+    uint8_t type;
+    uint8_t opcode;
+    uint16_t peer;
+    uint32_t lamport;
+    uint32_t local_clock;
+    uint32_t sequence;
+    uint64_t wall_ns;
+};
+
+struct trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t process_id;
+    uint32_t capacity;
+    uint64_t next;
+    uint64_t dropped;
+    uint8_t reserved[32];
+};
+
+int trace_open(const char* directory, const char* process_name, int process_id);
+uint32_t trace_reserve(unsigned int count);
+void trace_event(enum trace_event type, uint32_t sequence, int opcode, int peer,
+                 unsigned int lamport, unsigned int local_clock);
+void trace_close(void);
+
+#endif
@@ -0,0 +1,254 @@
+#include "stub.h"
+#include "trace.h"
+#include "wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* trace_merge reads the .trace files written by the stubs of several
+   processes, pairs every RECV with the SEND that produced it and prints
+   all events in an order consistent with happens-before: program order
+   inside each process plus send -> receive across processes. Ties are
+   broken by (Lamport clock, process id), which gives the usual total order. */
+
+struct event {
+    uint32_t process_id;
+    uint32_t index;
+    struct trace_record record;
+    int next_in_process;
+    int matched_receive;
+    int pending;
+};
+
+static struct event* events = NULL;
+static int event_count = 0;
+static int* send_order = NULL;
+static int send_count = 0;
+
+/* load_trace appends the completed records of one trace file to events. */
+static int load_trace(const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(struct trace_header)) {
+        fprintf(stderr, "%s: cannot read trace\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+
+    const struct trace_header* header = map;
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+        header->record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s: not a version %d trace\n", path, TRACE_VERSION);
+        munmap(map, info.st_size);
+        return -1;
+    }
+    uint64_t stored = header->next < header->capacity ? header->next : header->capacity;
+    if (sizeof(struct trace_header) + stored * sizeof(struct trace_record) > (uint64_t)info.st_size) {
+        fprintf(stderr, "%s: truncated trace\n", path);
+        munmap(map, info.st_size);
+        return -1;
+    }
+    if (header->dropped > 0) {
+        fprintf(stderr, "%s: %llu events dropped, trace is incomplete\n",
+                path, (unsigned long long)header->dropped);
+    }
+
+    const struct trace_record* records = (const struct trace_record*)(header + 1);
+    events = realloc(events, (event_count + stored) * sizeof(struct event));
+    for (uint64_t i = 0; i < stored; i++) {
+        if (records[i].type != TRACE_SEND && records[i].type != TRACE_RECV) continue;
+        struct event* event = &events[event_count++];
+        event->process_id = header->process_id;
+        event->index = (uint32_t)i;
+        event->record = records[i];
+        event->next_in_process = -1;
+        event->matched_receive = -1;
+        event->pending = 0;
+    }
+    munmap(map, info.st_size);
+    return 0;
+}
+
+/* Program order: per process, by sequence number. The local clock cannot
+   be used, since reset_clock() restarts it. */
+static int compare_program_order(const void* a, const void* b) {
+    const struct event* x = a;
+    const struct event* y = b;
+    if (x->process_id != y->process_id) return x->process_id < y->process_id ? -1 : 1;
+    if (x->record.sequence != y->record.sequence) {
+        return x->record.sequence < y->record.sequence ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+/* Channel key of a SEND: (sender, receiver, Lamport value carried). */
+static int compare_sends(const void* a, const void* b) {
+    const struct event* x = &events[*(const int*)a];
+    const struct event* y = &events[*(const int*)b];
+    if (x->process_id != y->process_id) return x->process_id < y->process_id ? -1 : 1;
+    if (x->record.peer != y->record.peer) return x->record.peer < y->record.peer ? -1 : 1;
+    if (x->record.lamport != y->record.lamport) return x->record.lamport < y->record.lamport ? -1 : 1;
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+/* find_send returns the first unmatched SEND for a RECV, or -1. */
+static int find_send(const struct event* receive) {
+    int low = 0, high = send_count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        const struct event* send = &events[send_order[middle]];
+        int before = send->process_id != receive->record.peer
+                         ? send->process_id < receive->record.peer
+                         : send->record.peer != receive->process_id
+                               ? send->record.peer < receive->process_id
+                               : send->record.lamport < receive->record.lamport;
+        if (before) low = middle + 1;
+        else high = middle;
+    }
+    for (; low < send_count; low++) {
+        const struct event* send = &events[send_order[low]];
+        if (send->process_id != receive->record.peer || send->record.peer != receive->process_id ||
+            send->record.lamport != receive->record.lamport) {
+            break;
+        }
+        if (send->matched_receive == -1) return send_order[low];
+    }
+    return -1;
+}
+
+/* Ready events are kept in a binary heap ordered by (local clock, process). */
+static int* heap = NULL;
+static int heap_size = 0;
+
+static int heap_before(int a, int b) {
+    if (events[a].record.local_clock != events[b].record.local_clock) {
+        return events[a].record.local_clock < events[b].record.local_clock;
+    }
+    return events[a].process_id < events[b].process_id;
+}
+
+static void heap_push(int event) {
+    int i = heap_size++;
+    heap[i] = event;
+    while (i > 0 && heap_before(heap[i], heap[(i - 1) / 2])) {
+        int parent = (i - 1) / 2;
+        int tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+static int heap_pop(void) {
+    int top = heap[0];
+    heap[0] = heap[--heap_size];
+    int i = 0;
+    for (;;) {
+        int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < heap_size && heap_before(heap[left], heap[smallest])) smallest = left;
+        if (right < heap_size && heap_before(heap[right], heap[smallest])) smallest = right;
+        if (smallest == i) break;
+        int tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+    return top;
+}
+
+static const char* operation_name(int opcode) {
+    static char unknown[16];
+    switch (opcode) {
+        case READY_TO_SHUTDOWN: return "READY_TO_SHUTDOWN";
+        case SHUTDOWN_NOW: return "SHUTDOWN_NOW";
+        case SHUTDOWN_ACK: return "SHUTDOWN_ACK";
+        case WIRE_OP_BARRIER: return "BARRIER";
+        case WIRE_OP_MULTICAST: return "MULTICAST";
+        case WIRE_OP_MULTICAST_ACK: return "MULTICAST_ACK";
+        case WIRE_OP_LOCK_REQUEST: return "LOCK_REQUEST";
+        case WIRE_OP_LOCK_REPLY: return "LOCK_REPLY";
+    }
+    snprintf(unknown, sizeof(unknown), "OP%d", opcode);
+    return unknown;
+}
+
+static void print_event(const struct event* event) {
+    const struct trace_record* record = &event->record;
+    printf("%llu.%09llu P%u, %u, %s (P%u), %s",
+           (unsigned long long)(record->wall_ns / 1000000000ull),
+           (unsigned long long)(record->wall_ns % 1000000000ull),
+           event->process_id, record->local_clock,
+           record->type == TRACE_SEND ? "SEND" : "RECV", record->peer,
+           operation_name(record->opcode));
+    if (record->type == TRACE_RECV) printf(" [sent at %u]", record->lamport);
+    printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <process.trace>...\n", argv[0]);
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (load_trace(argv[i]) != 0) return 1;
+    }
+
+    qsort(events, event_count, sizeof(struct event), compare_program_order);
+    send_order = malloc((event_count + 1) * sizeof(int));
+    heap = malloc((event_count + 1) * sizeof(int));
+    for (int i = 0; i < event_count; i++) {
+        if (i + 1 < event_count && events[i + 1].process_id == events[i].process_id) {
+            events[i].next_in_process = i + 1;
+            events[i + 1].pending++;
+        }
+        if (events[i].record.type == TRACE_SEND) send_order[send_count++] = i;
+    }
+    qsort(send_order, send_count, sizeof(int), compare_sends);
+
+    int matched = 0, orphan_receives = 0;
+    for (int i = 0; i < event_count; i++) {
+        if (events[i].record.type != TRACE_RECV) continue;
+        int send = find_send(&events[i]);
+        if (send < 0) {
+            orphan_receives++;
+            continue;
+        }
+        events[send].matched_receive = i;
+        events[i].pending++;
+        matched++;
+    }
+
+    /* Topological order over program order and message edges */
+    for (int i = 0; i < event_count; i++) {
+        if (events[i].pending == 0) heap_push(i);
+    }
+    int printed = 0;
+    while (heap_size > 0) {
+        int current = heap_pop();
+        print_event(&events[current]);
+        printed++;
+        int successors[2] = {events[current].next_in_process, events[current].matched_receive};
+        for (int k = 0; k < 2; k++) {
+            if (successors[k] >= 0 && --events[successors[k]].pending == 0) heap_push(successors[k]);
+        }
+    }
+
+    fprintf(stderr, "%d events, %d messages matched, %d sends without receive, %d receives without send\n",
+            event_count, matched, send_count - matched, orphan_receives);
+    if (printed < event_count) {
+        fprintf(stderr, "%d events are part of a causal cycle; traces are inconsistent\n",
+                event_count - printed);
+        return 1;
+    }
+    return 0;
+}
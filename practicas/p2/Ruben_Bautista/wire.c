@@ -0,0 +1,117 @@
+#include "wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+static void put_u16(uint8_t* buffer, uint16_t value) {
+    buffer[0] = (uint8_t)(value >> 8);
+    buffer[1] = (uint8_t)value;
+}
+
+static uint16_t get_u16(const uint8_t* buffer) {
+    return (uint16_t)((buffer[0] << 8) | buffer[1]);
+}
+
+/* put_varint writes value as unsigned LEB128 and returns the bytes used. */
+static size_t put_varint(uint8_t* buffer, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        buffer[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[length++] = (uint8_t)value;
+    return length;
+}
+
+/* get_varint64 reads an unsigned LEB128 value of at most bits bits. It
+   returns the bytes consumed, 0 if the buffer ends first and -1 if it is
+   too long or its last byte sets bits above the limit. */
+static int get_varint64(const uint8_t* buffer, size_t length, int bits, uint64_t* value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < bits; shift += 7) {
+        size_t i = shift / 7;
+        if (i == length) return 0;
+        if (shift + 7 > bits && (buffer[i] & 0x7F) >> (bits - shift) != 0) return -1;
+        result |= (uint64_t)(buffer[i] & 0x7F) << shift;
+        if ((buffer[i] & 0x80) == 0) {
+            *value = result;
+            return (int)i + 1;
+        }
+    }
+    return -1;
+}
+
+/* get_varint reads a 32-bit value, at most 5 bytes. */
+static int get_varint(const uint8_t* buffer, size_t length, uint32_t* value) {
+    uint64_t result;
+    int used = get_varint64(buffer, length, 32, &result);
+    if (used > 0) *value = (uint32_t)result;
+    return used;
+}
+
+/* wire_encode writes frame into buffer, which must hold WIRE_MAX_FRAME
+   bytes, and returns the encoded length. */
+size_t wire_encode(const struct wire_frame* frame, uint8_t* buffer) {
+    buffer[0] = WIRE_VERSION;
+    buffer[1] = frame->opcode;
+    buffer[2] = frame->flags;
+    put_u16(buffer + 3, frame->source);
+    put_u16(buffer + 5, frame->destination);
+    size_t length = WIRE_HEADER_SIZE + put_varint(buffer + WIRE_HEADER_SIZE, frame->clock);
+    if (frame->flags & WIRE_FLAG_ARGUMENT) {
+        length += put_varint(buffer + length, frame->argument);
+    }
+    if (frame->flags & WIRE_FLAG_HLC) {
+        length += put_varint(buffer + length, frame->hlc);
+    }
+    return length;
+}
+
+/* wire_decode parses one frame from the start of buffer. It returns the
+   frame length, 0 when more bytes are needed, or -1 for a frame that
+   cannot be parsed (unknown version or malformed varint). */
+int wire_decode(const uint8_t* buffer, size_t length, struct wire_frame* frame) {
+    if (length < WIRE_MIN_FRAME) return 0;
+    if (buffer[0] != WIRE_VERSION) return -1;
+
+    frame->opcode = buffer[1];
+    frame->flags = buffer[2];
+    frame->source = get_u16(buffer + 3);
+    frame->destination = get_u16(buffer + 5);
+
+    int used = get_varint(buffer + WIRE_HEADER_SIZE, length - WIRE_HEADER_SIZE, &frame->clock);
+    if (used <= 0) return used;
+    size_t offset = WIRE_HEADER_SIZE + used;
+
+    frame->argument = 0;
+    if (frame->flags & WIRE_FLAG_ARGUMENT) {
+        used = get_varint64(buffer + offset, length - offset, 64, &frame->argument);
+        if (used <= 0) return used;
+        offset += used;
+    }
+
+    frame->hlc = 0;
+    if (frame->flags & WIRE_FLAG_HLC) {
+        used = get_varint64(buffer + offset, length - offset, 64, &frame->hlc);
+        if (used <= 0) return used;
+        offset += used;
+    }
+    return (int)offset;
+}
+
+/* wire_process_id maps a process name of the form "P<number>" to its
+   numeric id, or returns -1 when the name has another form. */
+int wire_process_id(const char* process_name) {
+    if (process_name[0] != 'P' || !isdigit((unsigned char)process_name[1])) return -1;
+    if (process_name[1] == '0' && process_name[2] != '\0') return -1;
+
+    char* end;
+    long id = strtol(process_name + 1, &end, 10);
+    if (*end != '\0' || id > WIRE_MAX_PROCESS_ID) return -1;
+    return (int)id;
+}
+
+/* wire_process_name is the inverse of wire_process_id. */
+void wire_process_name(uint16_t process_id, char* process_name, size_t size) {
+    snprintf(process_name, size, "P%u", process_id);
+}
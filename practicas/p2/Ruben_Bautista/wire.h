@@ -0,0 +1,60 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Frame layout, all multi-byte fields in network byte order:
+     byte 0     version (WIRE_VERSION)
+     byte 1     opcode (enum operations value, or a stub control opcode)
+     byte 2     flags
+     bytes 3-4  source process id
+     bytes 5-6  destination process id
+     bytes 7-   Lamport clock as an unsigned LEB128 varint (1 to 5 bytes)
+     then       argument as a 64-bit varint (1 to 10 bytes), only with
+                WIRE_FLAG_ARGUMENT
+     then       hybrid logical clock as a 64-bit varint (up to 10 bytes),
+                only with WIRE_FLAG_HLC */
+#define WIRE_VERSION 1
+#define WIRE_HEADER_SIZE 7
+#define WIRE_MIN_FRAME (WIRE_HEADER_SIZE + 1)
+#define WIRE_MAX_FRAME (WIRE_HEADER_SIZE + 5 + 10 + 10)
+#define WIRE_MAX_PROCESS_ID 0xFFFF
+
+#define WIRE_FLAG_ARGUMENT 0x01
+#define WIRE_FLAG_HLC 0x02
+
+/* Opcodes from WIRE_FIRST_CONTROL_OPCODE on are consumed by the stub
+   itself and never reach the application. Link opcodes, from
+   WIRE_FIRST_LINK_OPCODE on, manage one connection: they are neither
+   relayed nor sequenced, and carry no Lamport clock. */
+#define WIRE_FIRST_CONTROL_OPCODE 0x40
+#define WIRE_OP_BARRIER 0x40
+#define WIRE_OP_MULTICAST 0x41
+#define WIRE_OP_MULTICAST_ACK 0x42
+#define WIRE_OP_LOCK_REQUEST 0x43
+#define WIRE_OP_LOCK_REPLY 0x44
+#define WIRE_OP_SNAPSHOT_MARKER 0x45
+#define WIRE_OP_SNAPSHOT_DONE 0x46
+#define WIRE_FIRST_LINK_OPCODE 0x60
+#define WIRE_OP_LINK_HELLO 0x60
+#define WIRE_OP_LINK_ACK 0x61
+#define WIRE_OP_LINK_CLOSE 0x62
+#define WIRE_OP_LINK_SHM 0x63
+
+struct wire_frame {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t source;
+    uint16_t destination;
+    uint32_t clock;
+    uint64_t argument;
+    uint64_t hlc;
+};
+
+size_t wire_encode(const struct wire_frame* frame, uint8_t* buffer);
+int wire_decode(const uint8_t* buffer, size_t length, struct wire_frame* frame);
+int wire_process_id(const char* process_name);
+void wire_process_name(uint16_t process_id, char* process_name, size_t size);
+
+#endif
@@ -0,0 +1,119 @@
+#include "stub.h"
+#include "wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* wire_bench times wire_encode/wire_decode and compares the encoded size
+   with the raw struct message that used to go over the socket, without
+   and with the hybrid logical clock. It first checks that the largest
+   clocks round trip and that varints overflowing their field are
+   rejected. */
+
+#define FRAMES 4096
+
+/* Keeps the compiler from discarding the decoded frames */
+static volatile unsigned long decode_sink;
+
+static double elapsed_ns(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+/* bench_clock_range encodes and decodes FRAMES frames whose clocks start
+   at first_clock, rounds times, and prints the per-frame cost and size.
+   With with_hlc the frames also carry a current hybrid logical clock. */
+static void bench_clock_range(unsigned int first_clock, int with_hlc, int rounds) {
+    static uint8_t buffer[FRAMES * WIRE_MAX_FRAME];
+    struct wire_frame frame = {.flags = with_hlc ? WIRE_FLAG_HLC : 0, .source = 1, .destination = 2};
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t first_hlc = (uint64_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000) << HLC_LOGICAL_BITS;
+    struct wire_frame decoded;
+    struct timespec start, end;
+    size_t length = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < rounds; r++) {
+        length = 0;
+        for (int i = 0; i < FRAMES; i++) {
+            frame.opcode = i % 3;
+            frame.clock = first_clock + i;
+            frame.hlc = with_hlc ? first_hlc + i : 0;
+            length += wire_encode(&frame, buffer + length);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double encode_ns = elapsed_ns(start, end) / ((double)rounds * FRAMES);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < rounds; r++) {
+        size_t offset = 0;
+        int used;
+        while ((used = wire_decode(buffer + offset, length - offset, &decoded)) > 0) {
+            decode_sink += decoded.clock + decoded.hlc;
+            offset += used;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double decode_ns = elapsed_ns(start, end) / ((double)rounds * FRAMES);
+
+    printf("clock %10u+%s  %5.2f bytes/msg (raw struct %zu)  encode %5.1f ns  decode %5.1f ns\n",
+           first_clock, with_hlc ? " hlc" : "    ", (double)length / FRAMES, sizeof(struct message), encode_ns, decode_ns);
+}
+
+/* check_decode decodes a hand-built frame and compares the result with
+   expected. Returns 0 if they match. */
+static int check_decode(const char* name, const uint8_t* buffer, size_t length, int expected) {
+    struct wire_frame frame;
+    int used = wire_decode(buffer, length, &frame);
+    if (used != expected) {
+        printf("check %-24s FAILED: decode returned %d, expected %d\n", name, used, expected);
+        return -1;
+    }
+    return 0;
+}
+
+/* check_varints round trips the largest clock values and makes sure the
+   decoder rejects a 5th clock byte, or a 10th hlc byte, with bits above
+   the width of the field. Returns 0 if every check passed. */
+static int check_varints(void) {
+    struct wire_frame frame = {.flags = WIRE_FLAG_ARGUMENT | WIRE_FLAG_HLC, .source = 1, .destination = 2,
+                               .clock = UINT32_MAX, .argument = UINT64_MAX, .hlc = UINT64_MAX};
+    struct wire_frame decoded;
+    uint8_t buffer[WIRE_MAX_FRAME];
+    int failed = 0;
+
+    size_t length = wire_encode(&frame, buffer);
+    if (wire_decode(buffer, length, &decoded) != (int)length || decoded.clock != UINT32_MAX ||
+        decoded.argument != UINT64_MAX || decoded.hlc != UINT64_MAX) {
+        printf("check %-24s FAILED\n", "largest values");
+        failed = 1;
+    }
+
+    const uint8_t clock_33_bits[] = {WIRE_VERSION, 0, 0, 0, 1, 0, 2, 0xFF, 0xFF, 0xFF, 0xFF, 0x1F};
+    const uint8_t clock_6_bytes[] = {WIRE_VERSION, 0, 0, 0, 1, 0, 2, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00};
+    const uint8_t hlc_65_bits[] = {WIRE_VERSION, 0, WIRE_FLAG_HLC, 0, 1, 0, 2, 0x00,
+                                   0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x03};
+    failed |= check_decode("clock over 32 bits", clock_33_bits, sizeof(clock_33_bits), -1) != 0;
+    failed |= check_decode("clock over 5 bytes", clock_6_bytes, sizeof(clock_6_bytes), -1) != 0;
+    failed |= check_decode("hlc over 64 bits", hlc_65_bits, sizeof(hlc_65_bits), -1) != 0;
+    if (!failed) printf("varint checks ok\n");
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = (argc > 1) ? atoi(argv[1]) : 2000;
+    if (rounds <= 0) {
+        printf("Usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+    if (check_varints() != 0) return 1;
+
+    for (int with_hlc = 0; with_hlc <= 1; with_hlc++) {
+        bench_clock_range(0, with_hlc, rounds);
+        bench_clock_range(1u << 14, with_hlc, rounds);
+        bench_clock_range(1u << 21, with_hlc, rounds);
+        bench_clock_range(1u << 28, with_hlc, rounds);
+    }
+    return 0;
+}
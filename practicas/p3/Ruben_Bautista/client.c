@@ -4,6 +4,9 @@ char *server_ip_address = NULL;
 int server_port_number = 0;
 int client_mode = 0;
 int number_of_threads = 0;
+int requests_per_connection = 1;
+int batch_size = 0;
+unsigned int counter_key = 0;
 
 volatile sig_atomic_t interrupted = 0;
 pthread_t *threads = NULL;
@@ -13,6 +16,10 @@ int number_of_created_threads = 0;
 // print_thread_result(): Prints the result of a thread's operation.
 void print_thread_result(int thread_id, struct response *resp) {
     const char *mode_str;
+    if (resp->action == FAILED) {
+        fprintf(stderr, "[Cliente #%d] Error: the server could not save the write\n", thread_id);
+        return;
+    }
     if (resp->action == READ) {
         mode_str = "Lector";
     } else {
@@ -23,19 +30,22 @@ void print_thread_result(int thread_id, struct response *resp) {
 }
 
 // parse_client_arguments(): Parses command-line arguments for the client.
-int parse_client_arguments(int argc, char *argv[], char **ip, int *port, int *mode, int *threadss) {
+int parse_client_arguments(int argc, char *argv[], char **ip, int *port, int *mode, int *threadss, int *requests, int *batch) {
     static struct option long_options[] = {
         {"ip", required_argument, 0, 'i'},
         {"port", required_argument, 0, 'p'},
         {"mode", required_argument, 0, 'm'},
         {"threads", required_argument, 0, 't'},
+        {"requests", required_argument, 0, 'n'},
+        {"batch", required_argument, 0, 'b'},
+        {"key", required_argument, 0, 'k'},
         {0, 0, 0, 0}
     };
     
     int opt;
     int option_index = 0;
     
-    while ((opt = getopt_long(argc, argv, "i:p:m:t:", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "i:p:m:t:n:b:k:", long_options, &option_index)) != -1) {
         if (opt == 'i') {
             *ip = optarg;
         } else if (opt == 'p') {
@@ -45,8 +55,10 @@ int parse_client_arguments(int argc, char *argv[], char **ip, int *port, int *mo
                 *mode = 0;
             } else if (strcmp(optarg, "writer") == 0) {
                 *mode = 1;
+            } else if (strcmp(optarg, "stats") == 0) {
+                *mode = 2;
             } else {
-                fprintf(stderr, "Error: mode must be reader or writer\n");
+                fprintf(stderr, "Error: mode must be reader, writer or stats\n");
                 return -1;
             }
         } else if (opt == 't') {
@@ -55,20 +67,103 @@ int parse_client_arguments(int argc, char *argv[], char **ip, int *port, int *mo
                 fprintf(stderr, "Error: threads must be positive integer\n");
                 return -1;
             }
+        } else if (opt == 'n') {
+            *requests = atoi(optarg);
+            if (*requests <= 0) {
+                fprintf(stderr, "Error: requests must be positive integer\n");
+                return -1;
+            }
+        } else if (opt == 'b') {
+            *batch = atoi(optarg);
+            if (*batch <= 0 || *batch > MAX_BATCH_SIZE) {
+                fprintf(stderr, "Error: batch must be between 1 and %d\n", MAX_BATCH_SIZE);
+                return -1;
+            }
+        } else if (opt == 'k') {
+            counter_key = strtoul(optarg, NULL, 10);
         } else {
             return -1;
         }
     }
     
     if (*ip == NULL || *port == 0 || *threadss == 0) {
-        fprintf(stderr, "Usage: %s --ip IP --port PORT --mode reader/writer --threads N\n", argv[0]);
+        fprintf(stderr, "Usage: %s --ip IP --port PORT --mode reader/writer/stats --threads N [--requests N] [--batch N] [--key K]\n", argv[0]);
         return -1;
     }
     
     return 0;
 }
 
-// comunication_server(): Thread function to communicate with the server.
+// request_stats(): Asks the server for its latency report and prints it.
+int request_stats(int client_socket, int thread_id) {
+    struct request stats_req;
+    struct response stats_resp;
+    struct latency_row rows[LATENCY_METRICS * 2];
+    
+    stats_req.action = STATS;
+    stats_req.id = thread_id;
+    stats_req.key = 0;
+    if (send_request(client_socket, &stats_req) <= 0) {
+        fprintf(stderr, "[Cliente #%d] Error sending request\n", thread_id);
+        return -1;
+    }
+    
+    int count = receive_stats_response(client_socket, &stats_resp, rows, LATENCY_METRICS * 2);
+    if (count < 0 || stats_resp.id != stats_req.id) {
+        fprintf(stderr, "[Cliente #%d] Error receiving stats\n", thread_id);
+        return -1;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        printf("[Cliente #%d] %s %s: n=%lu p50=%ld p99=%ld p99.9=%ld max=%ld ns\n", thread_id,
+               rows[i].action == READ ? "Lector" : "Escritor", latency_metric_name(rows[i].metric),
+               rows[i].count, rows[i].p50_ns, rows[i].p99_ns, rows[i].p999_ns, rows[i].max_ns);
+    }
+    return 0;
+}
+
+/* send_batch_request(): Sends batch_size requests of the thread's mode in
+ one BATCH frame and prints the result of each. Returns -1 on error.*/
+int send_batch_request(int client_socket, int thread_id, struct request *batch_req) {
+    struct request *items = malloc(batch_size * sizeof(struct request));
+    struct response *results = malloc(batch_size * sizeof(struct response));
+    struct response batch_resp;
+    int result = -1;
+    
+    if (items == NULL || results == NULL) {
+        fprintf(stderr, "[Cliente #%d] Error: Memory allocation failed\n", thread_id);
+        free(items);
+        free(results);
+        return -1;
+    }
+    
+    for (int i = 0; i < batch_size; i++) {
+        items[i].action = batch_req->action;
+        items[i].id = thread_id;
+        items[i].key = counter_key;
+    }
+    
+    if (send_batch(client_socket, batch_req, items, batch_size) <= 0) {
+        fprintf(stderr, "[Cliente #%d] Error sending batch\n", thread_id);
+    } else if (receive_batch_response(client_socket, &batch_resp, results, batch_size) != batch_size ||
+               batch_resp.id != batch_req->id) {
+        fprintf(stderr, "[Cliente #%d] Error receiving batch response\n", thread_id);
+    } else {
+        for (int i = 0; i < batch_size; i++) {
+            print_thread_result(thread_id, &results[i]);
+        }
+        result = 0;
+    }
+    
+    free(items);
+    free(results);
+    return result;
+}
+
+/* comunication_server(): Thread function to communicate with the server.
+ Sends requests_per_connection requests over one session; each one gets
+ its own id, and its response must carry the same id. With --batch, each
+ request is a BATCH frame of batch_size operations.*/
 void *comunication_server(void *thread_id_ptr) {
     int thread_id = *(int *)thread_id_ptr;
     int client_socket;
@@ -81,26 +176,49 @@ void *comunication_server(void *thread_id_ptr) {
         return NULL;
     }
     
+    if (client_mode == 2) {
+        request_stats(client_socket, thread_id);
+        close_connection(client_socket);
+        return NULL;
+    }
+    
     if (client_mode == 0) {
         client_req.action = READ;
     } else {
         client_req.action = WRITE;
     }
-    client_req.id = thread_id;
     
-    if (send_request(client_socket, &client_req) <= 0) {
-        fprintf(stderr, "[Cliente #%d] Error sending request\n", thread_id);
-        close_connection(client_socket);
-        return NULL;
-    }
-    
-    if (receive_response(client_socket, &server_resp) <= 0) {
-        fprintf(stderr, "[Cliente #%d] Error receiving response\n", thread_id);
-        close_connection(client_socket);
-        return NULL;
+    for (int i = 0; i < requests_per_connection && !interrupted; i++) {
+        // With one request per connection the id is the thread id, as before
+        client_req.id = thread_id * requests_per_connection + i;
+        client_req.key = counter_key;
+        
+        if (batch_size > 0) {
+            struct request batch_req = client_req;
+            if (send_batch_request(client_socket, thread_id, &batch_req) != 0) {
+                break;
+            }
+            continue;
+        }
+        
+        if (send_request(client_socket, &client_req) <= 0) {
+            fprintf(stderr, "[Cliente #%d] Error sending request\n", thread_id);
+            break;
+        }
+        
+        if (receive_response(client_socket, &server_resp) <= 0) {
+            fprintf(stderr, "[Cliente #%d] Error receiving response\n", thread_id);
+            break;
+        }
+        
+        if (server_resp.id != client_req.id) {
+            fprintf(stderr, "[Cliente #%d] Response for request %u, expected %u\n",
+                    thread_id, server_resp.id, client_req.id);
+            break;
+        }
+        
+        print_thread_result(thread_id, &server_resp);
     }
-    
-    print_thread_result(thread_id, &server_resp);
     close_connection(client_socket);
     
     return NULL;
@@ -136,7 +254,7 @@ int main(int argc, char *argv[]) {
     signal(SIGPIPE, SIG_IGN);
     
     if (parse_client_arguments(argc, argv, &server_ip_address, &server_port_number, 
-                              &client_mode, &number_of_threads) != 0) {
+                              &client_mode, &number_of_threads, &requests_per_connection, &batch_size) != 0) {
         exit(EXIT_FAILURE);
     }
     
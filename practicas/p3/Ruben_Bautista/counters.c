@@ -0,0 +1,182 @@
+#include "counters.h"
+
+/* One shard: its gate and an open addressing table of its keys. Shards
+   are aligned so that the gates of two shards never share a cache line. */
+struct counter_shard {
+    struct rw_gate gate;
+    unsigned int *keys;
+    int *values;
+    unsigned char *used;
+    int capacity;
+    int size;
+} __attribute__((aligned(64)));
+
+static struct counter_shard *shards = NULL;
+static int shard_count = 0;
+
+// key_hash(): Mixes the bits of a key, so consecutive keys spread over shards and slots.
+static unsigned int key_hash(unsigned int key) {
+    key ^= key >> 16;
+    key *= 0x7feb352du;
+    key ^= key >> 15;
+    key *= 0x846ca68bu;
+    key ^= key >> 16;
+    return key;
+}
+
+// counters_shard_of(): Shard that holds a key.
+int counters_shard_of(unsigned int key) {
+    return key_hash(key) % shard_count;
+}
+
+/* find_slot(): Slot of key in the table of a shard, or of the empty slot
+ where it would go. The table is never full. */
+static int find_slot(struct counter_shard *shard, unsigned int key) {
+    int slot = (key_hash(key) / shard_count) & (shard->capacity - 1);
+
+    while (shard->used[slot] && shard->keys[slot] != key) {
+        slot = (slot + 1) & (shard->capacity - 1);
+    }
+    return slot;
+}
+
+// allocate_table(): Gives a shard an empty table of capacity slots (a power of two).
+static int allocate_table(struct counter_shard *shard, int capacity) {
+    shard->keys = malloc(capacity * sizeof(unsigned int));
+    shard->values = malloc(capacity * sizeof(int));
+    shard->used = calloc(capacity, sizeof(unsigned char));
+    if (shard->keys == NULL || shard->values == NULL || shard->used == NULL) {
+        free(shard->keys);
+        free(shard->values);
+        free(shard->used);
+        shard->keys = NULL;
+        shard->values = NULL;
+        shard->used = NULL;
+        return -1;
+    }
+    shard->capacity = capacity;
+    shard->size = 0;
+    return 0;
+}
+
+// grow_table(): Doubles the table of a shard and moves its keys over.
+static int grow_table(struct counter_shard *shard) {
+    struct counter_shard old = *shard;
+
+    if (allocate_table(shard, old.capacity * 2) != 0) {
+        *shard = old;
+        return -1;
+    }
+    for (int i = 0; i < old.capacity; i++) {
+        if (old.used[i]) {
+            int slot = find_slot(shard, old.keys[i]);
+            shard->used[slot] = 1;
+            shard->keys[slot] = old.keys[i];
+            shard->values[slot] = old.values[i];
+            shard->size++;
+        }
+    }
+    free(old.keys);
+    free(old.values);
+    free(old.used);
+    return 0;
+}
+
+/* value_slot(): Slot holding key in its shard, adding it with value 0 if
+ needed. Only call it from the writer admitted to the shard. Returns -1
+ if the table cannot grow. */
+static int value_slot(struct counter_shard *shard, unsigned int key) {
+    int slot = find_slot(shard, key);
+
+    if (shard->used[slot]) {
+        return slot;
+    }
+    // Keep the load under 3/4 so probes stay short
+    if ((shard->size + 1) * 4 > shard->capacity * 3) {
+        if (grow_table(shard) != 0) {
+            return -1;
+        }
+        slot = find_slot(shard, key);
+    }
+    shard->used[slot] = 1;
+    shard->keys[slot] = key;
+    shard->values[slot] = 0;
+    shard->size++;
+    return slot;
+}
+
+// counters_init(): Creates the shards with empty tables and gates.
+int counters_init(int count, int ratio, int prefer_writers) {
+    void *memory;
+    
+    if (posix_memalign(&memory, 64, count * sizeof(struct counter_shard)) != 0) {
+        return -1;
+    }
+    shards = memory;
+    memset(shards, 0, count * sizeof(struct counter_shard));
+    shard_count = count;
+    for (int i = 0; i < count; i++) {
+        if (gate_init(&shards[i].gate, ratio, prefer_writers) != 0 ||
+            allocate_table(&shards[i], SHARD_INITIAL_CAPACITY) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// counters_enter(): Waits until the gate of the key's shard lets the request in.
+void counters_enter(unsigned int key, const struct rw_policy *policy, enum operations action) {
+    gate_enter(&shards[counters_shard_of(key)].gate, policy, action);
+}
+
+// counters_exit(): Leaves the gate of the key's shard.
+void counters_exit(unsigned int key, const struct rw_policy *policy, enum operations action) {
+    gate_exit(&shards[counters_shard_of(key)].gate, policy, action);
+}
+
+// counters_read(): Value of a key; the caller is a reader admitted to its shard.
+int counters_read(unsigned int key) {
+    struct counter_shard *shard = &shards[counters_shard_of(key)];
+    int slot = find_slot(shard, key);
+
+    return shard->used[slot] ? shard->values[slot] : 0;
+}
+
+/* counters_increment(): Adds one to a key and stores the new value in
+ value; the caller is the writer admitted to its shard. Returns -1,
+ leaving value alone, if the key cannot be added. */
+int counters_increment(unsigned int key, int *value) {
+    struct counter_shard *shard = &shards[counters_shard_of(key)];
+    int slot = value_slot(shard, key);
+
+    if (slot < 0) {
+        return -1;
+    }
+    *value = ++shard->values[slot];
+    return 0;
+}
+
+// counters_set(): Sets a key before any request is served. Returns -1 if it cannot be added.
+int counters_set(unsigned int key, int value) {
+    struct counter_shard *shard = &shards[counters_shard_of(key)];
+    int slot = value_slot(shard, key);
+
+    if (slot < 0) {
+        return -1;
+    }
+    shard->values[slot] = value;
+    return 0;
+}
+
+// counters_free(): Destroys the gates and frees the tables of every shard.
+void counters_free(void) {
+    for (int i = 0; i < shard_count && shards != NULL; i++) {
+        gate_destroy(&shards[i].gate);
+        free(shards[i].keys);
+        free(shards[i].values);
+        free(shards[i].used);
+    }
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include "policy.h"
+
+/* Keyed counters of the server. Keys are spread over shards by hash, and
+   every shard has its own readers-writers gate and its own table, so
+   requests on keys of different shards never wait for each other.
+
+   A table is only read by readers its gate admitted and only changed by
+   the writer it admitted alone, so values need no lock or atomic of
+   their own. A key that was never written reads as 0. Key 0 is the
+   counter of the original protocol, the one the server persists. */
+#define DEFAULT_SHARDS 64
+#define SHARD_INITIAL_CAPACITY 16
+
+int counters_init(int shards, int ratio, int prefer_writers);
+int counters_shard_of(unsigned int key);
+void counters_enter(unsigned int key, const struct rw_policy *policy, enum operations action);
+void counters_exit(unsigned int key, const struct rw_policy *policy, enum operations action);
+int counters_read(unsigned int key);
+int counters_increment(unsigned int key, int *value);
+int counters_set(unsigned int key, int value);
+void counters_free(void);
+
+#endif
@@ -0,0 +1,157 @@
+#include "latency.h"
+#include <stdatomic.h>
+
+struct latency_histograms {
+    atomic_uint buckets[LATENCY_CLASSES][LATENCY_METRICS][LATENCY_BUCKETS];
+    atomic_long max_ns[LATENCY_CLASSES][LATENCY_METRICS];
+    struct latency_histograms *next;
+};
+
+// Every thread that recorded, newest first; entries are only freed by latency_free()
+static _Atomic(struct latency_histograms *) all_histograms = NULL;
+static __thread struct latency_histograms *own_histograms = NULL;
+
+// class_of(): Histogram class of an operation.
+static int class_of(enum operations action) {
+    return action == WRITE ? 1 : 0;
+}
+
+// bucket_of(): Log-linear bucket of a value in ns.
+static int bucket_of(long ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return ns < 0 ? 0 : ns;
+    }
+    int exponent = 63 - __builtin_clzl(ns);
+    if (exponent > LATENCY_MAX_EXPONENT) {
+        return LATENCY_BUCKETS - 1;
+    }
+    int shift = exponent - LATENCY_SUB_BUCKET_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + ((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// bucket_limit(): Largest value in ns that falls in a bucket.
+static long bucket_limit(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    long lower = (long)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << shift;
+    return lower + (1L << shift) - 1;
+}
+
+/* thread_histograms(): The calling thread's histograms, created and
+ published on its first record. */
+static struct latency_histograms *thread_histograms(void) {
+    if (own_histograms == NULL) {
+        struct latency_histograms *histograms = calloc(1, sizeof(struct latency_histograms));
+        if (histograms == NULL) {
+            return NULL;
+        }
+        histograms->next = atomic_load(&all_histograms);
+        while (!atomic_compare_exchange_weak(&all_histograms, &histograms->next, histograms)) {
+        }
+        own_histograms = histograms;
+    }
+    return own_histograms;
+}
+
+// latency_record(): Records count operations of type action that took ns for metric.
+void latency_record(enum operations action, enum latency_metric metric, long ns, unsigned int count) {
+    struct latency_histograms *histograms = thread_histograms();
+    if (histograms == NULL) {
+        return;
+    }
+    int class = class_of(action);
+
+    // Only this thread writes them, so a load and a store are enough
+    atomic_uint *bucket = &histograms->buckets[class][metric][bucket_of(ns)];
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + count,
+                          memory_order_relaxed);
+    if (ns > atomic_load_explicit(&histograms->max_ns[class][metric], memory_order_relaxed)) {
+        atomic_store_explicit(&histograms->max_ns[class][metric], ns, memory_order_relaxed);
+    }
+}
+
+// percentile(): Upper limit of the bucket holding the given fraction of the samples.
+static long percentile(unsigned long *counts, unsigned long total, double fraction, long max_ns) {
+    unsigned long rank = (unsigned long)(fraction * total);
+    unsigned long seen = 0;
+
+    if (rank >= total) {
+        rank = total - 1;
+    }
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += counts[bucket];
+        if (seen > rank) {
+            long limit = bucket_limit(bucket);
+            return limit < max_ns ? limit : max_ns;
+        }
+    }
+    return max_ns;
+}
+
+/* latency_report(): Adds up the histograms of every thread into one row
+ per class and metric. Returns the number of rows written. */
+int latency_report(struct latency_row *rows, int max) {
+    unsigned long *counts = malloc(LATENCY_BUCKETS * sizeof(unsigned long));
+    int written = 0;
+
+    if (counts == NULL) {
+        return 0;
+    }
+    for (int class = 0; class < LATENCY_CLASSES; class++) {
+        for (int metric = 0; metric < LATENCY_METRICS && written < max; metric++) {
+            struct latency_row *row = &rows[written++];
+            memset(row, 0, sizeof(*row));
+            memset(counts, 0, LATENCY_BUCKETS * sizeof(unsigned long));
+            row->action = class == 1 ? WRITE : READ;
+            row->metric = metric;
+
+            struct latency_histograms *histograms = atomic_load(&all_histograms);
+            for (; histograms != NULL; histograms = histograms->next) {
+                for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+                    unsigned int count = atomic_load_explicit(&histograms->buckets[class][metric][bucket],
+                                                              memory_order_relaxed);
+                    counts[bucket] += count;
+                    row->count += count;
+                }
+                long max_ns = atomic_load_explicit(&histograms->max_ns[class][metric], memory_order_relaxed);
+                if (max_ns > row->max_ns) {
+                    row->max_ns = max_ns;
+                }
+            }
+            if (row->count > 0) {
+                row->p50_ns = percentile(counts, row->count, 0.50, row->max_ns);
+                row->p99_ns = percentile(counts, row->count, 0.99, row->max_ns);
+                row->p999_ns = percentile(counts, row->count, 0.999, row->max_ns);
+            }
+        }
+    }
+    free(counts);
+    return written;
+}
+
+// latency_print(): Prints the report as a table, in ms.
+void latency_print(FILE *out, const char *policy_name) {
+    struct latency_row rows[LATENCY_ROWS];
+    int count = latency_report(rows, LATENCY_ROWS);
+
+    fprintf(out, "latency (ms), policy %s\n", policy_name);
+    fprintf(out, "  %-7s %-11s %10s %10s %10s %10s %10s\n", "class", "metric", "count", "p50", "p99", "p99.9", "max");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "  %-7s %-11s %10lu %10.3f %10.3f %10.3f %10.3f\n",
+                rows[i].action == WRITE ? "writer" : "reader", latency_metric_name(rows[i].metric), rows[i].count,
+                rows[i].p50_ns / 1e6, rows[i].p99_ns / 1e6, rows[i].p999_ns / 1e6, rows[i].max_ns / 1e6);
+    }
+}
+
+// latency_free(): Frees every thread's histograms; call it once no thread records any more.
+void latency_free(void) {
+    struct latency_histograms *histograms = atomic_exchange(&all_histograms, NULL);
+
+    while (histograms != NULL) {
+        struct latency_histograms *next = histograms->next;
+        free(histograms);
+        histograms = next;
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "stub.h"
+
+/* Latency histograms of the server, per class (READ, WRITE) and metric:
+   QUEUE_WAIT is the time waiting in can_pass(), CRITICAL_SECTION the
+   time inside the gate, and TOTAL_TIME the time from receiving the
+   request to sending its response.
+
+   Buckets are log-linear: values below LATENCY_SUB_BUCKETS ns have their
+   own bucket, and every power of two above is split in
+   LATENCY_SUB_BUCKETS, so a percentile is off by at most 1/16. Each
+   thread records in its own histograms with plain relaxed stores, so
+   recording takes no lock and shares no cache line; a report adds up
+   the histograms of every thread. */
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_EXPONENT 40
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BUCKET_BITS + 2) * LATENCY_SUB_BUCKETS)
+#define LATENCY_CLASSES 2
+#define LATENCY_ROWS (LATENCY_CLASSES * LATENCY_METRICS)
+
+void latency_record(enum operations action, enum latency_metric metric, long ns, unsigned int count);
+int latency_report(struct latency_row *rows, int max);
+void latency_print(FILE *out, const char *policy_name);
+void latency_free(void);
+
+#endif
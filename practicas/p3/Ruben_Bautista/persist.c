@@ -0,0 +1,617 @@
+#include "persist.h"
+#include "wal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+static int state_fd = -1;
+static unsigned char *state_map = NULL;
+static const char *export_path = NULL;
+static const char *keys_file = NULL;
+static int next_slot = 0;
+static uint64_t sequence = 0;
+static int64_t exported_value = 0;
+static int wal_opened = 0;
+
+// Written by the commit thread only, once it runs
+static int64_t logged_value = 0;
+static uint64_t logged_lsn = 0;
+static uint64_t snapshot_lsn = 0;
+static uint64_t keys_lsn = 0;
+static struct persist_stats stats;
+
+/* Last logged value of every key but 0, in an open addressing table
+   that is never full. Like logged_value, only the commit thread uses it
+   once it runs. */
+static struct {
+    uint32_t *keys;
+    int32_t *values;
+    int capacity;
+    int size;
+} logged_keys;
+
+// Recovery state, for replay_record()
+static int recovered_value;
+static long replayed_records;
+static int replay_failed;
+
+/* Writes waiting for the commit thread, each with the ticket its WRITE
+   waits on. The commit thread swaps pending with its own batch buffer,
+   so queueing a WRITE never waits for the log; committed_cond wakes the
+   WRITEs once their batch is synced or failed. */
+static pthread_t commit_thread;
+static int commit_thread_running = 0;
+static pthread_mutex_t persist_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t persist_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t committed_cond = PTHREAD_COND_INITIALIZER;
+static struct wal_record *pending = NULL;
+static struct persist_ticket **pending_tickets = NULL;
+static int pending_writes = 0;
+static int pending_waiting = 0;
+static uint64_t pending_group = 0;
+static int pending_capacity = 0;
+static int stopping = 0;
+static int commit_every = DEFAULT_SYNC_EVERY;
+static int commit_ms = DEFAULT_SYNC_MS;
+static int snapshot_every = DEFAULT_SNAPSHOT_EVERY;
+
+// persist_crc32(): CRC-32 (IEEE, reflected) of a buffer.
+uint32_t persist_crc32(const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    uint32_t crc = 0xFFFFFFFFu;
+
+    for (size_t i = 0; i < length; i++) {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+// key_slot(): Slot of key in logged_keys, or of the empty slot where it would go.
+static int key_slot(uint32_t key) {
+    int slot = (key * 0x9E3779B1u) & (logged_keys.capacity - 1);
+
+    while (logged_keys.keys[slot] != 0 && logged_keys.keys[slot] != key) {
+        slot = (slot + 1) & (logged_keys.capacity - 1);
+    }
+    return slot;
+}
+
+/* set_logged_key(): Records the last value logged for a key other than 0,
+   doubling the table when it is 3/4 full. */
+static int set_logged_key(uint32_t key, int32_t value) {
+    if ((logged_keys.size + 1) * 4 > logged_keys.capacity * 3) {
+        int capacity = logged_keys.capacity ? logged_keys.capacity * 2 : 64;
+        uint32_t *keys = calloc(capacity, sizeof(uint32_t));
+        int32_t *values = malloc(capacity * sizeof(int32_t));
+        if (keys == NULL || values == NULL) {
+            free(keys);
+            free(values);
+            return -1;
+        }
+        uint32_t *old_keys = logged_keys.keys;
+        int32_t *old_values = logged_keys.values;
+        int old_capacity = logged_keys.capacity;
+        logged_keys.keys = keys;
+        logged_keys.values = values;
+        logged_keys.capacity = capacity;
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_keys[i] != 0) {
+                int slot = key_slot(old_keys[i]);
+                keys[slot] = old_keys[i];
+                values[slot] = old_values[i];
+            }
+        }
+        free(old_keys);
+        free(old_values);
+    }
+    int slot = key_slot(key);
+    if (logged_keys.keys[slot] == 0) {
+        logged_keys.keys[slot] = key;
+        logged_keys.size++;
+    }
+    logged_keys.values[slot] = value;
+    return 0;
+}
+
+// log_record(): Applies a logged record to logged_value or logged_keys.
+static int log_record(const struct wal_record *record) {
+    if (record->key == 0) {
+        logged_value = record->value;
+        return 0;
+    }
+    return set_logged_key(record->key, record->value);
+}
+
+// valid_header(): Checks the magic, version and checksum of a header slot.
+static int valid_header(const struct state_header *header) {
+    return header->magic == STATE_MAGIC && header->version == STATE_VERSION &&
+           header->checksum == persist_crc32(header, offsetof(struct state_header, checksum));
+}
+
+// read_text_value(): Parses the counter from the text file. Returns 0 if it holds one.
+static int read_text_value(const char *path, int *value) {
+    FILE *file = fopen(path, "r");
+    int result = -1;
+
+    if (file != NULL) {
+        if (fscanf(file, "%d", value) == 1) {
+            result = 0;
+        }
+        fclose(file);
+    }
+    return result;
+}
+
+// write_header(): Writes a snapshot to the older header slot and syncs the mapping.
+static int write_header(int64_t value, uint64_t lsn) {
+    struct state_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = STATE_MAGIC;
+    header.version = STATE_VERSION;
+    header.sequence = sequence + 1;
+    header.committed_value = value;
+    header.exported_value = exported_value;
+    header.wal_lsn = lsn;
+    header.checksum = persist_crc32(&header, offsetof(struct state_header, checksum));
+
+    memcpy(state_map + next_slot * STATE_SLOT_SIZE, &header, sizeof(header));
+    if (msync(state_map, STATE_FILE_SIZE, MS_SYNC) != 0) {
+        return -1;
+    }
+    sequence++;
+    next_slot ^= 1;
+    return 0;
+}
+
+/* export_value(): Rewrites the text file through a rename, so readers
+   and a crash see either the old value or the new one. */
+static int export_value(int64_t value) {
+    char tmp_path[4096];
+    FILE *file;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", export_path);
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    fprintf(file, "%lld", (long long)value);
+    if (fclose(file) != 0 || rename(tmp_path, export_path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    exported_value = value;
+    return 0;
+}
+
+// sync_parent(): Makes a rename in the directory of path durable.
+static int sync_parent(const char *path) {
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+
+    snprintf(dir, sizeof(dir), "%.*s", slash != NULL ? (int)(slash - path) : 1, slash != NULL ? path : ".");
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+/* write_keys(): Rewrites the keys file with the values of logged_keys,
+   which are those after the record lsn, and makes it durable before the
+   log may drop what it covers. */
+static int write_keys(uint64_t lsn) {
+    size_t size = sizeof(struct keys_header) + logged_keys.size * sizeof(struct key_value);
+    unsigned char *buffer = calloc(1, size);
+    char tmp_path[4096];
+    int result = -1;
+
+    if (buffer == NULL) {
+        return -1;
+    }
+    struct keys_header *header = (struct keys_header *)buffer;
+    struct key_value *entries = (struct key_value *)(buffer + sizeof(struct keys_header));
+    header->magic = KEYS_MAGIC;
+    header->version = KEYS_VERSION;
+    header->count = logged_keys.size;
+    header->wal_lsn = lsn;
+    for (int i = 0, n = 0; i < logged_keys.capacity; i++) {
+        if (logged_keys.keys[i] != 0) {
+            entries[n].key = logged_keys.keys[i];
+            entries[n].value = logged_keys.values[i];
+            n++;
+        }
+    }
+    header->checksum = persist_crc32(buffer, size);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", keys_file);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        if (write(fd, buffer, size) == (ssize_t)size && fsync(fd) == 0) {
+            result = 0;
+        }
+        close(fd);
+    }
+    if (result != 0 || rename(tmp_path, keys_file) != 0 || sync_parent(keys_file) != 0) {
+        unlink(tmp_path);
+        result = -1;
+    } else {
+        keys_lsn = lsn;
+    }
+    free(buffer);
+    return result;
+}
+
+/* read_keys(): Loads the keys file into logged_keys and sets keys_lsn.
+   A missing or corrupt file leaves the table empty. Returns -1 only if
+   the table cannot hold the keys. */
+static int read_keys(void) {
+    struct keys_header header;
+    unsigned char *buffer = NULL;
+    FILE *file = fopen(keys_file, "rb");
+    int result = 0;
+
+    keys_lsn = 0;
+    if (file == NULL) {
+        return 0;
+    }
+    if (fread(&header, sizeof(header), 1, file) == 1 && header.magic == KEYS_MAGIC &&
+        header.version == KEYS_VERSION) {
+        size_t size = sizeof(header) + (size_t)header.count * sizeof(struct key_value);
+        buffer = malloc(size);
+        if (buffer != NULL && fread(buffer + sizeof(header), sizeof(struct key_value), header.count, file) == header.count) {
+            uint32_t checksum = header.checksum;
+            header.checksum = 0;
+            memcpy(buffer, &header, sizeof(header));
+            struct key_value *entries = (struct key_value *)(buffer + sizeof(header));
+            if (persist_crc32(buffer, size) == checksum) {
+                keys_lsn = header.wal_lsn;
+                for (uint32_t i = 0; i < header.count && result == 0; i++) {
+                    if (entries[i].key != 0) {
+                        result = set_logged_key(entries[i].key, entries[i].value);
+                    }
+                }
+            }
+        }
+    }
+    free(buffer);
+    fclose(file);
+    return result;
+}
+
+/* take_snapshot(): Records value as the counter after the record lsn,
+   exports it and lets the log drop the segments the snapshot covers.
+   The keys go first, so the log never drops records they still need.
+   The header is written again after the export so that it records it. */
+static int take_snapshot(int64_t value, uint64_t lsn) {
+    if ((logged_keys.size > 0 && write_keys(lsn) != 0) || write_header(value, lsn) != 0) {
+        return -1;
+    }
+    snapshot_lsn = lsn;
+    stats.snapshots++;
+    if (exported_value != value && (export_value(value) != 0 || write_header(value, lsn) != 0)) {
+        return -1;
+    }
+    wal_trim(lsn);
+    return 0;
+}
+
+/* replay_record(): Applies a record of the log during recovery, unless the
+   snapshot of its key already includes it. */
+static void replay_record(const struct wal_record *record) {
+    if (record->key == 0 && record->lsn > snapshot_lsn) {
+        recovered_value = record->value;
+        replayed_records++;
+    } else if (record->key != 0 && record->lsn > keys_lsn && set_logged_key(record->key, record->value) != 0) {
+        replay_failed = 1;
+    }
+}
+
+/* persist_open(): Maps the state file, creating it if needed, and
+   recovers counter 0 from the newest snapshot and the log after it, and
+   the other counters from the keys file and the log after it, handing
+   each one to restore. The text file wins when it no longer holds the
+   value the server last exported, because then someone else wrote it. */
+int persist_open(const char *text_path, const char *state_path, const char *keys_path, const char *wal_dir,
+                 int *value, int (*restore)(unsigned int key, int value)) {
+    struct state_header *latest = NULL;
+    uint64_t last_lsn;
+    int text_value;
+
+    export_path = text_path;
+    keys_file = keys_path;
+    state_fd = open(state_path, O_RDWR | O_CREAT, 0644);
+    if (state_fd < 0) {
+        return -1;
+    }
+    // Preallocated, so snapshots never change the file size or its metadata
+    if (posix_fallocate(state_fd, 0, STATE_FILE_SIZE) != 0) {
+        close(state_fd);
+        state_fd = -1;
+        return -1;
+    }
+    state_map = mmap(NULL, STATE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0);
+    if (state_map == MAP_FAILED) {
+        state_map = NULL;
+        close(state_fd);
+        state_fd = -1;
+        return -1;
+    }
+
+    for (int slot = 0; slot < 2; slot++) {
+        struct state_header *header = (struct state_header *)(state_map + slot * STATE_SLOT_SIZE);
+        if (valid_header(header) && (latest == NULL || header->sequence > latest->sequence)) {
+            latest = header;
+            next_slot = slot ^ 1;
+        }
+    }
+
+    recovered_value = 0;
+    replayed_records = 0;
+    replay_failed = 0;
+    if (latest != NULL) {
+        sequence = latest->sequence;
+        exported_value = latest->exported_value;
+        snapshot_lsn = latest->wal_lsn;
+        recovered_value = latest->committed_value;
+    }
+    if (read_keys() != 0 ||
+        wal_open(wal_dir, keys_lsn > snapshot_lsn ? keys_lsn : snapshot_lsn, &last_lsn, replay_record) != 0) {
+        persist_close();
+        return -1;
+    }
+    wal_opened = 1;
+    if (replay_failed) {
+        persist_close();
+        return -1;
+    }
+    *value = recovered_value;
+    for (int i = 0; i < logged_keys.capacity && restore != NULL; i++) {
+        if (logged_keys.keys[i] != 0 && restore(logged_keys.keys[i], logged_keys.values[i]) != 0) {
+            persist_close();
+            return -1;
+        }
+    }
+
+    // Without a snapshot to compare with, a log replayed from its start wins
+    int has_text = read_text_value(text_path, &text_value) == 0;
+    if (has_text && (latest != NULL ? text_value != latest->exported_value : replayed_records == 0)) {
+        *value = text_value;
+    }
+    if (has_text) {
+        exported_value = text_value;
+    }
+
+    // Both files agree on the recovered value before any request is served
+    if (((!has_text || text_value != *value) && export_value(*value) != 0) ||
+        take_snapshot(*value, last_lsn) != 0) {
+        persist_close();
+        return -1;
+    }
+    logged_value = *value;
+    logged_lsn = last_lsn;
+    return 0;
+}
+
+// deadline_after(): CLOCK_REALTIME deadline ms from now, for pthread_cond_timedwait().
+static void deadline_after(struct timespec *deadline, int ms) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/* commit_loop(): Commit thread; turns each group of pending writes into
+   one log append and tells their WRITEs whether it was synced. */
+static void *commit_loop(void *arg) {
+    struct wal_record *batch = NULL;
+    struct persist_ticket **batch_tickets = NULL;
+    int batch_capacity = 0;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&persist_mutex);
+    while (1) {
+        // An idle log gets a snapshot, so the text file catches up
+        while (pending_writes == 0 && !stopping) {
+            if (logged_lsn == snapshot_lsn) {
+                pthread_cond_wait(&persist_cond, &persist_mutex);
+                continue;
+            }
+            deadline_after(&deadline, SNAPSHOT_IDLE_MS);
+            if (pthread_cond_timedwait(&persist_cond, &persist_mutex, &deadline) == ETIMEDOUT &&
+                pending_writes == 0) {
+                pthread_mutex_unlock(&persist_mutex);
+                if (take_snapshot(logged_value, logged_lsn) != 0) {
+                    perror("persist: snapshot");
+                }
+                pthread_mutex_lock(&persist_mutex);
+            }
+        }
+        if (pending_writes == 0) {
+            break;
+        }
+
+        /* Give the group commit_ms from its first write to fill up, but no
+           longer than until every WRITE in it waits: none of them can add
+           to it, and new ones go to the next group meanwhile */
+        deadline_after(&deadline, commit_ms);
+        while (pending_writes < commit_every && pending_waiting < pending_writes && !stopping) {
+            if (pthread_cond_timedwait(&persist_cond, &persist_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        struct wal_record *records = pending;
+        struct persist_ticket **tickets = pending_tickets;
+        int capacity = pending_capacity;
+        int count = pending_writes;
+        pending = batch;
+        pending_tickets = batch_tickets;
+        pending_capacity = batch_capacity;
+        pending_writes = 0;
+        pending_waiting = 0;
+        pending_group++;
+        batch = records;
+        batch_tickets = tickets;
+        batch_capacity = capacity;
+        pthread_mutex_unlock(&persist_mutex);
+
+        int appended = wal_append(batch, count) == 0;
+        pthread_mutex_lock(&persist_mutex);
+        for (int i = 0; i < count; i++) {
+            batch_tickets[i]->state = appended ? PERSIST_COMMITTED : PERSIST_FAILED;
+        }
+        pthread_cond_broadcast(&committed_cond);
+        pthread_mutex_unlock(&persist_mutex);
+
+        if (!appended) {
+            perror("persist: wal append");
+            stats.failures += count;
+        } else {
+            stats.records += count;
+            stats.appends++;
+            for (int i = 0; i < count; i++) {
+                if (log_record(&batch[i]) != 0) {
+                    perror("persist: key table");
+                    stats.failures++;
+                }
+            }
+            logged_lsn = batch[count - 1].lsn;
+            if (logged_lsn - snapshot_lsn >= snapshot_every && take_snapshot(logged_value, logged_lsn) != 0) {
+                perror("persist: snapshot");
+            }
+        }
+
+        pthread_mutex_lock(&persist_mutex);
+    }
+    pthread_mutex_unlock(&persist_mutex);
+    free(batch);
+    free(batch_tickets);
+    return NULL;
+}
+
+// persist_start(): Starts the commit thread with the given group commit and snapshot policy.
+int persist_start(int sync_every, int sync_ms, int snapshot_records) {
+    commit_every = sync_every;
+    commit_ms = sync_ms;
+    snapshot_every = snapshot_records;
+    stopping = 0;
+    memset(&stats, 0, sizeof(stats));
+    if (pthread_create(&commit_thread, NULL, commit_loop, NULL) != 0) {
+        return -1;
+    }
+    commit_thread_running = 1;
+    return 0;
+}
+
+/* persist_update(): Queues a WRITE to a key for the commit thread, which
+   sets ticket once the log append holding it is synced or failed. Call
+   it in the order the writes were applied; it does not wait for the log.
+   Returns -1, with ticket failed, if the write cannot be queued. */
+int persist_update(unsigned int request_id, unsigned int key, int value, struct persist_ticket *ticket) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ticket->state = PERSIST_FAILED;
+    pthread_mutex_lock(&persist_mutex);
+    if (pending_writes == pending_capacity) {
+        int capacity = pending_capacity ? pending_capacity * 2 : 256;
+        struct wal_record *grown = realloc(pending, capacity * sizeof(struct wal_record));
+        if (grown != NULL) {
+            pending = grown;
+        }
+        struct persist_ticket **grown_tickets = realloc(pending_tickets, capacity * sizeof(struct persist_ticket *));
+        if (grown_tickets != NULL) {
+            pending_tickets = grown_tickets;
+        }
+        if (grown == NULL || grown_tickets == NULL) {
+            pthread_mutex_unlock(&persist_mutex);
+            perror("persist: out of memory");
+            return -1;
+        }
+        pending_capacity = capacity;
+    }
+    ticket->state = PERSIST_PENDING;
+    ticket->group = pending_group;
+    pending_tickets[pending_writes] = ticket;
+    struct wal_record *record = &pending[pending_writes++];
+    memset(record, 0, sizeof(*record));
+    record->request_id = request_id;
+    record->key = key;
+    record->value = value;
+    record->timestamp_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (pending_writes == 1 || pending_writes >= commit_every) {
+        pthread_cond_signal(&persist_cond);
+    }
+    pthread_mutex_unlock(&persist_mutex);
+    return 0;
+}
+
+/* persist_wait(): Waits until the write of ticket is durable. Returns 0
+   once its log append was synced, -1 if it failed or was never queued. */
+int persist_wait(struct persist_ticket *ticket) {
+    pthread_mutex_lock(&persist_mutex);
+    if (ticket->state == PERSIST_PENDING && ticket->group == pending_group &&
+        ++pending_waiting == pending_writes) {
+        pthread_cond_signal(&persist_cond);
+    }
+    while (ticket->state == PERSIST_PENDING) {
+        pthread_cond_wait(&committed_cond, &persist_mutex);
+    }
+    int state = ticket->state;
+    pthread_mutex_unlock(&persist_mutex);
+    return state == PERSIST_COMMITTED ? 0 : -1;
+}
+
+// persist_close(): Logs what is pending, takes a last snapshot and closes the files.
+void persist_close(void) {
+    if (commit_thread_running) {
+        pthread_mutex_lock(&persist_mutex);
+        stopping = 1;
+        pthread_cond_signal(&persist_cond);
+        pthread_mutex_unlock(&persist_mutex);
+        pthread_join(commit_thread, NULL);
+        commit_thread_running = 0;
+        take_snapshot(logged_value, logged_lsn);
+    }
+    if (wal_opened) {
+        wal_close();
+        wal_opened = 0;
+    }
+    if (state_map != NULL) {
+        munmap(state_map, STATE_FILE_SIZE);
+        state_map = NULL;
+    }
+    if (state_fd >= 0) {
+        close(state_fd);
+        state_fd = -1;
+    }
+    free(pending);
+    free(pending_tickets);
+    pending = NULL;
+    pending_tickets = NULL;
+    pending_writes = pending_capacity = 0;
+    free(logged_keys.keys);
+    free(logged_keys.values);
+    memset(&logged_keys, 0, sizeof(logged_keys));
+    keys_lsn = 0;
+}
+
+// persist_get_stats(): Copies the commit thread counters; call it after persist_close().
+void persist_get_stats(struct persist_stats *copy) {
+    *copy = stats;
+}
@@ -0,0 +1,110 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Persistence of the server counters. Every WRITE becomes a record of
+   the write-ahead log in wal.h; the state file is a snapshot of counter 0
+   as of one LSN of that log, the keys file one of every other counter,
+   and recovery replays the records after them.
+
+   A WRITE hands its value to persist_update() while it holds its key,
+   so the log keeps the order the writes were applied in, and once it let
+   the key go waits in persist_wait() before it is acknowledged. A commit
+   thread groups the writes: it appends them to the log and syncs it once
+   sync_every writes are pending, sync_ms after the first one or once
+   every WRITE in the group waits, whichever comes first, and then wakes
+   their WRITEs. An acknowledged
+   write is therefore durable; one whose append failed is reported as
+   failed, although the counter in memory keeps it.
+
+   The state file is preallocated and mapped with mmap, and holds two
+   header slots in separate sectors. A snapshot writes the slot not
+   holding the newest header, with the next sequence number and a CRC-32,
+   and msyncs the mapping, so a torn write leaves the other slot intact.
+   The commit thread takes one every snapshot_every records, and when the
+   log has been idle for SNAPSHOT_IDLE_MS.
+
+   The keys file is rewritten whole at each snapshot, before the state
+   file, through a rename: a keys_header followed by count key_value
+   records, with a CRC-32 of the whole file with checksum set to 0. It is
+   only written once some key other than 0 has been.
+
+   The text file (server_output.txt) stays the interface to the outside:
+   every snapshot rewrites it, and on startup a value written there by
+   someone else than the server replaces the recovered one. */
+#define STATE_FILENAME "server_state.bin"
+#define STATE_MAGIC 0x54535033u
+#define STATE_VERSION 2
+#define KEYS_FILENAME "server_keys.bin"
+#define KEYS_MAGIC 0x53594B33u
+#define KEYS_VERSION 1
+#define STATE_FILE_SIZE 4096
+#define STATE_SLOT_SIZE 512
+#define DEFAULT_SYNC_EVERY 32
+#define DEFAULT_SYNC_MS 10
+#define DEFAULT_SNAPSHOT_EVERY 4096
+#define SNAPSHOT_IDLE_MS 200
+
+/* committed_value is the counter after the record wal_lsn; exported_value
+   the last value written to the text file */
+struct state_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t sequence;
+    int64_t committed_value;
+    int64_t exported_value;
+    uint64_t wal_lsn;
+    uint32_t padding;
+    uint32_t checksum;
+};
+
+// wal_lsn is the last record the values of the keys file include
+struct keys_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t count;
+    uint32_t checksum;
+    uint64_t wal_lsn;
+};
+
+struct key_value {
+    uint32_t key;
+    int32_t value;
+};
+
+enum persist_state {
+    PERSIST_PENDING = 0,
+    PERSIST_COMMITTED,
+    PERSIST_FAILED
+};
+
+/* Set by the commit thread once the write it was handed with is synced
+   or failed; group is the commit group the write was queued in */
+struct persist_ticket {
+    enum persist_state state;
+    uint64_t group;
+};
+
+// Counters of the commit thread since persist_start()
+struct persist_stats {
+    unsigned long records;
+    unsigned long appends;
+    unsigned long snapshots;
+    unsigned long failures;
+};
+
+uint32_t persist_crc32(const void *data, size_t length);
+
+int persist_open(const char *text_path, const char *state_path, const char *keys_path, const char *wal_dir,
+                 int *value, int (*restore)(unsigned int key, int value));
+int persist_start(int sync_every, int sync_ms, int snapshot_every);
+int persist_update(unsigned int request_id, unsigned int key, int value, struct persist_ticket *ticket);
+int persist_wait(struct persist_ticket *ticket);
+void persist_close(void);
+void persist_get_stats(struct persist_stats *stats);
+
+#endif
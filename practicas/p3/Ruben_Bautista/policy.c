@@ -0,0 +1,245 @@
+#include "policy.h"
+
+// conflicts(): Whether whoever is inside keeps action out, whatever the policy.
+static int conflicts(struct rw_gate *gate, enum operations action) {
+    if (action == WRITE) {
+        return gate->writer_active || gate->active_readers > 0;
+    }
+    return gate->writer_active;
+}
+
+// mark_inside(): Records that a request of type action entered.
+static void mark_inside(struct rw_gate *gate, enum operations action) {
+    if (action == WRITE) {
+        gate->writer_active = 1;
+    } else {
+        gate->active_readers++;
+    }
+}
+
+/* mark_outside(): Records that a request of type action left. Returns 1
+ if the gate is now empty. */
+static int mark_outside(struct rw_gate *gate, enum operations action) {
+    if (action == WRITE) {
+        gate->writer_active = 0;
+    } else {
+        gate->active_readers--;
+    }
+    return !gate->writer_active && gate->active_readers == 0;
+}
+
+// wake_all(): Wakes every waiter so each one checks its own condition again.
+static void wake_all(struct rw_gate *gate) {
+    pthread_cond_broadcast(&gate->readers_can_enter);
+    pthread_cond_broadcast(&gate->writers_can_enter);
+}
+
+/* reader_enter(): Readers only wait for an active writer; writers also
+ wait for readers that are waiting. */
+static void reader_enter(struct rw_gate *gate, enum operations action) {
+    if (action == READ) {
+        gate->waiting_readers++;
+        while (conflicts(gate, READ)) {
+            pthread_cond_wait(&gate->readers_can_enter, &gate->mutex);
+        }
+        gate->waiting_readers--;
+    } else {
+        gate->waiting_writers++;
+        while (conflicts(gate, WRITE) || gate->waiting_readers > 0) {
+            pthread_cond_wait(&gate->writers_can_enter, &gate->mutex);
+        }
+        gate->waiting_writers--;
+    }
+    mark_inside(gate, action);
+}
+
+// reader_exit(): Waiting readers go before waiting writers.
+static void reader_exit(struct rw_gate *gate, enum operations action) {
+    if (!mark_outside(gate, action)) {
+        return;
+    }
+    if (gate->waiting_readers > 0) {
+        pthread_cond_broadcast(&gate->readers_can_enter);
+    } else if (gate->waiting_writers > 0) {
+        pthread_cond_signal(&gate->writers_can_enter);
+    }
+}
+
+// writer_enter(): Readers also wait while a writer is waiting.
+static void writer_enter(struct rw_gate *gate, enum operations action) {
+    if (action == READ) {
+        gate->waiting_readers++;
+        while (conflicts(gate, READ) || gate->waiting_writers > 0) {
+            pthread_cond_wait(&gate->readers_can_enter, &gate->mutex);
+        }
+        gate->waiting_readers--;
+    } else {
+        gate->waiting_writers++;
+        while (conflicts(gate, WRITE)) {
+            pthread_cond_wait(&gate->writers_can_enter, &gate->mutex);
+        }
+        gate->waiting_writers--;
+    }
+    mark_inside(gate, action);
+}
+
+// writer_exit(): Waiting writers go before waiting readers.
+static void writer_exit(struct rw_gate *gate, enum operations action) {
+    if (!mark_outside(gate, action)) {
+        return;
+    }
+    if (gate->waiting_writers > 0) {
+        pthread_cond_signal(&gate->writers_can_enter);
+    } else if (gate->waiting_readers > 0) {
+        pthread_cond_broadcast(&gate->readers_can_enter);
+    }
+}
+
+/* ratio_enter(): The preferred side waits once it entered ratio times in
+ a row while the other side waits; the other side waits for that. */
+static void ratio_enter(struct rw_gate *gate, enum operations action) {
+    int preferred = (action == WRITE) == gate->prefer_writers;
+    int *waiting = action == WRITE ? &gate->waiting_writers : &gate->waiting_readers;
+    int *others_waiting = action == WRITE ? &gate->waiting_readers : &gate->waiting_writers;
+    pthread_cond_t *can_enter = action == WRITE ? &gate->writers_can_enter : &gate->readers_can_enter;
+
+    (*waiting)++;
+    while (conflicts(gate, action) ||
+           (*others_waiting > 0 && (preferred ? gate->preferred_in_a_row >= gate->ratio
+                                              : gate->preferred_in_a_row < gate->ratio))) {
+        pthread_cond_wait(can_enter, &gate->mutex);
+    }
+    (*waiting)--;
+
+    gate->preferred_in_a_row = preferred ? gate->preferred_in_a_row + 1 : 0;
+    mark_inside(gate, action);
+}
+
+// ratio_exit(): Which side goes next depends on the count, so both are woken.
+static void ratio_exit(struct rw_gate *gate, enum operations action) {
+    if (mark_outside(gate, action)) {
+        wake_all(gate);
+    }
+}
+
+/* phase_fair_enter(): A reader that finds a writer inside or waiting
+ sleeps until the next reader phase, which the writer leaving starts
+ for it. Writers enter in ticket order once no reader is inside. */
+static void phase_fair_enter(struct rw_gate *gate, enum operations action) {
+    if (action == READ) {
+        if (gate->writer_active || gate->waiting_writers > 0) {
+            unsigned long phase = gate->reader_phase;
+            gate->waiting_readers++;
+            while (gate->reader_phase == phase) {
+                pthread_cond_wait(&gate->readers_can_enter, &gate->mutex);
+            }
+            // phase_fair_exit() already counted it as active
+            return;
+        }
+        mark_inside(gate, READ);
+    } else {
+        unsigned long ticket = gate->next_writer_ticket++;
+        gate->waiting_writers++;
+        while (conflicts(gate, WRITE) || gate->serving_writer_ticket != ticket) {
+            pthread_cond_wait(&gate->writers_can_enter, &gate->mutex);
+        }
+        gate->waiting_writers--;
+        gate->serving_writer_ticket++;
+        mark_inside(gate, WRITE);
+    }
+}
+
+/* phase_fair_exit(): A leaving writer lets in every reader that waited
+ for it, as one phase; the last reader out lets the next writer in. */
+static void phase_fair_exit(struct rw_gate *gate, enum operations action) {
+    if (!mark_outside(gate, action)) {
+        return;
+    }
+    if (action == WRITE && gate->waiting_readers > 0) {
+        gate->active_readers += gate->waiting_readers;
+        gate->waiting_readers = 0;
+        gate->reader_phase++;
+        pthread_cond_broadcast(&gate->readers_can_enter);
+    } else if (gate->waiting_writers > 0) {
+        // The ticket holder may be any of them
+        pthread_cond_broadcast(&gate->writers_can_enter);
+    }
+}
+
+/* fifo_enter(): Requests enter in ticket order. A reader that enters
+ hands the turn on at once, so readers in a row share the gate. */
+static void fifo_enter(struct rw_gate *gate, enum operations action) {
+    unsigned long ticket = gate->next_ticket++;
+    int *waiting = action == WRITE ? &gate->waiting_writers : &gate->waiting_readers;
+    pthread_cond_t *can_enter = action == WRITE ? &gate->writers_can_enter : &gate->readers_can_enter;
+
+    (*waiting)++;
+    while (gate->serving_ticket != ticket || conflicts(gate, action)) {
+        pthread_cond_wait(can_enter, &gate->mutex);
+    }
+    (*waiting)--;
+
+    gate->serving_ticket++;
+    mark_inside(gate, action);
+    if (action == READ && gate->waiting_readers > 0) {
+        pthread_cond_broadcast(&gate->readers_can_enter);
+    }
+}
+
+// fifo_exit(): The next ticket may belong to either side.
+static void fifo_exit(struct rw_gate *gate, enum operations action) {
+    if (mark_outside(gate, action)) {
+        wake_all(gate);
+    }
+}
+
+static const struct rw_policy policies[] = {
+    {"reader", reader_enter, reader_exit},
+    {"writer", writer_enter, writer_exit},
+    {"ratio", ratio_enter, ratio_exit},
+    {"phase-fair", phase_fair_enter, phase_fair_exit},
+    {"fifo", fifo_enter, fifo_exit},
+};
+
+// policy_lookup(): Finds a policy by its --priority name. Returns NULL if there is none.
+const struct rw_policy *policy_lookup(const char *name) {
+    for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(policies[i].name, name) == 0) {
+            return &policies[i];
+        }
+    }
+    return NULL;
+}
+
+// gate_init(): Initializes an empty gate; ratio and prefer_writers only matter to the ratio policy.
+int gate_init(struct rw_gate *gate, int ratio, int prefer_writers) {
+    memset(gate, 0, sizeof(*gate));
+    gate->ratio = ratio > 0 ? ratio : DEFAULT_RATIO;
+    gate->prefer_writers = prefer_writers;
+
+    if (pthread_mutex_init(&gate->mutex, NULL) != 0) return -1;
+    if (pthread_cond_init(&gate->readers_can_enter, NULL) != 0) return -1;
+    if (pthread_cond_init(&gate->writers_can_enter, NULL) != 0) return -1;
+    return 0;
+}
+
+// gate_enter(): Waits until policy lets a request of type action in.
+void gate_enter(struct rw_gate *gate, const struct rw_policy *policy, enum operations action) {
+    pthread_mutex_lock(&gate->mutex);
+    policy->enter(gate, action);
+    pthread_mutex_unlock(&gate->mutex);
+}
+
+// gate_exit(): Lets a request of type action out and wakes whoever policy lets in next.
+void gate_exit(struct rw_gate *gate, const struct rw_policy *policy, enum operations action) {
+    pthread_mutex_lock(&gate->mutex);
+    policy->exit(gate, action);
+    pthread_mutex_unlock(&gate->mutex);
+}
+
+// gate_destroy(): Releases the mutex and conditions of the gate.
+void gate_destroy(struct rw_gate *gate) {
+    pthread_mutex_destroy(&gate->mutex);
+    pthread_cond_destroy(&gate->readers_can_enter);
+    pthread_cond_destroy(&gate->writers_can_enter);
+}
@@ -0,0 +1,62 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include "stub.h"
+
+/* Admission policies for the readers-writers gate in front of the
+   counter. Every policy keeps writers exclusive; they differ in who goes
+   first when readers and writers wait at the same time:
+
+   reader      readers enter whenever no writer is inside; writers can starve.
+   writer      readers also wait while a writer waits; readers can starve.
+   ratio       one side (writers unless --priority reader --ratio N) is
+               preferred, but after N of its entries in a row the other
+               side, if waiting, goes next.
+   phase-fair  reader and writer phases alternate: a reader waits for at
+               most one writer, and a writer for one reader phase plus the
+               writers queued before it.
+   fifo        requests enter in arrival order; consecutive readers share.
+
+   The gate mutex is held around the enter and exit hooks; enter may
+   wait on the gate conditions. */
+#define DEFAULT_RATIO 4
+#define POLICY_NAMES "reader/writer/ratio/phase-fair/fifo"
+
+struct rw_gate {
+    pthread_mutex_t mutex;
+    pthread_cond_t readers_can_enter;
+    pthread_cond_t writers_can_enter;
+    int active_readers;
+    int waiting_readers;
+    int waiting_writers;
+    int writer_active;
+
+    // ratio
+    int ratio;
+    int prefer_writers;
+    int preferred_in_a_row;
+
+    // phase-fair: writers take tickets; readers wait for the next reader phase
+    unsigned long reader_phase;
+    unsigned long next_writer_ticket;
+    unsigned long serving_writer_ticket;
+
+    // fifo
+    unsigned long next_ticket;
+    unsigned long serving_ticket;
+};
+
+struct rw_policy {
+    const char *name;
+    void (*enter)(struct rw_gate *gate, enum operations action);
+    void (*exit)(struct rw_gate *gate, enum operations action);
+};
+
+const struct rw_policy *policy_lookup(const char *name);
+
+int gate_init(struct rw_gate *gate, int ratio, int prefer_writers);
+void gate_enter(struct rw_gate *gate, const struct rw_policy *policy, enum operations action);
+void gate_exit(struct rw_gate *gate, const struct rw_policy *policy, enum operations action);
+void gate_destroy(struct rw_gate *gate);
+
+#endif
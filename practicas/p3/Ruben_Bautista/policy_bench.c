@@ -0,0 +1,253 @@
+#include "policy.h"
+#include <stdatomic.h>
+
+/* policy_bench stresses each admission policy of policy.h without the
+   network: R reader and W writer threads go through the gate in a loop
+   for a while, holding it for a few microseconds each time. Inside, they
+   check that no writer shares the gate with anyone (mutual exclusion),
+   and they record how long they waited to enter.
+
+   A policy passes if there was no violation and, on every side it does
+   not starve by design, every thread got in and no wait was longer than
+   --max-wait-ms. The reader policy may starve writers, and the writer
+   policy readers; their waits are reported but not checked.
+
+   The ratio policy runs twice, leaning to writers and to readers. While
+   both sides keep waiting, the preferred side enters --ratio times for
+   each entry of the other, so with at least RATIO_MIN_THREADS threads on
+   each side, enough to always have some waiting, its entries per entry
+   of the other must come within RATIO_TOLERANCE of --ratio. */
+
+#define DEFAULT_DURATION_MS 1000
+#define DEFAULT_HOLD_US 100
+#define DEFAULT_MAX_WAIT_MS 500
+#define RATIO_TOLERANCE 0.25
+#define RATIO_MIN_THREADS 4
+
+// check_ratio: the preferred side's entries per entry of the other are checked against --ratio
+struct policy_case {
+    const char *name;
+    const char *label;
+    int prefer_writers;
+    int check_ratio;
+    int may_starve_readers;
+    int may_starve_writers;
+};
+
+static const struct policy_case cases[] = {
+    {"reader", "reader", 0, 0, 0, 1},
+    {"writer", "writer", 1, 0, 1, 0},
+    {"ratio", "ratio-w", 1, 1, 0, 0},
+    {"ratio", "ratio-r", 0, 1, 0, 0},
+    {"phase-fair", "phase-fair", 0, 0, 0, 0},
+    {"fifo", "fifo", 0, 0, 0, 0},
+};
+
+struct thread_stats {
+    enum operations action;
+    long operations;
+    long max_wait_ns;
+};
+
+int bench_readers = 8;
+int bench_writers = 4;
+int duration_ms = DEFAULT_DURATION_MS;
+int hold_us = DEFAULT_HOLD_US;
+int max_wait_ms = DEFAULT_MAX_WAIT_MS;
+int bench_ratio = DEFAULT_RATIO;
+const char *only_policy = NULL;
+
+struct rw_gate gate;
+const struct rw_policy *policy;
+atomic_int running;
+atomic_int readers_inside;
+atomic_int writers_inside;
+atomic_long violations;
+
+// elapsed_ns(): Nanoseconds between two CLOCK_MONOTONIC readings.
+long elapsed_ns(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+}
+
+// stress_thread(): Enters and leaves the gate until the run ends, checking exclusion inside.
+void *stress_thread(void *stats_ptr) {
+    struct thread_stats *stats = stats_ptr;
+    struct timespec start, end;
+
+    while (atomic_load(&running)) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        gate_enter(&gate, policy, stats->action);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (stats->action == WRITE) {
+            if (atomic_fetch_add(&writers_inside, 1) != 0 || atomic_load(&readers_inside) != 0) {
+                atomic_fetch_add(&violations, 1);
+            }
+        } else {
+            atomic_fetch_add(&readers_inside, 1);
+            if (atomic_load(&writers_inside) != 0) {
+                atomic_fetch_add(&violations, 1);
+            }
+        }
+        usleep(hold_us);
+        if (stats->action == WRITE) {
+            atomic_fetch_sub(&writers_inside, 1);
+        } else {
+            atomic_fetch_sub(&readers_inside, 1);
+        }
+
+        gate_exit(&gate, policy, stats->action);
+
+        long wait_ns = elapsed_ns(start, end);
+        if (wait_ns > stats->max_wait_ns) {
+            stats->max_wait_ns = wait_ns;
+        }
+        stats->operations++;
+    }
+    return NULL;
+}
+
+/* summarize(): Adds up the threads of one side. Returns 1 if each of them
+ got in and none waited longer than the limit. */
+int summarize(struct thread_stats *stats, int count, enum operations action, long *operations, long *max_wait_ns) {
+    int bounded = 1;
+
+    *operations = 0;
+    *max_wait_ns = 0;
+    for (int i = 0; i < count; i++) {
+        if (stats[i].action != action) {
+            continue;
+        }
+        *operations += stats[i].operations;
+        if (stats[i].max_wait_ns > *max_wait_ns) {
+            *max_wait_ns = stats[i].max_wait_ns;
+        }
+        if (stats[i].operations == 0 || stats[i].max_wait_ns > max_wait_ms * 1000000L) {
+            bounded = 0;
+        }
+    }
+    return bounded;
+}
+
+// run_case(): Stresses one policy and prints its result. Returns 0 if it passed.
+int run_case(const struct policy_case *test) {
+    int count = bench_readers + bench_writers;
+    pthread_t *threads = malloc(count * sizeof(pthread_t));
+    struct thread_stats *stats = calloc(count, sizeof(struct thread_stats));
+    long reads, writes, read_wait_ns, write_wait_ns;
+
+    if (threads == NULL || stats == NULL) {
+        fprintf(stderr, "policy_bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    policy = policy_lookup(test->name);
+    if (policy == NULL || gate_init(&gate, bench_ratio, test->prefer_writers) != 0) {
+        fprintf(stderr, "policy_bench: cannot set up policy %s\n", test->name);
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&running, 1);
+    atomic_store(&violations, 0);
+
+    for (int i = 0; i < count; i++) {
+        stats[i].action = i < bench_readers ? READ : WRITE;
+        if (pthread_create(&threads[i], NULL, stress_thread, &stats[i]) != 0) {
+            fprintf(stderr, "policy_bench: thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    usleep(duration_ms * 1000);
+    atomic_store(&running, 0);
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    gate_destroy(&gate);
+
+    int readers_bounded = summarize(stats, count, READ, &reads, &read_wait_ns);
+    int writers_bounded = summarize(stats, count, WRITE, &writes, &write_wait_ns);
+    long violation_count = atomic_load(&violations);
+    int ok = violation_count == 0 && (readers_bounded || test->may_starve_readers) &&
+             (writers_bounded || test->may_starve_writers);
+
+    printf("%-11s reads %8ld (max wait %7.1f ms%s)  writes %8ld (max wait %7.1f ms%s)  %ld violations",
+           test->label, reads, read_wait_ns / 1e6, test->may_starve_readers ? ", may starve" : "",
+           writes, write_wait_ns / 1e6, test->may_starve_writers ? ", may starve" : "",
+           violation_count);
+    if (test->check_ratio) {
+        long preferred = test->prefer_writers ? writes : reads;
+        long other = test->prefer_writers ? reads : writes;
+        double measured = other > 0 ? (double)preferred / other : 0;
+        int checked = bench_readers >= RATIO_MIN_THREADS && bench_writers >= RATIO_MIN_THREADS;
+        if (checked && (measured < bench_ratio * (1 - RATIO_TOLERANCE) ||
+                        measured > bench_ratio * (1 + RATIO_TOLERANCE))) {
+            ok = 0;
+        }
+        printf("  %.2f:1 for %d:1%s", measured, bench_ratio, checked ? "" : " (not checked)");
+    }
+    printf("  %s\n", ok ? "ok" : "FAILED");
+
+    free(threads);
+    free(stats);
+    return ok ? 0 : -1;
+}
+
+// parse_bench_arguments(): Parses command-line arguments for the benchmark.
+int parse_bench_arguments(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"readers", required_argument, 0, 'r'},
+        {"writers", required_argument, 0, 'w'},
+        {"duration-ms", required_argument, 0, 'd'},
+        {"hold-us", required_argument, 0, 'h'},
+        {"max-wait-ms", required_argument, 0, 'm'},
+        {"ratio", required_argument, 0, 't'},
+        {"policy", required_argument, 0, 'p'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "r:w:d:h:m:t:p:", long_options, NULL)) != -1) {
+        if (opt == 'r') {
+            bench_readers = atoi(optarg);
+        } else if (opt == 'w') {
+            bench_writers = atoi(optarg);
+        } else if (opt == 'd') {
+            duration_ms = atoi(optarg);
+        } else if (opt == 'h') {
+            hold_us = atoi(optarg);
+        } else if (opt == 'm') {
+            max_wait_ms = atoi(optarg);
+        } else if (opt == 't') {
+            bench_ratio = atoi(optarg);
+        } else if (opt == 'p') {
+            if (policy_lookup(optarg) == NULL) {
+                return -1;
+            }
+            only_policy = optarg;
+        } else {
+            return -1;
+        }
+    }
+    if (bench_readers < 0 || bench_writers < 0 || bench_readers + bench_writers == 0 ||
+        duration_ms <= 0 || hold_us < 0 || max_wait_ms <= 0 || bench_ratio <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+
+    if (parse_bench_arguments(argc, argv) != 0) {
+        fprintf(stderr, "Usage: %s [--readers R] [--writers W] [--duration-ms T] [--hold-us T] "
+                "[--max-wait-ms T] [--ratio N] [--policy " POLICY_NAMES "]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d readers, %d writers, %d ms per policy, %d us inside, waits checked up to %d ms\n",
+           bench_readers, bench_writers, duration_ms, hold_us, max_wait_ms);
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (only_policy == NULL || strcmp(only_policy, cases[i].name) == 0) {
+            failed |= run_case(&cases[i]) != 0;
+        }
+    }
+    return failed;
+}
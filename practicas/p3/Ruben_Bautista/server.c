@@ -1,59 +1,79 @@
 #include "stub.h"
+#include "persist.h"
+#include "wal.h"
+#include "policy.h"
+#include "latency.h"
+#include "counters.h"
 
-#define MAX_CONCURRENT_THREADS 600
+#define DEFAULT_WORKERS 600
+#define DEFAULT_QUEUE_DEPTH 1024
+#define ACCEPT_BATCH 64
+#define SESSION_POLL_MS 200
+#define DEFAULT_IDLE_MS 5000
 #define MIN_SLEEP_MS 75
 #define MAX_SLEEP_MS 150
 #define OUTPUT_FILENAME "server_output.txt"
 
-int shared_counter;
-int server_priority;
-
-int active_readers_count;
-int waiting_writers_count;
-int is_writer_active;
-int waiting_readers_count;
-
-pthread_mutex_t counter_mutex;
-pthread_mutex_t file_mutex;
-pthread_mutex_t readers_writers_mutex;
-pthread_cond_t readers_can_enter;
-pthread_cond_t writers_can_enter;
+// Every shard of the keyed counters has its own gate, run by the --priority policy
+const struct rw_policy *gate_policy = NULL;
+int prefer_writers = 0;
+int shard_count = DEFAULT_SHARDS;
 
 int active_threads_count = 0;
 pthread_mutex_t active_threads_mutex;
-sem_t available_threads_semaphore;
-pthread_t client_threads[MAX_CONCURRENT_THREADS];
-int client_threads_count = 0;
-pthread_mutex_t client_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Worker pool: the acceptor queues connections, worker_count threads serve them
+int worker_count = DEFAULT_WORKERS;
+int queue_depth = DEFAULT_QUEUE_DEPTH;
+pthread_t *worker_threads = NULL;
+int started_workers = 0;
+int *connection_queue = NULL;
+int queue_head = 0;
+int queued_connections = 0;
+pthread_mutex_t queue_mutex;
+pthread_cond_t queue_not_empty;
+pthread_cond_t queue_not_full;
 
 volatile int server_running = 1;
+// SIGUSR1 is blocked in every thread; stats_thread takes it with sigwait()
+sigset_t report_signals;
+pthread_t stats_thread;
+int stats_thread_started = 0;
+struct acceptor connection_acceptor = {-1, -1, -1};
 
 int ratio = 0;
-int writers_since_last_reader = 0;
-int readers_since_last_writer = 0;
+int sync_every = DEFAULT_SYNC_EVERY;
+int sync_ms = DEFAULT_SYNC_MS;
+int snapshot_every = DEFAULT_SNAPSHOT_EVERY;
+// A session with no request for idle_ms is closed, so it gives its worker back
+int idle_ms = DEFAULT_IDLE_MS;
 
 // parse_server_arguments(): Parses command-line arguments for server configuration.
-int parse_server_arguments(int argc, char *argv[], int *port, int *priority) {
+int parse_server_arguments(int argc, char *argv[], int *port, const struct rw_policy **policy) {
     static struct option long_options[] = {
         {"port", required_argument, 0, 'p'},
         {"priority", required_argument, 0, 'r'},
         {"ratio", required_argument, 0, 't'},
+        {"sync-every", required_argument, 0, 'e'},
+        {"sync-ms", required_argument, 0, 's'},
+        {"snapshot-every", required_argument, 0, 'n'},
+        {"workers", required_argument, 0, 'w'},
+        {"queue-depth", required_argument, 0, 'q'},
+        {"shards", required_argument, 0, 'k'},
+        {"idle-ms", required_argument, 0, 'i'},
         {0, 0, 0, 0}
     };
     
     int opt;
     int option_index = 0;
     
-    while ((opt = getopt_long(argc, argv, "p:r:t:", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:r:t:e:s:n:w:q:k:i:", long_options, &option_index)) != -1) {
         if (opt == 'p') {
             *port = atoi(optarg);
         } else if (opt == 'r') {
-            if (strcmp(optarg, "reader") == 0) {
-                *priority = 0;
-            } else if (strcmp(optarg, "writer") == 0) {
-                *priority = 1;
-            } else {
-                fprintf(stderr, "Usage: %s --port PORT --priority reader/writer [--ratio N]\n", argv[0]);
+            *policy = policy_lookup(optarg);
+            if (*policy == NULL) {
+                fprintf(stderr, "Usage: %s --port PORT --priority " POLICY_NAMES " [--ratio N] [--sync-every N] [--sync-ms T] [--snapshot-every N] [--workers N] [--queue-depth N] [--shards N] [--idle-ms T]\n", argv[0]);
                 return -1;
             }
         } else if (opt == 't') {
@@ -62,38 +82,92 @@ int parse_server_arguments(int argc, char *argv[], int *port, int *priority) {
                 fprintf(stderr, "Ratio must be a positive integer\n");
                 return -1;
             }
+        } else if (opt == 'e') {
+            sync_every = atoi(optarg);
+            if (sync_every <= 0) {
+                fprintf(stderr, "Sync every must be a positive integer\n");
+                return -1;
+            }
+        } else if (opt == 's') {
+            sync_ms = atoi(optarg);
+            if (sync_ms < 0) {
+                fprintf(stderr, "Sync ms must be a non-negative integer\n");
+                return -1;
+            }
+        } else if (opt == 'n') {
+            snapshot_every = atoi(optarg);
+            if (snapshot_every <= 0) {
+                fprintf(stderr, "Snapshot every must be a positive integer\n");
+                return -1;
+            }
+        } else if (opt == 'w') {
+            worker_count = atoi(optarg);
+            if (worker_count <= 0) {
+                fprintf(stderr, "Workers must be a positive integer\n");
+                return -1;
+            }
+        } else if (opt == 'q') {
+            queue_depth = atoi(optarg);
+            if (queue_depth <= 0) {
+                fprintf(stderr, "Queue depth must be a positive integer\n");
+                return -1;
+            }
+        } else if (opt == 'k') {
+            shard_count = atoi(optarg);
+            if (shard_count <= 0) {
+                fprintf(stderr, "Shards must be a positive integer\n");
+                return -1;
+            }
+        } else if (opt == 'i') {
+            idle_ms = atoi(optarg);
+            if (idle_ms <= 0) {
+                fprintf(stderr, "Idle ms must be a positive integer\n");
+                return -1;
+            }
         } else {
             return -1;
         }
     }
     
     if (*port == 0) {
-        fprintf(stderr, "Usage: %s --port PORT --priority reader/writer [--ratio N]\n", argv[0]);
+        fprintf(stderr, "Usage: %s --port PORT --priority " POLICY_NAMES " [--ratio N] [--sync-every N] [--sync-ms T] [--snapshot-every N] [--workers N] [--queue-depth N] [--shards N] [--idle-ms T]\n", argv[0]);
         return -1;
     }
     
+    // reader and writer with a ratio are the ratio policy leaning to that side
+    if (*policy == NULL) {
+        *policy = policy_lookup("reader");
+    }
+    if (strcmp((*policy)->name, "ratio") == 0) {
+        prefer_writers = 1;
+    } else if (ratio > 0) {
+        if (strcmp((*policy)->name, "reader") != 0 && strcmp((*policy)->name, "writer") != 0) {
+            fprintf(stderr, "Ratio only applies to the reader, writer and ratio policies\n");
+            return -1;
+        }
+        prefer_writers = strcmp((*policy)->name, "writer") == 0;
+        *policy = policy_lookup("ratio");
+    }
+    
     return 0;
 }
 
-// initialize(): Initializes mutexes, condition variables, and semaphores.
+// initialize(): Initializes mutexes, condition variables, and the worker pool queue.
 int initialize(void) {
-    shared_counter = 0;
-    active_readers_count = 0;
-    waiting_writers_count = 0;
-    waiting_readers_count = 0;
-    is_writer_active = 0;
     active_threads_count = 0;
-    client_threads_count = 0;
-    writers_since_last_reader = 0;
+    started_workers = 0;
+    queue_head = 0;
+    queued_connections = 0;
     
-    if (pthread_mutex_init(&counter_mutex, NULL) != 0) return -1;
-    if (pthread_mutex_init(&file_mutex, NULL) != 0) return -1;
-    if (pthread_mutex_init(&readers_writers_mutex, NULL) != 0) return -1;
+    if (counters_init(shard_count, ratio, prefer_writers) != 0) return -1;
     if (pthread_mutex_init(&active_threads_mutex, NULL) != 0) return -1;
-    if (pthread_mutex_init(&client_threads_mutex, NULL) != 0) return -1;
-    if (pthread_cond_init(&readers_can_enter, NULL) != 0) return -1;
-    if (pthread_cond_init(&writers_can_enter, NULL) != 0) return -1;
-    if (sem_init(&available_threads_semaphore, 0, MAX_CONCURRENT_THREADS) != 0) return -1;
+    if (pthread_mutex_init(&queue_mutex, NULL) != 0) return -1;
+    if (pthread_cond_init(&queue_not_empty, NULL) != 0) return -1;
+    if (pthread_cond_init(&queue_not_full, NULL) != 0) return -1;
+    
+    worker_threads = malloc(worker_count * sizeof(pthread_t));
+    connection_queue = malloc(queue_depth * sizeof(int));
+    if (worker_threads == NULL || connection_queue == NULL) return -1;
     
     return 0;
 }
@@ -106,45 +180,47 @@ void cleanup_resources(int server_socket) {
         shutdown(server_socket, SHUT_RDWR);
         close(server_socket);
     }
-
-    pthread_mutex_lock(&readers_writers_mutex);
-    pthread_cond_broadcast(&readers_can_enter);
-    pthread_cond_broadcast(&writers_can_enter);
-    pthread_mutex_unlock(&readers_writers_mutex);
+    acceptor_close(&connection_acceptor);
     
-    for (int i = 0; i < MAX_CONCURRENT_THREADS * 2; i++) {
-        sem_post(&available_threads_semaphore);
+    if (stats_thread_started) {
+        pthread_kill(stats_thread, SIGUSR1);
+        pthread_join(stats_thread, NULL);
+        stats_thread_started = 0;
     }
-    
-    pthread_mutex_lock(&client_threads_mutex);
 
-    for (int i = 0; i < client_threads_count; i++) {
-        pthread_join(client_threads[i], NULL);
+    // Workers serve what is still queued and then exit
+    pthread_mutex_lock(&queue_mutex);
+    pthread_cond_broadcast(&queue_not_empty);
+    pthread_cond_broadcast(&queue_not_full);
+    pthread_mutex_unlock(&queue_mutex);
+
+    for (int i = 0; i < started_workers; i++) {
+        pthread_join(worker_threads[i], NULL);
     }
-    client_threads_count = 0;
-    pthread_mutex_unlock(&client_threads_mutex);
+    started_workers = 0;
+
+    persist_close();
+    latency_free();
 
-    pthread_mutex_destroy(&counter_mutex);
-    pthread_mutex_destroy(&file_mutex);
-    pthread_mutex_destroy(&readers_writers_mutex);
+    counters_free();
     pthread_mutex_destroy(&active_threads_mutex);
-    pthread_mutex_destroy(&client_threads_mutex);
+    pthread_mutex_destroy(&queue_mutex);
     
-    pthread_cond_destroy(&readers_can_enter);
-    pthread_cond_destroy(&writers_can_enter);
+    pthread_cond_destroy(&queue_not_empty);
+    pthread_cond_destroy(&queue_not_full);
     
-    sem_destroy(&available_threads_semaphore);
+    free(worker_threads);
+    free(connection_queue);
+    worker_threads = NULL;
+    connection_queue = NULL;
 }
 
-// write_counter_to_file(): Writes the current counter value to the output file.
-void write_counter_to_file(int counter_value) {
-    pthread_mutex_lock(&file_mutex);
-    FILE *file = fopen(OUTPUT_FILENAME, "w");
-    if (file != NULL) {
-        fprintf(file, "%d", counter_value);
-        fclose(file);
-    }
-    pthread_mutex_unlock(&file_mutex);
+/* write_counter_to_file(): Hands the WRITE to the commit thread, which
+logs it together with the writes around it and sets ticket once it is
+durable.*/
+int write_counter_to_file(unsigned int request_id, unsigned int key, int counter_value,
+                          struct persist_ticket *ticket) {
+    return persist_update(request_id, key, counter_value, ticket);
 }
 
 // get_current_timestamp(): Retrieves the current time in seconds and microseconds.
@@ -164,360 +240,368 @@ long calculate_latency(struct timespec start, struct timespec end) {
 
 // sleep_random(): Sleeps for a random duration within the critical section.
 void sleep_random(void) {
-    int sleep_ms = MIN_SLEEP_MS + rand() % (MAX_SLEEP_MS - MIN_SLEEP_MS + 1);
+    // rand() takes a global lock, so every thread draws from its own seed
+    static __thread unsigned int seed;
+    if (seed == 0) {
+        seed = (unsigned int)time(NULL) ^ (unsigned int)pthread_self();
+    }
+    int sleep_ms = MIN_SLEEP_MS + rand_r(&seed) % (MAX_SLEEP_MS - MIN_SLEEP_MS + 1);
     usleep(sleep_ms * 1000);
 }
 
-/* can_pass(): Manages entry into the critical section
- based on reader/writer priority.*/
-void can_pass(struct request *client_req, struct timespec *start_time) {
-    pthread_mutex_lock(&readers_writers_mutex);
-    
-    if (client_req->action == READ) {
-        if (server_priority == 1) {
-            if (ratio > 0) {
-                // CON RATIO: lectores esperan solo si hay escritor activo O si el ratio no se ha cumplido Y hay escritores esperando
-                while (is_writer_active || (waiting_writers_count > 0 && writers_since_last_reader < ratio)) {
-                    waiting_readers_count++;
-                    pthread_cond_wait(&readers_can_enter, &readers_writers_mutex);
-                    waiting_readers_count--;
-                }
-                // Cuando un lector pasa, reiniciamos el contador de escritores desde el último lector
-                writers_since_last_reader = 0;
-            } else {
-                // SIN RATIO: comportamiento original
-                while (is_writer_active || waiting_writers_count > 0) {
-                    waiting_readers_count++;
-                    pthread_cond_wait(&readers_can_enter, &readers_writers_mutex);
-                    waiting_readers_count--;
-                }
-            }
+/* can_pass(): Manages entry into the critical section of the request's
+ key; the --priority policy of its shard decides when it may go in.*/
+void can_pass(struct request *client_req) {
+    counters_enter(client_req->key, gate_policy, client_req->action);
+}
+
+// priority_control(): Lets threads exit the critical section and signals waiting threads.
+void priority_control(struct request *client_req) {
+    counters_exit(client_req->key, gate_policy, client_req->action);
+}
+
+/* apply_request(): Reads or writes the counter of the request's key once
+it went through can_pass(), and returns the value read or written.
+can_pass() keeps writers of a shard exclusive, so readers admitted
+together run in parallel. Every WRITE is queued for the log, and ticket
+tells when it is durable or that it failed; a READ's ticket is committed
+already. Key 0 is the counter exported to the text file.*/
+int apply_request(struct request *req, struct persist_ticket *ticket) {
+    long seconds, microseconds;
+    int counter_value;
+    get_current_timestamp(&seconds, &microseconds);
+    
+    if (req->action == WRITE) {
+        // A key the table has no room for is not written, and the WRITE fails
+        if (counters_increment(req->key, &counter_value) != 0) {
+            fprintf(stderr, "[%ld.%06ld][ESCRITOR #%d] no memory for counter %u\n",
+                    seconds, microseconds, req->id, req->key);
+            ticket->state = PERSIST_FAILED;
+            return 0;
+        }
+        if (req->key == 0) {
+            printf("[%ld.%06ld][ESCRITOR #%d] modifica contador con valor %d\n", 
+                   seconds, microseconds, req->id, counter_value);
         } else {
-            // Priority readers: con o sin ratio
-            if (ratio > 0) {
-                // Con ratio: los lectores esperan solo si hay un escritor activo o si hay escritores esperando y no se ha cumplido el ratio de lectores
-                while (is_writer_active || (waiting_writers_count > 0 && readers_since_last_writer >= ratio)) {
-                    waiting_readers_count++;
-                    pthread_cond_wait(&readers_can_enter, &readers_writers_mutex);
-                    waiting_readers_count--;
-                }
-                // Incrementamos el contador de lectores desde el último escritor
-                readers_since_last_writer++;
-            } else {
-                // Sin ratio: comportamiento original
-                while (is_writer_active) {
-                    waiting_readers_count++;
-                    pthread_cond_wait(&readers_can_enter, &readers_writers_mutex);
-                    waiting_readers_count--;
-                }
-            }
+            printf("[%ld.%06ld][ESCRITOR #%d] modifica contador %u con valor %d\n", 
+                   seconds, microseconds, req->id, req->key, counter_value);
         }
-        active_readers_count++;
+        write_counter_to_file(req->id, req->key, counter_value, ticket);
     } else {
-        // WRITER
-        waiting_writers_count++;
-        
-        if (server_priority == 0) {
-            if (ratio > 0) {
-                // Con ratio: los escritores esperan hasta que no hay escritores activos, no hay lectores activos y (no hay lectores esperando o se ha cumplido el ratio de lectores)
-                while (is_writer_active || active_readers_count > 0 || 
-                       (waiting_readers_count > 0 && readers_since_last_writer < ratio)) {
-                    pthread_cond_wait(&writers_can_enter, &readers_writers_mutex);
-                }
-            } else {
-                // Sin ratio: comportamiento original
-                while (is_writer_active || active_readers_count > 0 || waiting_readers_count > 0) {
-                    pthread_cond_wait(&writers_can_enter, &readers_writers_mutex);
-                }
-            }
+        ticket->state = PERSIST_COMMITTED;
+        counter_value = counters_read(req->key);
+        if (req->key == 0) {
+            printf("[%ld.%06ld][LECTOR #%d] lee contador con valor %d\n", 
+                   seconds, microseconds, req->id, counter_value);
         } else {
-            // Priority writers: con o sin ratio
-            if (ratio > 0) {
-                // Con ratio: los escritores esperan hasta que no hay escritores activos y no hay lectores activos
-                while (is_writer_active || active_readers_count > 0) {
-                    pthread_cond_wait(&writers_can_enter, &readers_writers_mutex);
-                }
-            } else {
-                // Sin ratio: comportamiento original
-                while (is_writer_active || active_readers_count > 0) {
-                    pthread_cond_wait(&writers_can_enter, &readers_writers_mutex);
-                }
-            }
+            printf("[%ld.%06ld][LECTOR #%d] lee contador %u con valor %d\n", 
+                   seconds, microseconds, req->id, req->key, counter_value);
         }
-        waiting_writers_count--;
-        is_writer_active = 1;
     }
     
-    pthread_mutex_unlock(&readers_writers_mutex);
+    return counter_value;
 }
 
-// priority_control(): Lets threads exit the critical section and signals waiting threads.
-void priority_control(struct request *client_req) {
-    pthread_mutex_lock(&readers_writers_mutex);
+/* manage_request(): Handles the client's request by
+reading or writing the shared counter. No lock is held while sleeping.*/
+void manage_request(struct request *req, struct response *resp, long wait_time, struct persist_ticket *ticket) {
+    int counter_value = apply_request(req, ticket);
+    
+    sleep_random();
     
-    if (client_req->action == READ) {
-        active_readers_count--;
+    resp->action = req->action;
+    resp->id = req->id;
+    resp->counter = counter_value;
+    resp->latency_time = wait_time;
+}
+
+/* confirm_request(): Waits until the request of resp is durable and
+turns resp into a FAILED response if it cannot be. Called once the
+request left the critical section, so the commit groups the writes
+of every writer waiting meanwhile.*/
+void confirm_request(struct persist_ticket *ticket, struct response *resp) {
+    if (persist_wait(ticket) != 0) {
+        resp->action = FAILED;
+        resp->counter = 0;
+    }
+}
+
+/* process_batch(): Serves a BATCH request. Each run of consecutive items
+ with the same operation and shard enters through can_pass() once and
+ costs one simulated critical section; its items report the wait of the
+ run. An empty batch gets an empty BATCH response.
+ Returns -1 if the batch is malformed, does not arrive whole within
+ SESSION_POLL_MS, or the connection failed.*/
+int process_batch(int client_socket, struct request *batch_req, struct timespec *received_time) {
+    struct request *items = malloc(MAX_BATCH_SIZE * sizeof(struct request));
+    struct response *results = malloc(MAX_BATCH_SIZE * sizeof(struct response));
+    struct persist_ticket *tickets = malloc(MAX_BATCH_SIZE * sizeof(struct persist_ticket));
+    struct response batch_resp;
+    struct timespec start_time, end_time, exit_time;
+    unsigned int readers = 0;
+    int count = -1;
+    
+    if (items != NULL && results != NULL && tickets != NULL) {
+        count = receive_batch(client_socket, items, MAX_BATCH_SIZE, SESSION_POLL_MS);
+    }
+    
+    if (count >= 0) {
+        batch_resp.id = batch_req->id;
+        batch_resp.latency_time = 0;
         
-        if (server_priority == 0) {
-            if (ratio > 0) {
-                // Con ratio: cuando un lector sale, no resetear el contador de lectores, pero verificar si se debe permitir un escritor
-                if (active_readers_count == 0) {
-                    // Si no hay lectores activos, podemos permitir un escritor si hay escritores esperando y se ha cumplido el ratio de lectores
-                    if (waiting_writers_count > 0 && readers_since_last_writer >= ratio) {
-                        pthread_cond_signal(&writers_can_enter);
-                    } else if (waiting_readers_count > 0) {
-                        pthread_cond_broadcast(&readers_can_enter);
-                    }
-                    // AÑADIDO: Si no hay lectores esperando pero sí writers, permitir writers incluso si no se cumplió el ratio
-                    else if (waiting_writers_count > 0 && waiting_readers_count == 0) {
-                        pthread_cond_signal(&writers_can_enter);
-                    }
-                } else {
-                    // Si aún hay lectores activos, solo despertar lectores si no se ha alcanzado el ratio
-                    if (waiting_readers_count > 0 && readers_since_last_writer < ratio) {
-                        pthread_cond_broadcast(&readers_can_enter);
-                    }
-                }
-            } else {
-                // Sin ratio: comportamiento original
-                if (active_readers_count == 0) {
-                    if (waiting_writers_count > 0) {
-                        pthread_cond_signal(&writers_can_enter);
-                    } else if (waiting_readers_count > 0) {
-                        pthread_cond_broadcast(&readers_can_enter);
-                    }
-                }
+        int first = 0;
+        while (first < count) {
+            int end = first + 1;
+            while (end < count && items[end].action == items[first].action &&
+                   counters_shard_of(items[end].key) == counters_shard_of(items[first].key)) {
+                end++;
             }
-        } else {
-            // Priority writers: con o sin ratio
-            if (ratio > 0) {
-                // Con ratio: cuando un lector sale, no hacemos nada especial, solo comprobamos condiciones normales
-                if (active_readers_count == 0) {
-                    if (waiting_writers_count > 0) {
-                        pthread_cond_signal(&writers_can_enter);
-                    } else if (waiting_readers_count > 0) {
-                        pthread_cond_broadcast(&readers_can_enter);
-                    }
-                }
-            } else {
-                // Sin ratio: comportamiento original
-                if (active_readers_count == 0) {
-                    if (waiting_writers_count > 0) {
-                        pthread_cond_signal(&writers_can_enter);
-                    } else if (waiting_readers_count > 0) {
-                        pthread_cond_broadcast(&readers_can_enter);
-                    }
-                }
+            
+            clock_gettime(CLOCK_MONOTONIC, &start_time);
+            can_pass(&items[first]);
+            clock_gettime(CLOCK_MONOTONIC, &end_time);
+            long wait_time = calculate_latency(start_time, end_time);
+            
+            for (int i = first; i < end; i++) {
+                results[i].action = items[i].action;
+                results[i].id = items[i].id;
+                results[i].counter = apply_request(&items[i], &tickets[i]);
+                results[i].latency_time = wait_time;
+            }
+            sleep_random();
+            clock_gettime(CLOCK_MONOTONIC, &exit_time);
+            priority_control(&items[first]);
+            
+            latency_record(items[first].action, QUEUE_WAIT, wait_time, end - first);
+            latency_record(items[first].action, CRITICAL_SECTION, calculate_latency(end_time, exit_time), end - first);
+            if (items[first].action == READ) {
+                readers += end - first;
             }
+            
+            batch_resp.latency_time += wait_time;
+            first = end;
+        }
+        for (int i = 0; i < count; i++) {
+            confirm_request(&tickets[i], &results[i]);
         }
-    } else {
-        // ESCRITOR
-        is_writer_active = 0;
         
-        if (server_priority == 1) {
-            if (ratio > 0) {
-                // CON RATIO: incrementar contador de escritores
-                writers_since_last_reader++;
-                
-                // SI HAY ESCRITORES ESPERANDO: respetar el ratio
-                if (waiting_writers_count > 0) {
-                    if (writers_since_last_reader >= ratio && waiting_readers_count > 0) {
-                        pthread_cond_broadcast(&readers_can_enter);
-                    } else {
-                        pthread_cond_signal(&writers_can_enter);
-                    }
-                } 
-                // SI NO HAY ESCRITORES ESPERANDO: permitir lectores inmediatamente
-                else if (waiting_readers_count > 0) {
-                    pthread_cond_broadcast(&readers_can_enter);
-                }
-            } else {
-                // SIN RATIO: comportamiento original
-                if (waiting_writers_count > 0) {
-                    pthread_cond_signal(&writers_can_enter);
-                } else if (waiting_readers_count > 0) {
-                    pthread_cond_broadcast(&readers_can_enter);
-                }
-            }
+        if (send_batch_response(client_socket, &batch_resp, results, count) < 0) {
+            count = -1;
         } else {
-            // Priority readers: con o sin ratio
-            if (ratio > 0) {
-                // Con ratio: cuando un escritor sale, resetear el contador de lectores
-                readers_since_last_writer = 0;
-                if (waiting_readers_count > 0) {
-                    pthread_cond_broadcast(&readers_can_enter);
-                } else if (waiting_writers_count > 0) {
-                    pthread_cond_signal(&writers_can_enter);
-                }
-            } else {
-                // Sin ratio: comportamiento original
-                if (waiting_readers_count > 0) {
-                    pthread_cond_broadcast(&readers_can_enter);
-                } else if (waiting_writers_count > 0) {
-                    pthread_cond_signal(&writers_can_enter);
-                }
+            clock_gettime(CLOCK_MONOTONIC, &end_time);
+            long total_time = calculate_latency(*received_time, end_time);
+            if (readers > 0) {
+                latency_record(READ, TOTAL_TIME, total_time, readers);
+            }
+            if (count > readers) {
+                latency_record(WRITE, TOTAL_TIME, total_time, count - readers);
             }
         }
     }
     
-    pthread_mutex_unlock(&readers_writers_mutex);
+    free(items);
+    free(results);
+    free(tickets);
+    return count >= 0 ? 0 : -1;
 }
-/* manage_request(): Handles the client's request by
-reading or writing the shared counter.*/
-void manage_request(struct request *req, struct response *resp, long wait_time) {
-    long seconds, microseconds;
-    get_current_timestamp(&seconds, &microseconds);
-    
-    pthread_mutex_lock(&counter_mutex);
-    
-    if (req->action == WRITE) {
-        shared_counter++;
-        printf("[%ld.%06ld][ESCRITOR #%d] modifica contador con valor %d\n", 
-               seconds, microseconds, req->id, shared_counter);
-        write_counter_to_file(shared_counter);
-    } else {
-        printf("[%ld.%06ld][LECTOR #%d] lee contador con valor %d\n", 
-               seconds, microseconds, req->id, shared_counter);
-    }
-    
-    sleep_random();
-    pthread_mutex_unlock(&counter_mutex);
-    
-    resp->action = req->action;
-    resp->counter = shared_counter;
-    resp->latency_time = wait_time;
+
+// process_stats(): Answers a STATS request with the latency report so far.
+int process_stats(int client_socket, struct request *stats_req) {
+    struct latency_row rows[LATENCY_ROWS];
+    struct response stats_resp;
+    
+    stats_resp.id = stats_req->id;
+    int count = latency_report(rows, LATENCY_ROWS);
+    return send_stats_response(client_socket, &stats_resp, rows, count) < 0 ? -1 : 0;
 }
 
-/* process(): Manages the lifecycle of a client connection,
-including receiving requests, processing them, and sending responses. */
-void *process(void *client_socket_ptr) {
-    int client_socket = *(int *)client_socket_ptr;
-    free(client_socket_ptr);
-    
+/* process(): Serves a client session: receives requests one after another
+ on the same connection and answers each one, until the client closes it
+ or sends nothing for idle_ms, which would otherwise keep the worker
+ forever. A request that starts arriving must arrive whole within
+ SESSION_POLL_MS. When the server stops, it still answers the requests
+ already sent and then closes the session.*/
+void process(int client_socket) {
     pthread_mutex_lock(&active_threads_mutex);
     active_threads_count++;
     pthread_mutex_unlock(&active_threads_mutex);
     
     struct request client_req;
     struct response client_resp;
-    struct timespec start_time, end_time;
-    
-    if (receive_request(client_socket, &client_req) <= 0) {
-        close_connection(client_socket);
-        pthread_mutex_lock(&active_threads_mutex);
-        //Decrease counter on error
-        active_threads_count--;
-        pthread_mutex_unlock(&active_threads_mutex);
-        sem_post(&available_threads_semaphore);
-        return NULL;
-    }
-    
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
-    can_pass(&client_req, &start_time);
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    
-    // Calculate wait time
-    long wait_time = calculate_latency(start_time, end_time);
-    manage_request(&client_req, &client_resp, wait_time);
-    priority_control(&client_req);
-    
-    send_response(client_socket, &client_resp);
-    close_connection(client_socket);
-    
-    pthread_mutex_lock(&active_threads_mutex);
-    active_threads_count--;
-    pthread_mutex_unlock(&active_threads_mutex);
-    
-    sem_post(&available_threads_semaphore);
-    
-    return NULL;
-}
-
-/* manager_thread(): Accepts incoming client connections
- and spawns threads to handle them. */
-void *manager_thread(void *server_socket_ptr) {
-    int server_socket = *(int *)server_socket_ptr;
-    
-    while (server_running) {
-        int client_socket = wait_for_client_connection(server_socket, 1, &server_running);
-        
-        if (client_socket < 0) {
-            if (!server_running) break;
+    struct persist_ticket ticket;
+    struct timespec received_time, start_time, end_time, exit_time, sent_time;
+    struct timespec idle_since, now;
+    int idle = 0;
+    
+    while (1) {
+        // Measured on the clock: a poll cut short by a signal must not count as a whole one
+        if (!idle) {
+            clock_gettime(CLOCK_MONOTONIC, &idle_since);
+            idle = 1;
+        }
+        int ready = wait_for_data(client_socket, server_running ? SESSION_POLL_MS : 0);
+        if (ready == 0 && server_running) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (calculate_latency(idle_since, now) >= idle_ms * 1000000L) {
+                break;
+            }
             continue;
         }
-        
-        if (!server_running) {
-            close_connection(client_socket);
+        idle = 0;
+        if (ready <= 0 || receive_request(client_socket, &client_req, SESSION_POLL_MS) <= 0) {
             break;
         }
         
-        // Wait for an available thread slot with timeout
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 1;
+        clock_gettime(CLOCK_MONOTONIC, &received_time);
         
-        // If timeout occurs, close connection and continue
-        if (sem_timedwait(&available_threads_semaphore, &ts) != 0) {
-            close_connection(client_socket);
-            if (!server_running) break;
+        if (client_req.action == BATCH) {
+            if (process_batch(client_socket, &client_req, &received_time) != 0) {
+                break;
+            }
             continue;
         }
         
-        int *client_socket_ptr = malloc(sizeof(int));
-        if (client_socket_ptr == NULL) {
-            close_connection(client_socket);
-            sem_post(&available_threads_semaphore);
+        if (client_req.action == STATS) {
+            if (process_stats(client_socket, &client_req) != 0) {
+                break;
+            }
             continue;
         }
-        *client_socket_ptr = client_socket;
         
-        pthread_t client_thread;
-        if (pthread_create(&client_thread, NULL, process, client_socket_ptr) != 0) {
-            free(client_socket_ptr);
-            close_connection(client_socket);
-            sem_post(&available_threads_semaphore);
-            continue;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        can_pass(&client_req);
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        
+        // Calculate wait time
+        long wait_time = calculate_latency(start_time, end_time);
+        manage_request(&client_req, &client_resp, wait_time, &ticket);
+        clock_gettime(CLOCK_MONOTONIC, &exit_time);
+        priority_control(&client_req);
+        confirm_request(&ticket, &client_resp);
+        
+        if (send_response(client_socket, &client_resp) <= 0) {
+            break;
         }
         
-        // Store thread in the array for later joining
-        pthread_mutex_lock(&client_threads_mutex);
-        if (client_threads_count < MAX_CONCURRENT_THREADS) {
-            client_threads[client_threads_count] = client_thread;
-            client_threads_count++;
-        } else {
-            pthread_join(client_thread, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &sent_time);
+        latency_record(client_req.action, QUEUE_WAIT, wait_time, 1);
+        latency_record(client_req.action, CRITICAL_SECTION, calculate_latency(end_time, exit_time), 1);
+        latency_record(client_req.action, TOTAL_TIME, calculate_latency(received_time, sent_time), 1);
+    }
+    close_connection(client_socket);
+    
+    pthread_mutex_lock(&active_threads_mutex);
+    active_threads_count--;
+    pthread_mutex_unlock(&active_threads_mutex);
+}
+
+// worker_thread(): Pool thread; serves queued connections until the server stops.
+void *worker_thread(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&queue_mutex);
+        while (queued_connections == 0 && server_running) {
+            pthread_cond_wait(&queue_not_empty, &queue_mutex);
+        }
+        if (queued_connections == 0) {
+            pthread_mutex_unlock(&queue_mutex);
+            return NULL;
         }
-        pthread_mutex_unlock(&client_threads_mutex);
+        int client_socket = connection_queue[queue_head];
+        queue_head = (queue_head + 1) % queue_depth;
+        queued_connections--;
+        pthread_cond_signal(&queue_not_full);
+        pthread_mutex_unlock(&queue_mutex);
+        
+        process(client_socket);
     }
+}
 
-    return NULL;
+// start_workers(): Creates the worker pool once, before any connection is accepted.
+int start_workers(void) {
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&worker_threads[i], NULL, worker_thread, NULL) != 0) {
+            return -1;
+        }
+        started_workers++;
+    }
+    return 0;
+}
+
+/* queue_connection(): Hands a connection to the worker pool, waiting
+ up to a second for room in the queue. Closes it if there is none.*/
+void queue_connection(int client_socket) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    
+    pthread_mutex_lock(&queue_mutex);
+    while (queued_connections == queue_depth && server_running) {
+        if (pthread_cond_timedwait(&queue_not_full, &queue_mutex, &ts) == ETIMEDOUT) {
+            break;
+        }
+    }
+    
+    if (queued_connections == queue_depth || !server_running) {
+        pthread_mutex_unlock(&queue_mutex);
+        close_connection(client_socket);
+        return;
+    }
+    
+    connection_queue[(queue_head + queued_connections) % queue_depth] = client_socket;
+    queued_connections++;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_mutex);
 }
 
-// read_counter_from_file(): Reads the counter value from the output file.
-int read_counter_from_file(void) {
-    FILE *file = fopen(OUTPUT_FILENAME, "r");
-    int counter = 0;
+/* manager_thread(): Accepts incoming client connections in batches
+ and queues them for the worker pool, until the acceptor is stopped. */
+void *manager_thread(void *acceptor_ptr) {
+    struct acceptor *acceptor = acceptor_ptr;
+    int client_sockets[ACCEPT_BATCH];
     
-    if (file != NULL) {
-        if (fscanf(file, "%d", &counter) != 1) {
-            counter = 0;
+    while (server_running) {
+        int count = acceptor_wait(acceptor, client_sockets, ACCEPT_BATCH);
+        if (count < 0) {
+            perror("epoll_wait");
         }
-        fclose(file);
-    } else {
-        file = fopen(OUTPUT_FILENAME, "w");
-        if (file != NULL) {
-            fprintf(file, "0");
-            fclose(file);
+        if (count <= 0) {
+            break;
+        }
+        
+        for (int i = 0; i < count; i++) {
+            if (server_running) {
+                queue_connection(client_sockets[i]);
+            } else {
+                close_connection(client_sockets[i]);
+            }
         }
     }
+
+    return NULL;
+}
+
+/* read_counter_from_file(): Recovers counter 0 from the last snapshot
+and the log after it, or the value left in the output file, and sets the
+other counters to the values recovered for them.*/
+int read_counter_from_file(int *counter) {
+    return persist_open(OUTPUT_FILENAME, STATE_FILENAME, KEYS_FILENAME, WAL_DIRNAME, counter, counters_set);
+}
+
+// stats_reporter(): Prints the latency report each time the server gets SIGUSR1.
+void *stats_reporter(void *arg) {
+    int signal_number;
     
-    return counter;
+    while (sigwait(&report_signals, &signal_number) == 0 && server_running) {
+        latency_print(stdout, gate_policy->name);
+    }
+    return NULL;
 }
 
 // signal_handler(): Handles SIGINT to gracefully terminate the server.
 void signal_handler(int signal) {
     if (signal == SIGINT) {
         server_running = 0;
+        acceptor_stop(&connection_acceptor);
     }
 }
 
@@ -531,7 +615,12 @@ int main(int argc, char *argv[]) {
 
     signal(SIGINT, signal_handler);
     
-    if (parse_server_arguments(argc, argv, &server_port, &server_priority) != 0) {
+    // Blocked before any thread starts, so every thread inherits it
+    sigemptyset(&report_signals);
+    sigaddset(&report_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &report_signals, NULL);
+    
+    if (parse_server_arguments(argc, argv, &server_port, &gate_policy) != 0) {
         exit(EXIT_FAILURE);
     }
     
@@ -540,7 +629,15 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
     
-    shared_counter = read_counter_from_file();
+    int counter;
+    if (read_counter_from_file(&counter) != 0 || persist_start(sync_every, sync_ms, snapshot_every) != 0) {
+        fprintf(stderr, "Error opening %s\n", STATE_FILENAME);
+        exit(EXIT_FAILURE);
+    }
+    if (counters_set(0, counter) != 0) {
+        fprintf(stderr, "Error initializing server resources\n");
+        exit(EXIT_FAILURE);
+    }
     
     server_socket = initialize_server_socket(server_port);
     if (server_socket < 0) {
@@ -549,7 +646,26 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
     
-    if (pthread_create(&acceptor_thread, NULL, manager_thread, &server_socket) != 0) {
+    if (pthread_create(&stats_thread, NULL, stats_reporter, NULL) != 0) {
+        fprintf(stderr, "Error creating stats thread\n");
+        cleanup_resources(server_socket);
+        exit(EXIT_FAILURE);
+    }
+    stats_thread_started = 1;
+    
+    if (acceptor_open(&connection_acceptor, server_socket) != 0) {
+        fprintf(stderr, "Error creating the acceptor\n");
+        cleanup_resources(server_socket);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (start_workers() != 0) {
+        fprintf(stderr, "Error creating worker threads\n");
+        cleanup_resources(server_socket);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (pthread_create(&acceptor_thread, NULL, manager_thread, &connection_acceptor) != 0) {
         fprintf(stderr, "Error creating acceptor thread\n");
         close(server_socket);
         cleanup_resources(server_socket);
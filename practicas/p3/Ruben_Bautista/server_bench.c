@@ -0,0 +1,479 @@
+#include "stub.h"
+#include "persist.h"
+#include "wal.h"
+#include "policy.h"
+#include <sys/wait.h>
+#include <limits.h>
+#include <dirent.h>
+#include <math.h>
+
+/* server_bench starts ./server in a scratch directory, so it does not
+   touch server_output.txt, and runs N client threads against it. Each
+   thread sends M requests in a row, K per connection (one by default,
+   so every request pays for its own connection). It reports requests
+   per second, the rate the server would reach if the admitted threads
+   really ran in parallel (N over the mean simulated work of
+   MIN_SLEEP_MS..MAX_SLEEP_MS), and latency percentiles seen by the
+   clients.
+
+   With --mode reader, running it for growing N shows whether readers
+   admitted together by can_pass() overlap: the rate should grow with N
+   until it reaches the size of the server's worker pool, --workers.
+   Comparing --per-connection 1 with --per-connection M shows what the
+   handshakes cost. With --batch B every request is a BATCH frame of B
+   operations, and it also reports operations per second. At the end it
+   asks the server for its own latency percentiles with a STATS request.
+
+   --keys N spreads the requests over keys 0..N-1, drawn uniformly or,
+   with --skew zipf, by Zipf's law with exponent --zipf-s (key 0 the most
+   popular). Sweeping N with --mode writer shows how the per-shard gates
+   of the server let writers of unrelated keys proceed in parallel, and
+   how much of that a skewed key space takes back. */
+
+#define DEFAULT_PORT 7100
+#define MEAN_SLEEP_MS 112.5
+#define CONNECT_TIMEOUT_MS 5000
+
+char *server_path = "./server";
+int bench_port = DEFAULT_PORT;
+int bench_mode = 0;
+int bench_threads = 8;
+int bench_requests = 8;
+int bench_per_connection = 1;
+int bench_batch = 0;
+char *server_priority = "reader";
+char *server_workers = NULL;
+char *server_shards = NULL;
+int bench_keys = 1;
+int bench_zipf = 0;
+double zipf_s = 1.0;
+double *zipf_cdf = NULL;
+
+long *latency_samples;
+int *failed_requests;
+
+// elapsed_ns(): Nanoseconds between two CLOCK_MONOTONIC readings.
+long elapsed_ns(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+}
+
+// compare_samples(): qsort() order for latency samples.
+int compare_samples(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// remove_scratch(): Removes the files the server left in dir, and dir itself.
+void remove_scratch(char *dir) {
+    const char *names[] = {"server_output.txt", "server_output.txt.tmp", STATE_FILENAME, KEYS_FILENAME};
+    char path[PATH_MAX];
+    struct dirent *entry;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, WAL_DIRNAME);
+    DIR *listing = opendir(path);
+    if (listing != NULL) {
+        while ((entry = readdir(listing)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                snprintf(path, sizeof(path), "%s/%s/%s", dir, WAL_DIRNAME, entry->d_name);
+                unlink(path);
+            }
+        }
+        closedir(listing);
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, WAL_DIRNAME);
+    rmdir(path);
+    for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+// start_server(): Forks the server in dir and waits until it accepts connections.
+pid_t start_server(char *dir) {
+    char port[16];
+    char path[PATH_MAX];
+
+    if (realpath(server_path, path) == NULL) {
+        perror(server_path);
+        return -1;
+    }
+    snprintf(port, sizeof(port), "%d", bench_port);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        if (chdir(dir) != 0 || freopen("/dev/null", "w", stdout) == NULL) {
+            _exit(EXIT_FAILURE);
+        }
+        char *args[11] = {"server", "--port", port, "--priority", server_priority};
+        int arg_count = 5;
+        if (server_workers != NULL) {
+            args[arg_count++] = "--workers";
+            args[arg_count++] = server_workers;
+        }
+        if (server_shards != NULL) {
+            args[arg_count++] = "--shards";
+            args[arg_count++] = server_shards;
+        }
+        args[arg_count] = NULL;
+        execv(path, args);
+        _exit(EXIT_FAILURE);
+    }
+
+    // A connection without a request only costs the server one thread slot
+    for (int waited = 0; waited < CONNECT_TIMEOUT_MS; waited += 10) {
+        int probe = connect_to_server("127.0.0.1", bench_port);
+        if (probe >= 0) {
+            close_connection(probe);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            break;
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "server_bench: the server did not start on port %d\n", bench_port);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+// build_zipf(): Cumulative distribution of Zipf's law over bench_keys keys.
+int build_zipf(void) {
+    double sum = 0;
+
+    zipf_cdf = malloc(bench_keys * sizeof(double));
+    if (zipf_cdf == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < bench_keys; i++) {
+        sum += 1.0 / pow(i + 1, zipf_s);
+        zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < bench_keys; i++) {
+        zipf_cdf[i] /= sum;
+    }
+    return 0;
+}
+
+// pick_key(): Draws a key, uniformly or from the Zipf distribution.
+unsigned int pick_key(unsigned int *seed) {
+    double u = rand_r(seed) / ((double)RAND_MAX + 1);
+
+    if (!bench_zipf) {
+        return (unsigned int)(u * bench_keys);
+    }
+    int low = 0;
+    int high = bench_keys - 1;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (zipf_cdf[middle] > u) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+/* bench_thread(): Sends bench_requests requests, bench_per_connection
+   per session. A request's latency includes the connect that opened its
+   session, if any. */
+void *bench_thread(void *thread_id_ptr) {
+    int thread_id = *(int *)thread_id_ptr;
+    int client_socket = -1;
+    struct request req;
+    struct response resp;
+    struct timespec start, end;
+    struct request *items = NULL;
+    struct response *results = NULL;
+    unsigned int seed = thread_id + 1;
+
+    req.action = bench_mode == 0 ? READ : WRITE;
+    if (bench_batch > 0) {
+        items = malloc(bench_batch * sizeof(struct request));
+        results = malloc(bench_batch * sizeof(struct response));
+        if (items == NULL || results == NULL) {
+            failed_requests[thread_id] = bench_requests;
+            free(items);
+            free(results);
+            return NULL;
+        }
+        for (int i = 0; i < bench_batch; i++) {
+            items[i].action = req.action;
+            items[i].id = thread_id;
+        }
+    }
+
+    for (int i = 0; i < bench_requests; i++) {
+        long *sample = &latency_samples[thread_id * bench_requests + i];
+        *sample = -1;
+        req.id = thread_id * bench_requests + i;
+        req.key = pick_key(&seed);
+        for (int j = 0; j < bench_batch; j++) {
+            items[j].key = pick_key(&seed);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (client_socket < 0) {
+            client_socket = connect_to_server("127.0.0.1", bench_port);
+            if (client_socket < 0) {
+                failed_requests[thread_id]++;
+                continue;
+            }
+        }
+        int answered;
+        if (bench_batch > 0) {
+            struct request header = req;
+            answered = send_batch(client_socket, &header, items, bench_batch) > 0 &&
+                       receive_batch_response(client_socket, &resp, results, bench_batch) == bench_batch;
+        } else {
+            answered = send_request(client_socket, &req) > 0 && receive_response(client_socket, &resp) > 0;
+        }
+        if (!answered || resp.id != req.id) {
+            failed_requests[thread_id]++;
+            close_connection(client_socket);
+            client_socket = -1;
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        *sample = elapsed_ns(start, end);
+        // A WRITE the server could not make durable is answered, but it failed
+        int refused = bench_batch == 0 && resp.action == FAILED;
+        for (int j = 0; j < bench_batch; j++) {
+            refused |= results[j].action == FAILED;
+        }
+        if (refused) {
+            failed_requests[thread_id]++;
+        }
+
+        if ((i + 1) % bench_per_connection == 0) {
+            close_connection(client_socket);
+            client_socket = -1;
+        }
+    }
+    close_connection(client_socket);
+    free(items);
+    free(results);
+    return NULL;
+}
+
+// fetch_server_latency(): Gets the server's latency rows with a STATS request. Returns their count, or -1.
+int fetch_server_latency(struct latency_row *rows, int max) {
+    struct request req = {STATS, 0};
+    struct response resp;
+    int count = -1;
+
+    int client_socket = connect_to_server("127.0.0.1", bench_port);
+    if (client_socket >= 0 && send_request(client_socket, &req) > 0) {
+        count = receive_stats_response(client_socket, &resp, rows, max);
+    }
+    close_connection(client_socket);
+    return count;
+}
+
+// parse_bench_arguments(): Parses command-line arguments for the benchmark.
+int parse_bench_arguments(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"server", required_argument, 0, 's'},
+        {"port", required_argument, 0, 'p'},
+        {"priority", required_argument, 0, 'r'},
+        {"mode", required_argument, 0, 'm'},
+        {"threads", required_argument, 0, 't'},
+        {"requests", required_argument, 0, 'n'},
+        {"workers", required_argument, 0, 'w'},
+        {"per-connection", required_argument, 0, 'k'},
+        {"batch", required_argument, 0, 'b'},
+        {"shards", required_argument, 0, 'h'},
+        {"keys", required_argument, 0, 'K'},
+        {"skew", required_argument, 0, 'z'},
+        {"zipf-s", required_argument, 0, 'Z'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "s:p:r:m:t:n:w:k:b:h:K:z:Z:", long_options, NULL)) != -1) {
+        if (opt == 's') {
+            server_path = optarg;
+        } else if (opt == 'p') {
+            bench_port = atoi(optarg);
+        } else if (opt == 'r') {
+            if (policy_lookup(optarg) == NULL) {
+                return -1;
+            }
+            server_priority = optarg;
+        } else if (opt == 'm') {
+            if (strcmp(optarg, "reader") == 0) {
+                bench_mode = 0;
+            } else if (strcmp(optarg, "writer") == 0) {
+                bench_mode = 1;
+            } else {
+                return -1;
+            }
+        } else if (opt == 't') {
+            bench_threads = atoi(optarg);
+        } else if (opt == 'n') {
+            bench_requests = atoi(optarg);
+        } else if (opt == 'w') {
+            if (atoi(optarg) <= 0) {
+                return -1;
+            }
+            server_workers = optarg;
+        } else if (opt == 'k') {
+            bench_per_connection = atoi(optarg);
+        } else if (opt == 'b') {
+            bench_batch = atoi(optarg);
+            if (bench_batch <= 0 || bench_batch > MAX_BATCH_SIZE) {
+                return -1;
+            }
+        } else if (opt == 'h') {
+            if (atoi(optarg) <= 0) {
+                return -1;
+            }
+            server_shards = optarg;
+        } else if (opt == 'K') {
+            bench_keys = atoi(optarg);
+        } else if (opt == 'z') {
+            if (strcmp(optarg, "uniform") == 0) {
+                bench_zipf = 0;
+            } else if (strcmp(optarg, "zipf") == 0) {
+                bench_zipf = 1;
+            } else {
+                return -1;
+            }
+        } else if (opt == 'Z') {
+            zipf_s = atof(optarg);
+        } else {
+            return -1;
+        }
+    }
+
+    if (bench_port <= 0 || bench_threads <= 0 || bench_requests <= 0 || bench_per_connection <= 0 ||
+        bench_keys <= 0 || zipf_s <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char dir[] = "/tmp/server_bench.XXXXXX";
+    struct timespec start, end;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (parse_bench_arguments(argc, argv) != 0) {
+        fprintf(stderr, "Usage: %s [--server PATH] [--port PORT] [--priority " POLICY_NAMES "] "
+                "[--mode reader/writer] [--threads N] [--requests M] [--workers N] "
+                "[--per-connection K] [--batch B] [--shards N] [--keys N] [--skew uniform/zipf] "
+                "[--zipf-s S]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (bench_zipf && build_zipf() != 0) {
+        fprintf(stderr, "server_bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    long total = (long)bench_threads * bench_requests;
+    pthread_t *threads = malloc(bench_threads * sizeof(pthread_t));
+    int *thread_ids = malloc(bench_threads * sizeof(int));
+    latency_samples = malloc(total * sizeof(long));
+    failed_requests = calloc(bench_threads, sizeof(int));
+    if (threads == NULL || thread_ids == NULL || latency_samples == NULL || failed_requests == NULL) {
+        fprintf(stderr, "server_bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t server_pid = start_server(dir);
+    if (server_pid < 0) {
+        remove_scratch(dir);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < bench_threads; i++) {
+        thread_ids[i] = i;
+        if (pthread_create(&threads[i], NULL, bench_thread, &thread_ids[i]) != 0) {
+            fprintf(stderr, "server_bench: thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < bench_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    struct latency_row rows[LATENCY_METRICS * 2];
+    int row_count = fetch_server_latency(rows, LATENCY_METRICS * 2);
+
+    kill(server_pid, SIGINT);
+    waitpid(server_pid, NULL, 0);
+    remove_scratch(dir);
+
+    long count = 0;
+    long failed = 0;
+    for (long i = 0; i < total; i++) {
+        if (latency_samples[i] >= 0) {
+            latency_samples[count++] = latency_samples[i];
+        }
+    }
+    for (int i = 0; i < bench_threads; i++) {
+        failed += failed_requests[i];
+    }
+    qsort(latency_samples, count, sizeof(long), compare_samples);
+
+    double seconds = elapsed_ns(start, end) / 1e9;
+    // Writers of different keys overlap at best once per key
+    int parallel = bench_mode == 0 || bench_keys > bench_threads ? bench_threads : bench_keys;
+    if (server_workers != NULL && atoi(server_workers) < parallel) {
+        parallel = atoi(server_workers);
+    }
+    double ideal = parallel / (MEAN_SLEEP_MS / 1e3);
+    printf("%s clients %d, %d requests each, %d per connection, server priority %s, %s workers\n",
+           bench_mode == 0 ? "reader" : "writer", bench_threads, bench_requests, bench_per_connection,
+           server_priority,
+           server_workers != NULL ? server_workers : "default");
+    if (bench_keys > 1 && bench_zipf) {
+        printf("  keys          %d, zipf s=%.2f, %s shards\n", bench_keys, zipf_s,
+               server_shards != NULL ? server_shards : "default");
+    } else if (bench_keys > 1) {
+        printf("  keys          %d, uniform, %s shards\n", bench_keys,
+               server_shards != NULL ? server_shards : "default");
+    }
+    printf("  requests      %ld in %.3f s = %.1f req/s (%.1f if admitted threads overlap), %ld failed\n",
+           count, seconds, count / seconds, ideal, failed);
+    if (bench_batch > 0) {
+        printf("  operations    %ld in batches of %d = %.0f ops/s\n",
+               count * bench_batch, bench_batch, count * bench_batch / seconds);
+    }
+    if (count > 0) {
+        printf("  latency (ms)  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+               latency_samples[count / 2] / 1e6, latency_samples[count * 90 / 100] / 1e6,
+               latency_samples[count * 99 / 100] / 1e6, latency_samples[count - 1] / 1e6);
+    }
+    for (int i = 0; i < row_count; i++) {
+        if (rows[i].count > 0) {
+            printf("  server %s %-10s  p50 %.3f  p99 %.3f  p99.9 %.3f  max %.3f (ms, %lu ops)\n",
+                   rows[i].action == READ ? "reader" : "writer", latency_metric_name(rows[i].metric),
+                   rows[i].p50_ns / 1e6, rows[i].p99_ns / 1e6, rows[i].p999_ns / 1e6, rows[i].max_ns / 1e6,
+                   rows[i].count);
+        }
+    }
+
+    free(threads);
+    free(thread_ids);
+    free(latency_samples);
+    free(failed_requests);
+    free(zipf_cdf);
+    return failed == 0 ? 0 : 1;
+}
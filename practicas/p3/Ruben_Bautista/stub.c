@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "stub.h"
 
 // initialize_server_socket(): Initializes a server socket
@@ -34,48 +35,103 @@ int initialize_server_socket(int port) {
     return server_socket;
 }
 
-// wait_for_client_with_select(): Waits for client connection using select
-int wait_for_client_connection(int server_socket, int timeout_sec, volatile int *running) {
-    struct timeval timeout;
-    fd_set read_fds;
-    int ready;
-    int total_timeout = timeout_sec * 1000;
-    int step_timeout = 100;
+// acceptor_open(): Makes the listening socket non-blocking and watches it with epoll
+int acceptor_open(struct acceptor *acceptor, int server_socket) {
+    struct epoll_event event;
+    int flags;
 
-    while (total_timeout > 0 && *running) {
-        FD_ZERO(&read_fds);
-        FD_SET(server_socket, &read_fds);
+    acceptor->server_socket = server_socket;
+    acceptor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    acceptor->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (acceptor->epoll_fd < 0 || acceptor->stop_fd < 0) {
+        acceptor_close(acceptor);
+        return -1;
+    }
+
+    flags = fcntl(server_socket, F_GETFL, 0);
+    if (flags < 0 || fcntl(server_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        acceptor_close(acceptor);
+        return -1;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = server_socket;
+    if (epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_ADD, server_socket, &event) < 0) {
+        acceptor_close(acceptor);
+        return -1;
+    }
+    event.data.fd = acceptor->stop_fd;
+    if (epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_ADD, acceptor->stop_fd, &event) < 0) {
+        acceptor_close(acceptor);
+        return -1;
+    }
+    return 0;
+}
 
-        timeout.tv_sec = 0;
-        timeout.tv_usec = step_timeout * 1000;
+/* acceptor_wait(): Sleeps until connections arrive and accepts up to max of
+   them, draining the accept queue until EAGAIN. Returns how many it
+   accepted, 0 once acceptor_stop() was called, or -1 on error. The
+   accepted sockets are blocking. */
+int acceptor_wait(struct acceptor *acceptor, int *client_sockets, int max) {
+    struct epoll_event events[2];
+    int count = 0;
 
-        ready = select(server_socket + 1, &read_fds, NULL, NULL, &timeout);
-        
-        // Check the result of select. If interrupted, continue; if error, sleep and retry
+    while (count == 0) {
+        int ready = epoll_wait(acceptor->epoll_fd, events, 2, -1);
         if (ready < 0) {
             if (errno == EINTR) {
                 continue;
-            } else {
-                usleep(step_timeout * 1000);
             }
-        } else if (ready > 0) {
-            if (FD_ISSET(server_socket, &read_fds)) {
-                int client_socket = accept_client_connection(server_socket);
-                if (client_socket < 0) {
-                    if (errno != EINTR) {
-                        usleep(step_timeout * 1000);
-                    }
-                    return -1;
+            return -1;
+        }
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.fd == acceptor->stop_fd) {
+                return 0;
+            }
+        }
+
+        while (count < max) {
+            int client_socket = accept4(acceptor->server_socket, NULL, NULL, SOCK_CLOEXEC);
+            if (client_socket >= 0) {
+                client_sockets[count++] = client_socket;
+            } else if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else {
+                // Out of descriptors or memory: retry shortly unless something was accepted
+                if (errno != EAGAIN && errno != EWOULDBLOCK && count == 0) {
+                    usleep(ACCEPT_BACKOFF_US);
                 }
-                return client_socket;
+                break;
             }
         }
+    }
+    return count;
+}
 
-        total_timeout -= step_timeout;
+/* acceptor_stop(): Wakes acceptor_wait() for good. It only writes to the
+   eventfd, so it can be called from a signal handler. */
+void acceptor_stop(struct acceptor *acceptor) {
+    uint64_t one = 1;
+
+    // A write can only fail if the counter is saturated, that is, already stopped
+    if (acceptor->stop_fd >= 0 && write(acceptor->stop_fd, &one, sizeof(one)) < 0) {
+        return;
     }
+}
 
-    return -1;
+// acceptor_close(): Releases the epoll instance and the eventfd
+void acceptor_close(struct acceptor *acceptor) {
+    if (acceptor->epoll_fd >= 0) {
+        close(acceptor->epoll_fd);
+        acceptor->epoll_fd = -1;
+    }
+    if (acceptor->stop_fd >= 0) {
+        close(acceptor->stop_fd);
+        acceptor->stop_fd = -1;
+    }
 }
+
 // accept_client_connection(): Accepts an incoming client connection
 int accept_client_connection(int server_socket) {
     int client_socket;
@@ -114,6 +170,87 @@ int connect_to_server(char *server_ip, int port) {
     return client_socket;
 }
 
+// wait_for_data(): Waits for data on a socket. Returns 1 if readable (or closed), 0 on timeout
+int wait_for_data(int socket, int timeout_ms) {
+    struct pollfd pfd = {socket, POLLIN, 0};
+    
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    return ready;
+}
+
+// send_all(): Sends a whole buffer over a socket
+static int send_all(int socket, const void *buffer, size_t length, int flags) {
+    const char *ptr = buffer;
+    size_t remaining_bytes = length;
+    
+    while (remaining_bytes > 0) {
+        ssize_t bytes_sent = send(socket, ptr, remaining_bytes, flags | MSG_NOSIGNAL);
+        if (bytes_sent <= 0) {
+            return -1;
+        }
+        ptr += bytes_sent;
+        remaining_bytes -= bytes_sent;
+    }
+    
+    return 0;
+}
+
+/* deadline_after(): Sets deadline to timeout_ms from now on the
+ monotonic clock. A negative timeout_ms leaves it unset.*/
+static void deadline_after(struct timespec *deadline, int timeout_ms) {
+    if (timeout_ms < 0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// ms_until(): Milliseconds left until deadline, rounded up; 0 once it passed
+static int ms_until(const struct timespec *deadline) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long left_ns = (deadline->tv_sec - now.tv_sec) * 1000000000L + deadline->tv_nsec - now.tv_nsec;
+    return left_ns > 0 ? (int)((left_ns + 999999) / 1000000) : 0;
+}
+
+/* receive_all(): Receives exactly length bytes from a socket. With a
+ deadline, every read waits at most until it and the call fails once it
+ passed; a signal interrupting the wait does not extend it.*/
+static int receive_all(int socket, void *buffer, size_t length, const struct timespec *deadline) {
+    char *ptr = buffer;
+    size_t remaining_bytes = length;
+    
+    while (remaining_bytes > 0) {
+        while (deadline != NULL) {
+            int left = ms_until(deadline);
+            int ready = left > 0 ? wait_for_data(socket, left) : -1;
+            if (ready < 0) {
+                return -1;
+            }
+            if (ready > 0) {
+                break;
+            }
+        }
+        ssize_t bytes_received = recv(socket, ptr, remaining_bytes, 0);
+        if (bytes_received <= 0) {
+            return -1;
+        }
+        ptr += bytes_received;
+        remaining_bytes -= bytes_received;
+    }
+    
+    return 0;
+}
+
 // send_request(): Sends a request structure over a socket
 int send_request(int socket, struct request *req) {
     char *request_ptr = (char *)req;
@@ -133,23 +270,17 @@ int send_request(int socket, struct request *req) {
     return total_sent;
 }
 
-// receive_request(): Receives a request structure from a socket
-int receive_request(int socket, struct request *req) {
-    char *request_ptr = (char *)req;
-    int remaining_bytes = sizeof(struct request);
-    int total_received = 0;
+/* receive_request(): Receives a request structure from a socket. With a
+ non-negative timeout_ms, fails unless the whole request arrives within
+ timeout_ms.*/
+int receive_request(int socket, struct request *req, int timeout_ms) {
+    struct timespec deadline;
     
-    while (remaining_bytes > 0) {
-        int bytes_received = recv(socket, request_ptr, remaining_bytes, 0);
-        if (bytes_received <= 0) {
-            return -1;
-        }
-        request_ptr += bytes_received;
-        remaining_bytes -= bytes_received;
-        total_received += bytes_received;
+    deadline_after(&deadline, timeout_ms);
+    if (receive_all(socket, req, sizeof(struct request), timeout_ms >= 0 ? &deadline : NULL) != 0) {
+        return -1;
     }
-    
-    return total_received;
+    return sizeof(struct request);
 }
 
 // send_response(): Sends a response structure over a socket
@@ -195,4 +326,89 @@ void close_connection(int socket) {
     if (socket >= 0) {
         close(socket);
     }
-}
\ No newline at end of file
+}
+
+/* send_batch(): Sends a BATCH request with count items. MSG_MORE keeps
+ the header, the count and the items in the same segments. */
+int send_batch(int socket, struct request *header, struct request *items, unsigned int count) {
+    header->action = BATCH;
+    if (send_all(socket, header, sizeof(struct request), MSG_MORE) != 0 ||
+        send_all(socket, &count, sizeof(count), count > 0 ? MSG_MORE : 0) != 0 ||
+        send_all(socket, items, count * sizeof(struct request), 0) != 0) {
+        return -1;
+    }
+    return count;
+}
+
+/* receive_batch(): Receives the items of a BATCH request whose header was
+ already read with receive_request(). The count and the items must all
+ arrive within timeout_ms. Returns their count, possibly 0, or -1 if the
+ connection failed, the time ran out, or the batch is bigger than max. */
+int receive_batch(int socket, struct request *items, unsigned int max, int timeout_ms) {
+    struct timespec deadline;
+    unsigned int count;
+    
+    deadline_after(&deadline, timeout_ms);
+    const struct timespec *until = timeout_ms >= 0 ? &deadline : NULL;
+    if (receive_all(socket, &count, sizeof(count), until) != 0 || count > max ||
+        receive_all(socket, items, count * sizeof(struct request), until) != 0) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        if (items[i].action != READ && items[i].action != WRITE) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+// send_batch_response(): Sends the BATCH response header and one response per item
+int send_batch_response(int socket, struct response *header, struct response *items, unsigned int count) {
+    header->action = BATCH;
+    header->counter = count;
+    if (send_all(socket, header, sizeof(struct response), count > 0 ? MSG_MORE : 0) != 0 ||
+        send_all(socket, items, count * sizeof(struct response), 0) != 0) {
+        return -1;
+    }
+    return count;
+}
+
+// receive_batch_response(): Receives a BATCH response. Returns the item count, or -1
+int receive_batch_response(int socket, struct response *header, struct response *items, unsigned int max) {
+    if (receive_all(socket, header, sizeof(struct response), NULL) != 0 || header->action != BATCH ||
+        header->counter > max || receive_all(socket, items, header->counter * sizeof(struct response), NULL) != 0) {
+        return -1;
+    }
+    return header->counter;
+}
+
+// latency_metric_name(): Name of a latency metric, for reports
+const char *latency_metric_name(enum latency_metric metric) {
+    static const char *names[] = {"queue wait", "critical", "total"};
+    
+    if (metric < 0 || metric >= LATENCY_METRICS) {
+        return "?";
+    }
+    return names[metric];
+}
+
+// send_stats_response(): Sends the STATS response header and its latency rows
+int send_stats_response(int socket, struct response *header, struct latency_row *rows, unsigned int count) {
+    header->action = STATS;
+    header->counter = count;
+    header->latency_time = 0;
+    if (send_all(socket, header, sizeof(struct response), MSG_MORE) != 0 ||
+        send_all(socket, rows, count * sizeof(struct latency_row), 0) != 0) {
+        return -1;
+    }
+    return count;
+}
+
+// receive_stats_response(): Receives a STATS response. Returns the row count, or -1
+int receive_stats_response(int socket, struct response *header, struct latency_row *rows, unsigned int max) {
+    if (receive_all(socket, header, sizeof(struct response), NULL) != 0 || header->action != STATS ||
+        header->counter > max || receive_all(socket, rows, header->counter * sizeof(struct latency_row), NULL) != 0) {
+        return -1;
+    }
+    return header->counter;
+}
@@ -15,36 +15,105 @@
 #include <getopt.h>
 #include <signal.h>
 #include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+#define ACCEPT_BACKOFF_US 1000
+#define MAX_BATCH_SIZE 4096
 
 enum operations {
     WRITE = 0,
-    READ
+    READ,
+    BATCH,
+    STATS,
+    FAILED
+};
+
+enum latency_metric {
+    QUEUE_WAIT = 0,
+    CRITICAL_SECTION,
+    TOTAL_TIME,
+    LATENCY_METRICS
 };
 
+/* A connection is a session: the client may send any number of requests
+   on it, and the server answers each one with a response carrying the
+   same id, in order, until the client closes it. key selects the
+   counter; key 0 is the one kept in server_output.txt.
+
+   A BATCH request is followed by an unsigned int count (at most
+   MAX_BATCH_SIZE, possibly 0) and count READ/WRITE requests, which must
+   all arrive within the server's poll interval. Its answer is a BATCH
+   response with the same id, counter = count and latency_time = the
+   total time the batch waited to enter, followed by one response per
+   item, in order.
+
+   A WRITE the server could not apply or make durable gets a FAILED
+   response (counter = 0) in place of the WRITE one, in a batch too.
+
+   A STATS request gets a STATS response with counter = the number of
+   latency rows that follow: one per READ/WRITE class and metric, with
+   the server's percentiles since it started. */
 struct request {
     enum operations action;
     unsigned int id;
+    unsigned int key;
 };
 
 struct response {
     enum operations action;
+    unsigned int id;
     unsigned int counter;
     long latency_time;
 };
 
+struct latency_row {
+    enum operations action;
+    enum latency_metric metric;
+    unsigned long count;
+    long p50_ns;
+    long p99_ns;
+    long p999_ns;
+    long max_ns;
+};
+
+struct acceptor {
+    int server_socket;
+    int epoll_fd;
+    int stop_fd;
+};
+
 // Server socket functions
 int initialize_server_socket(int port);
 int accept_client_connection(int server_socket);
-int wait_for_client_connection(int server_socket, int timeout_sec, volatile int *running);
+int acceptor_open(struct acceptor *acceptor, int server_socket);
+int acceptor_wait(struct acceptor *acceptor, int *client_sockets, int max);
+void acceptor_stop(struct acceptor *acceptor);
+void acceptor_close(struct acceptor *acceptor);
 
 // Client socket functions  
 int connect_to_server(char *server_ip, int port);
 
 // Communication functions
+int wait_for_data(int socket, int timeout_ms);
 int send_request(int socket, struct request *req);
-int receive_request(int socket, struct request *req);
+int receive_request(int socket, struct request *req, int timeout_ms);
 int send_response(int socket, struct response *resp);
 int receive_response(int socket, struct response *resp);
 void close_connection(int socket);
 
+// Batch functions
+int send_batch(int socket, struct request *header, struct request *items, unsigned int count);
+int receive_batch(int socket, struct request *items, unsigned int max, int timeout_ms);
+int send_batch_response(int socket, struct response *header, struct response *items, unsigned int count);
+int receive_batch_response(int socket, struct response *header, struct response *items, unsigned int max);
+
+// Stats functions
+const char *latency_metric_name(enum latency_metric metric);
+int send_stats_response(int socket, struct response *header, struct latency_row *rows, unsigned int count);
+int receive_stats_response(int socket, struct response *header, struct latency_row *rows, unsigned int max);
+
 #endif
\ No newline at end of file
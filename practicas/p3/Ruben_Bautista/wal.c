@@ -0,0 +1,381 @@
+#include "wal.h"
+#include "persist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define WAL_READ_RECORDS 2048
+
+// Record of a version 1 segment, from before keys: every WRITE went to key 0
+struct wal_record_v1 {
+    uint32_t checksum;
+    uint32_t length;
+    uint64_t lsn;
+    uint32_t request_id;
+    int32_t value;
+    int64_t timestamp_ns;
+};
+
+static char wal_dir[4096];
+static int dir_fd = -1;
+static int segment_fd = -1;
+static off_t segment_size = 0;
+static uint64_t next_lsn = 1;
+
+// First LSN of every segment, oldest first; the last one is open for appending
+static uint64_t *segments = NULL;
+static int segment_count = 0;
+static int segment_capacity = 0;
+
+// record_checksum(): CRC-32 of a record from its length on.
+static uint32_t record_checksum(const struct wal_record *record) {
+    return persist_crc32((const char *)record + sizeof(record->checksum), sizeof(*record) - sizeof(record->checksum));
+}
+
+// segment_path(): Path of the segment whose first record is first_lsn.
+static void segment_path(char *path, size_t size, uint64_t first_lsn) {
+    snprintf(path, size, "%s/%016llx.wal", wal_dir, (unsigned long long)first_lsn);
+}
+
+// compare_lsn(): qsort() order for segment LSNs.
+static int compare_lsn(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// add_segment(): Appends first_lsn to the segment list.
+static int add_segment(uint64_t first_lsn) {
+    if (segment_count == segment_capacity) {
+        int capacity = segment_capacity ? segment_capacity * 2 : 16;
+        uint64_t *grown = realloc(segments, capacity * sizeof(uint64_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        segments = grown;
+        segment_capacity = capacity;
+    }
+    segments[segment_count++] = first_lsn;
+    return 0;
+}
+
+// remove_segments(): Deletes segments from index first on.
+static void remove_segments(int first) {
+    char path[4200];
+
+    for (int i = first; i < segment_count; i++) {
+        segment_path(path, sizeof(path), segments[i]);
+        unlink(path);
+    }
+    segment_count = first;
+    fsync(dir_fd);
+}
+
+// valid_segment_header(): Checks the magic and checksum of a segment header.
+static int valid_segment_header(const struct wal_segment_header *header) {
+    return header->magic == WAL_MAGIC &&
+           header->checksum == persist_crc32(header, offsetof(struct wal_segment_header, checksum));
+}
+
+/* reset_tail(): Discards whatever follows offset in the open segment and
+   preallocates it again, so stale records past the end of the log can
+   never line up with the LSNs written next. */
+static int reset_tail(off_t offset) {
+    if (ftruncate(segment_fd, offset) != 0 || posix_fallocate(segment_fd, 0, WAL_SEGMENT_SIZE) != 0) {
+        return -1;
+    }
+    return fsync(segment_fd);
+}
+
+/* open_segment(): Creates and preallocates a new segment starting at
+   first_lsn, with its header synced before any record goes in. */
+static int open_segment(uint64_t first_lsn) {
+    struct wal_segment_header header;
+    char path[4200];
+
+    memset(&header, 0, sizeof(header));
+    header.magic = WAL_MAGIC;
+    header.version = WAL_VERSION;
+    header.record_size = sizeof(struct wal_record);
+    header.first_lsn = first_lsn;
+    header.checksum = persist_crc32(&header, offsetof(struct wal_segment_header, checksum));
+
+    segment_path(path, sizeof(path), first_lsn);
+    segment_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (segment_fd < 0) {
+        return -1;
+    }
+    if (reset_tail(0) != 0 || pwrite(segment_fd, &header, sizeof(header), 0) != sizeof(header) ||
+        fdatasync(segment_fd) != 0 || add_segment(first_lsn) != 0 || fsync(dir_fd) != 0) {
+        close(segment_fd);
+        segment_fd = -1;
+        return -1;
+    }
+    segment_size = sizeof(header);
+    return 0;
+}
+
+/* convert_record(): Fills record from the version 1 record at data.
+   Returns -1 if data does not hold a valid one. */
+static int convert_record(const unsigned char *data, struct wal_record *record) {
+    struct wal_record_v1 old;
+
+    memcpy(&old, data, sizeof(old));
+    if (old.length != sizeof(old) ||
+        old.checksum != persist_crc32((const char *)&old + sizeof(old.checksum), sizeof(old) - sizeof(old.checksum))) {
+        return -1;
+    }
+    memset(record, 0, sizeof(*record));
+    record->length = sizeof(struct wal_record);
+    record->lsn = old.lsn;
+    record->request_id = old.request_id;
+    record->value = old.value;
+    record->timestamp_ns = old.timestamp_ns;
+    record->checksum = record_checksum(record);
+    return 0;
+}
+
+/* replay_segment(): Reads the records of segment index from *expected on
+   and hands each one to replay, converting those of a version 1 segment.
+   Sets *version to the version of the segment, 0 if its header is torn.
+   Returns the offset where the log ends in this segment, or -1 if it
+   could not be read or has a version this server does not know. */
+static off_t replay_segment(int index, uint64_t *expected, void (*replay)(const struct wal_record *record),
+                            int *version) {
+    unsigned char buffer[WAL_READ_RECORDS * sizeof(struct wal_record)];
+    struct wal_segment_header header;
+    struct wal_record converted;
+    char path[4200];
+    off_t offset = 0;
+
+    segment_path(path, sizeof(path), segments[index]);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    *version = 1;
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == WAL_MAGIC) {
+        if (!valid_segment_header(&header)) {
+            *version = 0;
+            close(fd);
+            return 0;
+        }
+        if (header.version != WAL_VERSION || header.record_size != sizeof(struct wal_record)) {
+            fprintf(stderr, "wal: %s has format version %u, this server reads versions 1 and %d\n",
+                    path, header.version, WAL_VERSION);
+            close(fd);
+            return -1;
+        }
+        *version = WAL_VERSION;
+        offset = sizeof(header);
+    }
+    size_t record_size = *version == 1 ? sizeof(struct wal_record_v1) : sizeof(struct wal_record);
+
+    while (1) {
+        ssize_t bytes = pread(fd, buffer, WAL_READ_RECORDS * record_size, offset);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            close(fd);
+            return -1;
+        }
+        int count = bytes / record_size;
+        for (int i = 0; i < count; i++) {
+            struct wal_record *record = (struct wal_record *)(buffer + i * record_size);
+            if (*version == 1) {
+                record = convert_record(buffer + i * record_size, &converted) == 0 ? &converted : NULL;
+            }
+            if (record == NULL || record->length != sizeof(struct wal_record) || record->lsn != *expected ||
+                record->checksum != record_checksum(record)) {
+                close(fd);
+                return offset;
+            }
+            replay(record);
+            (*expected)++;
+            offset += record_size;
+        }
+        if (count < WAL_READ_RECORDS) {
+            close(fd);
+            return offset;
+        }
+    }
+}
+
+/* wal_open(): Hands every record of the log to replay, oldest first, and
+   opens it for appending after them; the caller skips those its
+   snapshots cover. The log ends at the first invalid record or gap in
+   the LSNs; what follows is dropped, and so is a log that ends before
+   snapshot_lsn. Appends never go to a segment of an older version: the
+   log continues in a new one. On return *last_lsn is the LSN of the last
+   record. */
+int wal_open(const char *dir, uint64_t snapshot_lsn, uint64_t *last_lsn, void (*replay)(const struct wal_record *record)) {
+    unsigned long long first_lsn;
+    struct dirent *entry;
+    off_t end = 0;
+    int version = WAL_VERSION;
+    long converted = 0;
+    int length;
+
+    snprintf(wal_dir, sizeof(wal_dir), "%s", dir);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    DIR *listing = opendir(dir);
+    if (dir_fd < 0 || listing == NULL) {
+        if (listing != NULL) {
+            closedir(listing);
+        }
+        wal_close();
+        return -1;
+    }
+    while ((entry = readdir(listing)) != NULL) {
+        if (sscanf(entry->d_name, "%16llx.wal%n", &first_lsn, &length) == 1 && length == 20 &&
+            entry->d_name[length] == '\0' && add_segment(first_lsn) != 0) {
+            closedir(listing);
+            wal_close();
+            return -1;
+        }
+    }
+    closedir(listing);
+    qsort(segments, segment_count, sizeof(uint64_t), compare_lsn);
+
+    next_lsn = segment_count > 0 ? segments[0] : 1;
+    for (int i = 0; i < segment_count; i++) {
+        if (segments[i] != next_lsn) {
+            remove_segments(i);
+            break;
+        }
+        uint64_t first = next_lsn;
+        end = replay_segment(i, &next_lsn, replay, &version);
+        if (end < 0) {
+            wal_close();
+            return -1;
+        }
+        if (version == 1) {
+            converted += next_lsn - first;
+        }
+    }
+    if (converted > 0) {
+        fprintf(stderr, "wal: read %ld records of version 1 segments as WRITEs to key 0\n", converted);
+    }
+
+    // A log the snapshot is ahead of cannot be continued; start a new segment
+    if (next_lsn <= snapshot_lsn) {
+        next_lsn = snapshot_lsn + 1;
+        remove_segments(0);
+    }
+    // An old or torn segment with no records is replaced, not followed
+    if (segment_count > 0 && version != WAL_VERSION && segments[segment_count - 1] == next_lsn) {
+        segment_count--;
+    }
+    if (segment_count == 0 || version != WAL_VERSION) {
+        if (open_segment(next_lsn) != 0) {
+            wal_close();
+            return -1;
+        }
+    } else {
+        char path[4200];
+        segment_path(path, sizeof(path), segments[segment_count - 1]);
+        segment_fd = open(path, O_WRONLY);
+        segment_size = end;
+        if (segment_fd < 0 || reset_tail(end) != 0) {
+            wal_close();
+            return -1;
+        }
+    }
+    *last_lsn = next_lsn - 1;
+    return 0;
+}
+
+// write_chunk(): Writes count numbered records at the end of the open segment.
+static int write_chunk(struct wal_record *records, int count) {
+    size_t length = count * sizeof(struct wal_record);
+    size_t written = 0;
+
+    while (written < length) {
+        ssize_t bytes = pwrite(segment_fd, (char *)records + written, length - written, segment_size + written);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            reset_tail(segment_size);
+            return -1;
+        }
+        written += bytes;
+    }
+    segment_size += length;
+    next_lsn += count;
+    return 0;
+}
+
+/* wal_append(): Numbers the records, writes them to the log with one
+   pwrite per segment they land in and makes them durable with
+   fdatasync. A segment is synced before the log moves to the next one. */
+int wal_append(struct wal_record *records, int count) {
+    int done = 0;
+
+    for (int i = 0; i < count; i++) {
+        records[i].length = sizeof(struct wal_record);
+        records[i].lsn = next_lsn + i;
+        records[i].checksum = record_checksum(&records[i]);
+    }
+    while (done < count) {
+        int room = (WAL_SEGMENT_SIZE - segment_size) / (off_t)sizeof(struct wal_record);
+        if (room <= 0) {
+            if (fdatasync(segment_fd) != 0) {
+                return -1;
+            }
+            close(segment_fd);
+            if (open_segment(next_lsn) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        int chunk = count - done < room ? count - done : room;
+        if (write_chunk(records + done, chunk) != 0) {
+            return -1;
+        }
+        done += chunk;
+    }
+    return fdatasync(segment_fd);
+}
+
+/* wal_trim(): Deletes the oldest closed segments beyond WAL_KEEP_SEGMENTS,
+   as long as the snapshot at snapshot_lsn covers all their records. */
+void wal_trim(uint64_t snapshot_lsn) {
+    char path[4200];
+    int removed = 0;
+
+    while (segment_count - 1 - removed > WAL_KEEP_SEGMENTS && segments[removed + 1] - 1 <= snapshot_lsn) {
+        segment_path(path, sizeof(path), segments[removed]);
+        unlink(path);
+        removed++;
+    }
+    if (removed > 0) {
+        memmove(segments, segments + removed, (segment_count - removed) * sizeof(uint64_t));
+        segment_count -= removed;
+        fsync(dir_fd);
+    }
+}
+
+// wal_close(): Closes the log.
+void wal_close(void) {
+    if (segment_fd >= 0) {
+        close(segment_fd);
+        segment_fd = -1;
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+        dir_fd = -1;
+    }
+    free(segments);
+    segments = NULL;
+    segment_count = segment_capacity = 0;
+}
@@ -0,0 +1,56 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+
+/* Write-ahead log of the WRITEs applied to the counters. Records go to
+   segment files in WAL_DIRNAME, named after the LSN (log sequence number)
+   of their first record in hex. LSNs start at 1 and have no gaps. A batch
+   that does not fit in WAL_SEGMENT_SIZE continues in a new segment. Closed
+   segments are kept for auditing until a snapshot covers them and there
+   are more than WAL_KEEP_SEGMENTS of them.
+
+   Every segment starts with a wal_segment_header naming the format
+   version of its records; the records follow it. Segments of version 1,
+   written before there were headers or keys, start straight with their
+   32-byte records: recovery reads them as WRITEs to key 0 and the log
+   continues in a new segment. A segment of any other version stops the
+   server, which cannot read it.
+
+   Records are fixed-size and in native byte order. key is the counter the
+   WRITE went to and value the one it left. checksum is the CRC-32 of the
+   record from length on, so recovery stops at the first torn or corrupt
+   record and drops it and anything after it. */
+#define WAL_DIRNAME "server_wal"
+#define WAL_SEGMENT_SIZE (1024 * 1024)
+#define WAL_KEEP_SEGMENTS 4
+#define WAL_MAGIC 0x4C415733u
+#define WAL_VERSION 2
+
+// checksum is the CRC-32 of the header up to it
+struct wal_segment_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t first_lsn;
+    uint32_t reserved;
+    uint32_t checksum;
+};
+
+struct wal_record {
+    uint32_t checksum;
+    uint32_t length;
+    uint64_t lsn;
+    uint32_t request_id;
+    uint32_t key;
+    int32_t value;
+    uint32_t reserved;
+    int64_t timestamp_ns;
+};
+
+int wal_open(const char *dir, uint64_t snapshot_lsn, uint64_t *last_lsn, void (*replay)(const struct wal_record *record));
+int wal_append(struct wal_record *records, int count);
+void wal_trim(uint64_t snapshot_lsn);
+void wal_close(void);
+
+#endif
@@ -0,0 +1,212 @@
+#include "persist.h"
+#include "wal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+
+/* wal_bench measures how many WRITEs per second the persistence layer of
+   the server takes: N threads increment counters under a mutex, as
+   manage_request() does, hand every value to persist_update() and, once
+   out of the mutex, wait in persist_wait() for it to be durable, with no
+   simulated work. Each thread has one write in flight, so a group commit
+   holds at most N writes. The writes go to --keys counters in turn, key
+   0 first. The time runs until persist_close() returns. It reports the rate, how many writes each log append
+   carried, and the snapshots taken, and then reopens the files in the
+   scratch directory to check that recovery returns the last value of
+   every key. */
+
+#define DEFAULT_WRITES 200000
+
+int bench_threads = 4;
+long bench_writes = DEFAULT_WRITES;
+int sync_every = DEFAULT_SYNC_EVERY;
+int sync_ms = DEFAULT_SYNC_MS;
+int snapshot_every = DEFAULT_SNAPSHOT_EVERY;
+int bench_keys = 1;
+
+pthread_mutex_t counter_mutex = PTHREAD_MUTEX_INITIALIZER;
+int *counters = NULL;
+int *recovered_counters = NULL;
+long writes_left;
+long unconfirmed_writes;
+
+// elapsed_ns(): Nanoseconds between two CLOCK_MONOTONIC readings.
+long elapsed_ns(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+}
+
+/* writer_thread(): Increments the counter, logs it and waits for it to be
+   durable until the writes run out. */
+void *writer_thread(void *thread_id_ptr) {
+    unsigned int thread_id = *(int *)thread_id_ptr;
+    struct persist_ticket ticket;
+
+    while (1) {
+        pthread_mutex_lock(&counter_mutex);
+        if (writes_left == 0) {
+            pthread_mutex_unlock(&counter_mutex);
+            return NULL;
+        }
+        unsigned int key = writes_left-- % bench_keys;
+        counters[key]++;
+        persist_update(thread_id, key, counters[key], &ticket);
+        pthread_mutex_unlock(&counter_mutex);
+        if (persist_wait(&ticket) != 0) {
+            __atomic_fetch_add(&unconfirmed_writes, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// restore_counter(): Takes a key recovered by persist_open().
+int restore_counter(unsigned int key, int value) {
+    if (key >= bench_keys) {
+        return -1;
+    }
+    recovered_counters[key] = value;
+    return 0;
+}
+
+// remove_scratch(): Removes the files left in dir, and dir itself.
+void remove_scratch(char *dir) {
+    char path[PATH_MAX];
+    struct dirent *entry;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, WAL_DIRNAME);
+    DIR *listing = opendir(path);
+    if (listing != NULL) {
+        while ((entry = readdir(listing)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                snprintf(path, sizeof(path), "%s/%s/%s", dir, WAL_DIRNAME, entry->d_name);
+                unlink(path);
+            }
+        }
+        closedir(listing);
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, WAL_DIRNAME);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/%s", dir, STATE_FILENAME);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%s", dir, KEYS_FILENAME);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/server_output.txt", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+// parse_bench_arguments(): Parses command-line arguments for the benchmark.
+int parse_bench_arguments(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"threads", required_argument, 0, 't'},
+        {"writes", required_argument, 0, 'w'},
+        {"sync-every", required_argument, 0, 'e'},
+        {"sync-ms", required_argument, 0, 's'},
+        {"snapshot-every", required_argument, 0, 'n'},
+        {"keys", required_argument, 0, 'k'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "t:w:e:s:n:k:", long_options, NULL)) != -1) {
+        if (opt == 't') {
+            bench_threads = atoi(optarg);
+        } else if (opt == 'w') {
+            bench_writes = atol(optarg);
+        } else if (opt == 'e') {
+            sync_every = atoi(optarg);
+        } else if (opt == 's') {
+            sync_ms = atoi(optarg);
+        } else if (opt == 'n') {
+            snapshot_every = atoi(optarg);
+        } else if (opt == 'k') {
+            bench_keys = atoi(optarg);
+        } else {
+            return -1;
+        }
+    }
+    if (bench_threads <= 0 || bench_writes <= 0 || bench_writes > INT_MAX || sync_every <= 0 ||
+        sync_ms < 0 || snapshot_every <= 0 || bench_keys <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char dir[] = "/tmp/wal_bench.XXXXXX";
+    struct timespec start, end;
+    struct persist_stats stats;
+
+    if (parse_bench_arguments(argc, argv) != 0) {
+        fprintf(stderr, "Usage: %s [--threads N] [--writes M] [--sync-every N] [--sync-ms T] "
+                "[--snapshot-every N] [--keys N]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    counters = calloc(bench_keys, sizeof(int));
+    recovered_counters = calloc(bench_keys, sizeof(int));
+    if (counters == NULL || recovered_counters == NULL) {
+        fprintf(stderr, "wal_bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        perror("wal_bench: scratch directory");
+        exit(EXIT_FAILURE);
+    }
+    if (persist_open("server_output.txt", STATE_FILENAME, KEYS_FILENAME, WAL_DIRNAME, &counters[0], NULL) != 0 ||
+        persist_start(sync_every, sync_ms, snapshot_every) != 0) {
+        perror("wal_bench: persist_open");
+        remove_scratch(dir);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t *threads = malloc(bench_threads * sizeof(pthread_t));
+    int *thread_ids = malloc(bench_threads * sizeof(int));
+    if (threads == NULL || thread_ids == NULL) {
+        fprintf(stderr, "wal_bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    writes_left = bench_writes;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < bench_threads; i++) {
+        thread_ids[i] = i;
+        if (pthread_create(&threads[i], NULL, writer_thread, &thread_ids[i]) != 0) {
+            fprintf(stderr, "wal_bench: thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < bench_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    persist_close();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    persist_get_stats(&stats);
+
+    int ok = persist_open("server_output.txt", STATE_FILENAME, KEYS_FILENAME, WAL_DIRNAME,
+                          &recovered_counters[0], restore_counter) == 0 && stats.failures == 0 &&
+             unconfirmed_writes == 0;
+    persist_close();
+    int mismatched = 0;
+    for (int i = 0; i < bench_keys; i++) {
+        if (recovered_counters[i] != counters[i]) {
+            mismatched++;
+        }
+    }
+    ok = ok && mismatched == 0;
+    remove_scratch(dir);
+
+    double seconds = elapsed_ns(start, end) / 1e9;
+    printf("wal %d threads, %ld writes to %d keys, sync every %d writes or %d ms, snapshot every %d\n",
+           bench_threads, bench_writes, bench_keys, sync_every, sync_ms, snapshot_every);
+    printf("  writes        %lu in %.3f s = %.0f writes/s, %lu failed\n",
+           stats.records, seconds, stats.records / seconds, stats.failures);
+    printf("  appends       %lu (%.1f writes each), %lu snapshots\n",
+           stats.appends, stats.appends ? (double)stats.records / stats.appends : 0.0, stats.snapshots);
+    printf("  recovery      %s (key 0 %d, wrote %d; %d of %d keys differ)\n", ok ? "ok" : "FAILED",
+           recovered_counters[0], counters[0], mismatched, bench_keys);
+    return ok ? 0 : 1;
+}